@@ -10,13 +10,16 @@
 #include <bootrom.h>
 #include <common.h>
 #include <fcntl.h>
-#include <gelf.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-error zynq_bootrom_init_offs(uint32_t *img_ptr, int hdr_count, bootrom_offs_t *offs) {
-  (void) hdr_count;
+error zynq_bootrom_init_offs(uint32_t *img_ptr,
+                               uint32_t imgs_count,
+                               uint32_t parts_count,
+                               bootrom_offs_t *offs) {
+  uint32_t hdrs_end;
+
   /* Copy the image pointer */
   offs->img_ptr = img_ptr;
 
@@ -26,6 +29,22 @@ error zynq_bootrom_init_offs(uint32_t *img_ptr, int hdr_count, bootrom_offs_t *o
   offs->part_hdr_end_off = BOOTROM_PART_HDR_END_PADD;
   offs->bins_off = BOOTROM_BINS_OFF;
 
+  /* The constant offsets leave room for 14 partitions, the boot header
+   * points at the tables, so move them further if there are more */
+  hdrs_end = offs->img_hdr_off + sizeof(bootrom_img_hdr_tab_t) +
+             sizeof(bootrom_img_hdr_t) * imgs_count;
+  while (offs->part_hdr_off < hdrs_end)
+    offs->part_hdr_off += BOOTROM_IMG_PADDING_SIZE;
+
+  hdrs_end = offs->part_hdr_off + sizeof(bootrom_partition_hdr_t) * parts_count +
+             BOOTROM_PART_HDR_END_PADD;
+  while (offs->bins_off < hdrs_end)
+    offs->bins_off += BOOTROM_IMG_PADDING_SIZE;
+
+  /* There is nothing to point at when only planning the layout */
+  if (!img_ptr)
+    return SUCCESS;
+
   /* Move the offset to reserve the space for headers */
   offs->poff = (offs->img_hdr_off) / sizeof(uint32_t) + img_ptr;
   offs->coff = (offs->bins_off) / sizeof(uint32_t) + img_ptr;
@@ -81,9 +100,10 @@ error zynq_bootrom_setup_fsbl_at_curr_off(bootrom_hdr_t *hdr,
 
 error zynq_bootrom_init_img_hdr_tab(bootrom_img_hdr_tab_t *img_hdr_tab,
                                     bootrom_img_hdr_t *img_hdr,
+                                    uint32_t imgs_count,
                                     bootrom_partition_hdr_t *ihdr,
                                     bootrom_offs_t *offs) {
-  unsigned int i;
+  unsigned int i, j, first;
   uint32_t img_hdr_size = 0;
 
   /* Retrieve the header */
@@ -93,28 +113,25 @@ error zynq_bootrom_init_img_hdr_tab(bootrom_img_hdr_tab_t *img_hdr_tab,
   /* Call the common code */
   bootrom_init_img_hdr_tab(img_hdr_tab, offs);
 
-  for (i = 0; i < img_hdr_tab->hdrs_count; i++) {
+  for (i = 0; i < imgs_count; i++) {
     img_hdr_size = sizeof(img_hdr[i]) / sizeof(uint32_t);
     memset(&img_hdr[i].padding, 0xFF, sizeof(img_hdr->padding));
 
     /* Calculate the next img hdr offsets */
-    if (i + 1 == img_hdr_tab->hdrs_count) {
+    if (i + 1 == imgs_count) {
       img_hdr[i].next_img_off = 0x0;
     } else {
       img_hdr[i].next_img_off = offs->poff + img_hdr_size - offs->img_ptr;
     }
 
-    img_hdr[i].part_hdr_off = (offs->part_hdr_off / sizeof(uint32_t)) +
-                              (i * sizeof(bootrom_partition_hdr_t) / sizeof(uint32_t));
-
     /* Write the actual img_hdr data */
     memcpy(offs->poff, &(img_hdr[i]), sizeof(img_hdr[i]));
 
-    /* Keep the offset for later use */
-    part_hdr[i].img_hdr_off = (offs->poff - offs->img_ptr);
-
-    /* Calculate the checksum */
-    part_hdr[i].checksum = calc_checksum(&(part_hdr[i].pd_len), &(part_hdr[i].checksum) - 1);
+    /* Keep the offset in all the partitions of the image for later use */
+    first = (img_hdr[i].part_hdr_off - offs->part_hdr_off / sizeof(uint32_t)) /
+            (sizeof(bootrom_partition_hdr_t) / sizeof(uint32_t));
+    for (j = first; j < first + img_hdr[i].name_len; j++)
+      part_hdr[j].img_hdr_off = (offs->poff - offs->img_ptr);
 
     if (i == 0) {
       img_hdr_tab->part_img_hdr_off = (offs->poff - offs->img_ptr);
@@ -123,6 +140,10 @@ error zynq_bootrom_init_img_hdr_tab(bootrom_img_hdr_tab_t *img_hdr_tab,
     offs->poff += img_hdr_size;
   }
 
+  /* Calculate the checksums */
+  for (j = 0; j < img_hdr_tab->hdrs_count; j++)
+    part_hdr[j].checksum = calc_checksum(&(part_hdr[j].pd_len), &(part_hdr[j].checksum) - 1);
+
   /* Fill the partition header offset in img header */
   img_hdr_tab->part_hdr_off = offs->part_hdr_off / sizeof(uint32_t);
 
@@ -159,8 +180,8 @@ error zynq_init_part_hdr_dtb(bootrom_partition_hdr_t *ihdr, bif_node_t *node) {
 error zynq_init_part_hdr_elf(bootrom_partition_hdr_t *ihdr,
                              bif_node_t *node,
                              uint32_t *size,
-                             uint32_t load,
-                             uint32_t entry,
+                             uint64_t load,
+                             uint64_t entry,
                              uint8_t nbits) {
   /* Handle unused parameters warning */
   (void) node;
@@ -171,6 +192,10 @@ error zynq_init_part_hdr_elf(bootrom_partition_hdr_t *ihdr,
   bootrom_partition_hdr_zynq_t *hdr;
   hdr = (bootrom_partition_hdr_zynq_t *) ihdr;
 
+  /* There are no high address words on Zynq */
+  if (load > UINT32_MAX || entry > UINT32_MAX)
+    return ERROR_BOOTROM_ELF;
+
   /* Set the load and execution address */
   hdr->dest_load_addr = load;
   hdr->dest_exec_addr = entry;
@@ -262,6 +287,33 @@ error zynq_finish_part_hdr(bootrom_partition_hdr_t *ihdr,
   return SUCCESS;
 }
 
+error zynq_read_part_hdr(bootrom_partition_hdr_t *ihdr, bif_node_t *node, uint32_t *data_off) {
+  /* Retrieve the header */
+  bootrom_partition_hdr_zynq_t *hdr;
+  hdr = (bootrom_partition_hdr_zynq_t *) ihdr;
+
+  /* The load address is the only attribute that can't be
+   * recovered from the partition data itself */
+  node->load = hdr->dest_load_addr;
+
+  *data_off = hdr->data_off;
+  return SUCCESS;
+}
+
+error zynq_relink_part_hdr(bootrom_partition_hdr_t *ihdr, bootrom_partition_hdr_t *iold) {
+  /* Retrieve the headers */
+  bootrom_partition_hdr_zynq_t *hdr, *old;
+  hdr = (bootrom_partition_hdr_zynq_t *) ihdr;
+  old = (bootrom_partition_hdr_zynq_t *) iold;
+
+  hdr->img_hdr_off = old->img_hdr_off;
+
+  /* Recalculate the checksum */
+  hdr->checksum = calc_checksum(&(hdr->pd_len), &(hdr->checksum) - 1);
+
+  return SUCCESS;
+}
+
 /* Define ops */
 bootrom_ops_t zynq_bops = {
   .init_offs = zynq_bootrom_init_offs,
@@ -274,5 +326,9 @@ bootrom_ops_t zynq_bops = {
   .init_part_hdr_bitstream = zynq_init_part_hdr_bitstream,
   .init_part_hdr_linux = zynq_init_part_hdr_linux,
   .finish_part_hdr = zynq_finish_part_hdr,
-  .append_null_part = 0 /* Zynq does not use null part */
+  .read_part_hdr = zynq_read_part_hdr,
+  .relink_part_hdr = zynq_relink_part_hdr,
+  .append_null_part = 0, /* Zynq does not use null part */
+  .append_bitstream_noop = 1,
+  .pmufw_in_header = 0,
 };
@@ -16,7 +16,10 @@
 
 #define BOOTROM_ZYNQMP_OFFSET_AFTER_HEADERS 0x40
 
-error zynqmp_bootrom_init_offs(uint32_t *img_ptr, int hdr_count, bootrom_offs_t *offs) {
+error zynqmp_bootrom_init_offs(uint32_t *img_ptr,
+                                 uint32_t imgs_count,
+                                 uint32_t parts_count,
+                                 bootrom_offs_t *offs) {
   /* Copy the image pointer */
   offs->img_ptr = img_ptr;
 
@@ -24,10 +27,14 @@ error zynqmp_bootrom_init_offs(uint32_t *img_ptr, int hdr_count, bootrom_offs_t
   offs->img_hdr_off = BOOTROM_IMG_HDR_OFF;
   offs->part_hdr_end_off = 0; /* Not needed by zynqmp */
   offs->part_hdr_off =
-    offs->img_hdr_off + sizeof(bootrom_img_hdr_tab_t) + sizeof(bootrom_img_hdr_t) * hdr_count;
-  offs->bins_off = offs->part_hdr_off + sizeof(bootrom_partition_hdr_t) * hdr_count +
+    offs->img_hdr_off + sizeof(bootrom_img_hdr_tab_t) + sizeof(bootrom_img_hdr_t) * imgs_count;
+  offs->bins_off = offs->part_hdr_off + sizeof(bootrom_partition_hdr_t) * parts_count +
                    BOOTROM_ZYNQMP_OFFSET_AFTER_HEADERS;
 
+  /* There is nothing to point at when only planning the layout */
+  if (!img_ptr)
+    return SUCCESS;
+
   /* Move the offset to reserve the space for headers */
   offs->poff = (offs->img_hdr_off) / sizeof(uint32_t) + img_ptr;
   offs->coff = (offs->bins_off) / sizeof(uint32_t) + img_ptr;
@@ -98,9 +105,10 @@ error zynqmp_bootrom_setup_fsbl_at_curr_off(bootrom_hdr_t *hdr,
 
 error zynqmp_bootrom_init_img_hdr_tab(bootrom_img_hdr_tab_t *img_hdr_tab,
                                       bootrom_img_hdr_t *img_hdr,
+                                      uint32_t imgs_count,
                                       bootrom_partition_hdr_t *ihdr,
                                       bootrom_offs_t *offs) {
-  unsigned int i;
+  unsigned int i, j, first;
   uint32_t img_hdr_size = 0;
 
   bootrom_partition_hdr_zynqmp_t *part_hdr;
@@ -109,37 +117,25 @@ error zynqmp_bootrom_init_img_hdr_tab(bootrom_img_hdr_tab_t *img_hdr_tab,
   /* Call the common code */
   bootrom_init_img_hdr_tab(img_hdr_tab, offs);
 
-  for (i = 0; i < img_hdr_tab->hdrs_count; i++) {
+  for (i = 0; i < imgs_count; i++) {
     img_hdr_size = sizeof(img_hdr[i]) / sizeof(uint32_t);
     memset(&img_hdr[i].padding, 0xFF, sizeof(img_hdr->padding));
 
-    img_hdr[i].part_hdr_off = (offs->part_hdr_off / sizeof(uint32_t)) +
-                              (i * sizeof(bootrom_partition_hdr_t) / sizeof(uint32_t));
-
     /* Calculate the next img hdr offsets */
-    if (i + 1 == img_hdr_tab->hdrs_count) {
+    if (i + 1 == imgs_count) {
       img_hdr[i].next_img_off = 0x0;
     } else {
       img_hdr[i].next_img_off = offs->poff + img_hdr_size - offs->img_ptr;
     }
 
-    part_hdr[i].next_part_hdr_off = 0x0;
-    if (i > 0) {
-      part_hdr[i - 1].next_part_hdr_off = img_hdr[i].part_hdr_off;
-      part_hdr[i - 1].checksum =
-        calc_checksum(&(part_hdr[i - 1].pd_len), &(part_hdr[i - 1].checksum) - 1);
-    }
-
     /* Write the actual img_hdr data */
     memcpy(offs->poff, &(img_hdr[i]), sizeof(img_hdr[i]));
 
-    /* Keep the offset for later use */
-    part_hdr[i].img_hdr_off = (offs->poff - offs->img_ptr);
-
-    /* Calculate the checksum if this is the last header*/
-    if (i + 1 == img_hdr_tab->hdrs_count) {
-      part_hdr[i].checksum = calc_checksum(&(part_hdr[i].pd_len), &(part_hdr[i].checksum) - 1);
-    }
+    /* Keep the offset in all the partitions of the image for later use */
+    first = (img_hdr[i].part_hdr_off - offs->part_hdr_off / sizeof(uint32_t)) /
+            (sizeof(bootrom_partition_hdr_t) / sizeof(uint32_t));
+    for (j = first; j < first + img_hdr[i].name_len; j++)
+      part_hdr[j].img_hdr_off = (offs->poff - offs->img_ptr);
 
     if (i == 0) {
       img_hdr_tab->part_img_hdr_off = (offs->poff - offs->img_ptr);
@@ -148,6 +144,17 @@ error zynqmp_bootrom_init_img_hdr_tab(bootrom_img_hdr_tab_t *img_hdr_tab,
     offs->poff += img_hdr_size;
   }
 
+  /* Chain the partition headers and calculate their checksums */
+  for (j = 0; j < img_hdr_tab->hdrs_count; j++) {
+    part_hdr[j].next_part_hdr_off = 0x0;
+    if (j + 1 < img_hdr_tab->hdrs_count) {
+      part_hdr[j].next_part_hdr_off =
+        (offs->part_hdr_off + (j + 1) * sizeof(bootrom_partition_hdr_t)) / sizeof(uint32_t);
+    }
+
+    part_hdr[j].checksum = calc_checksum(&(part_hdr[j].pd_len), &(part_hdr[j].checksum) - 1);
+  }
+
   /* Fill the partition header offset in img header */
   img_hdr_tab->part_hdr_off = offs->part_hdr_off / sizeof(uint32_t);
 
@@ -189,8 +196,8 @@ error zynqmp_init_part_hdr_default(bootrom_partition_hdr_t *ihdr, bif_node_t *no
 error zynqmp_init_part_hdr_elf(bootrom_partition_hdr_t *ihdr,
                                bif_node_t *node,
                                uint32_t *size,
-                               uint32_t load,
-                               uint32_t entry,
+                               uint64_t load,
+                               uint64_t entry,
                                uint8_t nbits) {
   /* Retrieve the header */
   bootrom_partition_hdr_zynqmp_t *hdr;
@@ -198,7 +205,9 @@ error zynqmp_init_part_hdr_elf(bootrom_partition_hdr_t *ihdr,
 
   /* Set the load and execution address */
   hdr->dest_load_addr_lo = load;
+  hdr->dest_load_addr_hi = load >> 32;
   hdr->dest_exec_addr_lo = entry;
+  hdr->dest_exec_addr_hi = entry >> 32;
 
   /* Size needs to be rounded after conversion to words  */
   *size = (*size + 3) & ~3u;
@@ -305,6 +314,38 @@ error zynqmp_finish_part_hdr(bootrom_partition_hdr_t *ihdr,
   return SUCCESS;
 }
 
+error zynqmp_read_part_hdr(bootrom_partition_hdr_t *ihdr, bif_node_t *node, uint32_t *data_off) {
+  /* Retrieve the header */
+  bootrom_partition_hdr_zynqmp_t *hdr;
+  hdr = (bootrom_partition_hdr_zynqmp_t *) ihdr;
+
+  /* Recover the attributes zynqmp_calc_part_hdr_attr put there,
+   * the rest of them depends on the partition data */
+  node->load = hdr->dest_load_addr_lo;
+  node->partition_owner = hdr->attributes & BOOTROM_PART_ATTR_OWNER_MASK;
+  node->destination_device = hdr->attributes & BOOTROM_PART_ATTR_DEST_DEV_MASK;
+  node->destination_cpu = hdr->attributes & BOOTROM_PART_ATTR_DEST_CPU_MASK;
+  node->exception_level = hdr->attributes & BOOTROM_PART_ATTR_EXC_LVL_MASK;
+
+  *data_off = hdr->actual_part_off;
+  return SUCCESS;
+}
+
+error zynqmp_relink_part_hdr(bootrom_partition_hdr_t *ihdr, bootrom_partition_hdr_t *iold) {
+  /* Retrieve the headers */
+  bootrom_partition_hdr_zynqmp_t *hdr, *old;
+  hdr = (bootrom_partition_hdr_zynqmp_t *) ihdr;
+  old = (bootrom_partition_hdr_zynqmp_t *) iold;
+
+  hdr->next_part_hdr_off = old->next_part_hdr_off;
+  hdr->img_hdr_off = old->img_hdr_off;
+
+  /* Recalculate the checksum */
+  hdr->checksum = calc_checksum(&(hdr->pd_len), &(hdr->checksum) - 1);
+
+  return SUCCESS;
+}
+
 /* Define ops */
 bootrom_ops_t zynqmp_bops = {
   .init_offs = zynqmp_bootrom_init_offs,
@@ -317,5 +358,9 @@ bootrom_ops_t zynqmp_bops = {
   .init_part_hdr_bitstream = zynqmp_init_part_hdr_bitstream,
   .init_part_hdr_linux = zynqmp_init_part_hdr_linux,
   .finish_part_hdr = zynqmp_finish_part_hdr,
-  .append_null_part = 1 /* yes */
+  .read_part_hdr = zynqmp_read_part_hdr,
+  .relink_part_hdr = zynqmp_relink_part_hdr,
+  .append_null_part = 1, /* yes */
+  .append_bitstream_noop = 0,
+  .pmufw_in_header = 1,
 };
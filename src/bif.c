@@ -36,13 +36,17 @@
 #include <common.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
 static int perrorf(lexer_t *lex, const char *fmt, ...);
 
+static error deinit_lexer(lexer_t *lex);
+
 static inline char *get_token_name(int type);
 
-static inline void update_pos(lexer_t *lex, char ch);
-static inline error append_token(lexer_t *lex, char ch);
+static inline void update_pos(lexer_t *lex, size_t end);
 
 static error bif_scan(lexer_t *lex);
 static inline error bif_consume(lexer_t *lex, int type);
@@ -54,15 +58,50 @@ static const char *special_chars = ":{}[],=\\";
 
 /* errorf equivalent for parser errors */
 static int perrorf(lexer_t *lex, const char *fmt, ...) {
-  int n;
+  char msg[512];
   va_list args;
 
   va_start(args, fmt);
-  fprintf(stderr, "error: %s:%d:%d: ", lex->fname, lex->line, lex->column);
-  n = vfprintf(stderr, fmt, args);
+  vsnprintf(msg, sizeof(msg), fmt, args);
   va_end(args);
 
-  return n;
+  return errorf("%s:%d:%d: %s", lex->fname, lex->line, lex->column, msg);
+}
+
+/* Strings are kept in chunks of at least this many bytes */
+#define BIF_STR_CHUNK_SIZE 16384
+
+/* Reserve len bytes in a string arena, they stay valid until it is freed */
+static char *str_arena_alloc(bif_str_chunk_t **arena, size_t len) {
+  bif_str_chunk_t *chunk = *arena;
+  size_t cap;
+  char *ret;
+
+  /* Start a new chunk if the string doesn't fit in the current one */
+  if (!chunk || chunk->cap - chunk->len < len) {
+    cap = len > BIF_STR_CHUNK_SIZE ? len : BIF_STR_CHUNK_SIZE;
+    if (!(chunk = malloc(sizeof(*chunk) + cap)))
+      return NULL;
+
+    chunk->next = *arena;
+    chunk->len = 0;
+    chunk->cap = cap;
+    *arena = chunk;
+  }
+
+  ret = chunk->data + chunk->len;
+  chunk->len += len;
+
+  return ret;
+}
+
+static void str_arena_free(bif_str_chunk_t **arena) {
+  bif_str_chunk_t *chunk;
+
+  while ((chunk = *arena)) {
+    *arena = chunk->next;
+    free(chunk);
+  }
 }
 
 error init_bif_cfg(bif_cfg_t *cfg) {
@@ -76,6 +115,9 @@ error init_bif_cfg(bif_cfg_t *cfg) {
     return ERROR_NOMEM;
   }
 
+  /* Strings are allocated on demand */
+  cfg->strings = NULL;
+
   return SUCCESS;
 }
 
@@ -84,27 +126,62 @@ error deinit_bif_cfg(bif_cfg_t *cfg) {
   cfg->nodes_avail = 0;
 
   free(cfg->nodes);
+  str_arena_free(&cfg->strings);
 
   return SUCCESS;
 }
 
-static error init_lexer(lexer_t *lex, const char *fname) {
-  error err;
+/* Read a BIF that can't be mapped (e.g. a pipe) into memory */
+static error read_stream(const char *fname, mapped_file_t *file) {
+  FILE *stream;
+  uint8_t *data = NULL, *tmp;
+  size_t cap = 0, n;
 
-  if (!(lex->file = fopen(fname, "r"))) {
+  if (!(stream = fopen(fname, "r"))) {
     errorf("could not open file \"%s\"\n", fname);
     return ERROR_BIF_NOFILE;
   }
 
+  file->size = 0;
+  do {
+    if (file->size == cap) {
+      cap = cap ? 2 * cap : 4096;
+      if (!(tmp = realloc(data, cap))) {
+        errorf("out of memory\n");
+        free(data);
+        fclose(stream);
+        return ERROR_NOMEM;
+      }
+      data = tmp;
+    }
+
+    n = fread(data + file->size, 1, cap - file->size, stream);
+    file->size += n;
+  } while (n > 0);
+
+  if (ferror(stream)) {
+    errorf("could not read file \"%s\"\n", fname);
+    free(data);
+    fclose(stream);
+    return ERROR_BIF_NOFILE;
+  }
+
+  fclose(stream);
+  file->data = data;
+
+  return SUCCESS;
+}
+
+/* Common part of the lexer initialization, once the BIF is in memory */
+static error start_lexer(lexer_t *lex, const char *fname) {
+  error err;
+
   lex->fname = malloc(strlen(fname) + 1);
   strcpy(lex->fname, fname);
 
   lex->line = lex->column = 1;
   lex->type = 0;
 
-  lex->len = lex->cap = 32;
-  lex->buffer = malloc(lex->cap * sizeof(char));
-
   /* Scan a first token
      as the lexer is assumed to always contain a next token
      information in the buffer and type attributes */
@@ -114,10 +191,62 @@ static error init_lexer(lexer_t *lex, const char *fname) {
   return SUCCESS;
 }
 
+static error init_lexer(lexer_t *lex, const char *fname) {
+  struct stat st;
+  error err;
+
+  memset(lex, 0, sizeof(*lex));
+
+  if (stat(fname, &st)) {
+    errorf("could not open file \"%s\"\n", fname);
+    return ERROR_BIF_NOFILE;
+  }
+
+  /* Tokens are slices of the file, so it has to be in memory as a whole */
+  if (S_ISREG(st.st_mode)) {
+    if (map_file(fname, &lex->file))
+      return ERROR_BIF_NOFILE;
+    lex->mapped = true;
+  } else if ((err = read_stream(fname, &lex->file))) {
+    return err;
+  }
+
+  if ((err = start_lexer(lex, fname)))
+    deinit_lexer(lex);
+
+  return err;
+}
+
+/* Same as above for a BIF given as text, the text is copied */
+static error init_lexer_text(lexer_t *lex, const char *name, const char *text, size_t len) {
+  uint8_t *data;
+  error err;
+
+  memset(lex, 0, sizeof(*lex));
+
+  if (!(data = malloc(len ? len : 1))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+  memcpy(data, text, len);
+
+  lex->file.data = data;
+  lex->file.size = len;
+
+  if ((err = start_lexer(lex, name)))
+    deinit_lexer(lex);
+
+  return err;
+}
+
 static error deinit_lexer(lexer_t *lex) {
-  fclose(lex->file);
+  if (lex->mapped)
+    unmap_file(&lex->file);
+  else
+    free((void *) lex->file.data);
+
   free(lex->fname);
-  free(lex->buffer);
+  str_arena_free(&lex->escaped);
 
   return SUCCESS;
 }
@@ -151,156 +280,157 @@ static inline char *get_token_name(int type) {
   return "unknown token";
 }
 
-static inline void update_pos(lexer_t *lex, char ch) {
-  /* Calculate the lexer position after reading ch */
+static inline void update_pos(lexer_t *lex, size_t end) {
+  /* Calculate the lexer position after reading the chars up to end */
+  const char *ptr = (const char *) lex->file.data + lex->pos;
+  const char *stop = (const char *) lex->file.data + end;
+  const char *nl;
 
-  if (ch == '\t') {
-    lex->column += 8;
-  } else if (ch == '\n') {
+  while ((nl = memchr(ptr, '\n', stop - ptr))) {
     lex->column = 1;
     lex->line++;
-  } else {
-    lex->column++;
+    ptr = nl + 1;
   }
+
+  for (; ptr < stop; ptr++)
+    lex->column += *ptr == '\t' ? 8 : 1;
+
+  lex->pos = end;
 }
 
-static inline error append_token(lexer_t *lex, char ch) {
-  lex->len++;
+/* Chars ending a string defined without " marks, '\0' included */
+static inline bool is_delim(char ch) {
+  return strchr(special_chars, ch) || isspace((unsigned char) ch);
+}
 
-  if (lex->len >= lex->cap) {
-    lex->cap = 2 * (lex->len);
-    lex->buffer = realloc(lex->buffer, lex->cap);
-    if (!lex->buffer) {
-      errorf("out of memory\n");
-      return ERROR_NOMEM;
-    }
+/* Scan a string delimited by ", the leading mark is at pos. Strings without
+ * escape sequences are just pointed at, the others are copied. */
+static error bif_scan_string(lexer_t *lex) {
+  const char *data = (const char *) lex->file.data;
+  size_t start = lex->pos + 1, end, i;
+  char *buffer;
+  size_t len = 0;
+
+  /* Most strings have no escapes, look for the end with a bulk scan */
+  for (end = start; end < lex->file.size; end++)
+    if (data[end] == '"' || data[end] == '\\')
+      break;
+
+  if (end < lex->file.size && data[end] == '"') {
+    lex->token.ptr = data + start;
+    lex->token.len = end - start;
+    update_pos(lex, end + 1);
+    return SUCCESS;
   }
 
-  lex->buffer[lex->len - 1] = ch;
-  lex->buffer[lex->len] = '\0';
-  return SUCCESS;
-}
+  /* Find the closing mark first, the string is only copied once its
+   * length is known as the unescaped one is never longer than that */
+  for (; end < lex->file.size && data[end] != '"'; end++)
+    if (data[end] == '\\')
+      end++;
 
-static inline error bif_scan_comment(lexer_t *lex, char type) {
-  int ch = 0, prev;
+  if (end >= lex->file.size) {
+    update_pos(lex, lex->file.size);
+    perrorf(lex, "file ended while scanning a string\n");
+    return ERROR_BIF_LEXER;
+  }
 
-  if (type == '*') {
-    for (;;) {
-      prev = ch;
-      /* Break if its the end of file */
-      if ((ch = fgetc(lex->file)) < 0) {
-        perrorf(lex, "file ended while scanning a C-style comment\n");
-        return ERROR_BIF_LEXER;
-      }
-      /* Break if its the end of the comment */
-      if (prev == '*' && ch == '/')
-        break;
-      update_pos(lex, ch);
+  if (!(buffer = str_arena_alloc(&lex->escaped, end - start))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  for (i = start; i < end; i++) {
+    if (data[i] == '\\' && data[++i] != '"') {
+      update_pos(lex, i);
+      perrorf(lex, "only escape for '\"' char is supported\n");
     }
-    /* Don't update the pos after the last ch, it will happen in bif_scan */
-  } else if (type == '/') {
-    while ((ch = fgetc(lex->file)) >= 0 && ch != '\n')
-      update_pos(lex, ch);
-    /* Don't update the pos after the last ch, it will happen in bif_scan */
+    buffer[len++] = data[i];
   }
+
+  /* Give back what the escapes took */
+  lex->escaped->len -= end - start - len;
+
+  lex->token.ptr = buffer;
+  lex->token.len = len;
+  update_pos(lex, end + 1);
+
   return SUCCESS;
 }
 
 static error bif_scan(lexer_t *lex) {
   /* Scan a single token from a BIF file */
-
-  int ch = 0, prev, err;
-  bool esc = false;
+  const char *data = (const char *) lex->file.data;
+  size_t size = lex->file.size;
+  size_t pos = lex->pos;
+  const char *ptr;
+  char ch;
 
   /* Skip white chars and comments */
   for (;;) {
-    prev = ch;
-    ch = fgetc(lex->file);
-
-    if (ch < 0) {
+    if (pos >= size) {
+      update_pos(lex, size);
       lex->type = TOKEN_EOF;
+      lex->token.ptr = data + size;
+      lex->token.len = 0;
       return SUCCESS;
-    } else if (prev == '/') {
-      if (ch == '/' || ch == '*') {
-        /* Update the pos before reading the comment */
-        update_pos(lex, ch);
-
-        if ((err = bif_scan_comment(lex, ch)))
-          return err;
-
-        /* Replace ch with a more neutral char than '/' and '*' */
-        ch = ch == '/' ? '\n' : ' ';
-      } else {
-        /* The char after initial '/' didn't start a comment,
-           so pretend it wasn't read */
-        ungetc(ch, lex->file);
-        ch = prev;
-        break;
+    }
+
+    ch = data[pos];
+    if (isspace((unsigned char) ch)) {
+      pos++;
+    } else if (ch == '/' && pos + 1 < size && data[pos + 1] == '/') {
+      /* Skip a C++-style comment up to the end of line */
+      ptr = memchr(data + pos + 2, '\n', size - pos - 2);
+      pos = ptr ? (size_t) (ptr - data) + 1 : size;
+    } else if (ch == '/' && pos + 1 < size && data[pos + 1] == '*') {
+      /* Skip a C-style comment, look for the '*' chars only */
+      for (pos += 2;; pos++) {
+        ptr = memchr(data + pos, '*', size - pos);
+        if (!ptr || (size_t) (ptr - data) + 1 >= size) {
+          update_pos(lex, size);
+          perrorf(lex, "file ended while scanning a C-style comment\n");
+          return ERROR_BIF_LEXER;
+        }
+        pos = ptr - data;
+        if (data[pos + 1] == '/')
+          break;
       }
-    } else if (prev == '*' && ch == '/') {
+      pos += 2;
+    } else if (ch == '/' && pos + 1 >= size) {
+      /* A trailing '/' is ignored */
+      pos++;
+    } else if (ch == '*' && pos + 1 < size && data[pos + 1] == '/') {
+      update_pos(lex, pos + 1);
       perrorf(lex, "comment end without start\n");
       return ERROR_BIF_LEXER;
-    } else if (ch == '/' || ch == '*') {
-      /* Ignore a single '/' as it might start a comment
-         '*' might end a comment that didn't start */
-      ;
-    } else if (!isspace(ch)) {
+    } else if (ch == '*') {
+      /* '*' might end a comment that didn't start, ignore it */
+      pos++;
+    } else {
       break;
     }
-
-    update_pos(lex, ch);
   }
 
-  lex->len = 0;
-
-  update_pos(lex, ch);
-  if ((err = append_token(lex, ch)))
-    return err;
+  update_pos(lex, pos);
 
   if (strchr(special_chars, ch)) {
     /* Parse a special character */
     lex->type = ch; /* This is why ASCII is skipped in the enum */
+    lex->token.ptr = data + pos;
+    lex->token.len = 1;
+    update_pos(lex, pos + 1);
   } else if (ch == '\"') {
-    /* Scan a string delimited by " */
-
-    /* Ignore the leading quotation mark */
-    lex->len = 0;
-
-    for (;;) {
-      ch = fgetc(lex->file);
-
-      if (ch < 0) {
-        perrorf(lex, "file ended while scanning a string\n");
-        return ERROR_BIF_LEXER;
-      } else if (ch == '\\') {
-        esc = true;
-        continue;
-      } else if (ch == '\"' && !esc) {
-        lex->type = TOKEN_NAME;
-        break;
-      } else if (esc) {
-        perrorf(lex, "only escape for '\"' char is supported\n");
-      }
-
-      update_pos(lex, ch);
-      if ((err = append_token(lex, ch)))
-        return err;
-    }
+    lex->type = TOKEN_NAME;
+    return bif_scan_string(lex);
   } else {
     /* Scan a string being defined without " marks */
-    for (;;) {
-      ch = fgetc(lex->file);
-
-      if (ch < 0 || strchr(special_chars, ch) || isspace(ch)) {
-        ungetc(ch, lex->file); /* we don't want that char */
-        lex->type = TOKEN_NAME;
-        break;
-      }
-
-      update_pos(lex, ch);
-      if ((err = append_token(lex, ch)))
-        return err;
-    }
+    lex->type = TOKEN_NAME;
+    lex->token.ptr = data + pos;
+    while (++pos < size && !is_delim(data[pos]))
+      ;
+    lex->token.len = data + pos - lex->token.ptr;
+    update_pos(lex, pos);
   }
 
   return SUCCESS;
@@ -338,6 +468,7 @@ static error bif_parse_file(lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node) {
   node->partition_owner = BOOTROM_PART_ATTR_OWNER_FSBL;
   node->destination_cpu = BOOTROM_PART_ATTR_DEST_CPU_NONE;
   node->destination_device = BOOTROM_PART_ATTR_DEST_DEV_NONE;
+  node->split_gap = BIF_SPLIT_GAP_DEFAULT;
   node->is_file = 1;
 
   /* Parse the attribute list if it's present */
@@ -359,7 +490,8 @@ static error bif_parse_file(lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node) {
   /* Expect a filename */
   if (lex->type != TOKEN_NAME)
     return bif_expect(lex, TOKEN_NAME);
-  strcpy(node->fname, lex->buffer);
+  if (!(node->fname = bif_cfg_add_string(cfg, lex->token.ptr, lex->token.len)))
+    return ERROR_NOMEM;
   if ((err = bif_consume(lex, TOKEN_NAME)))
     return err;
 
@@ -368,13 +500,13 @@ static error bif_parse_file(lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node) {
 
 static error bif_parse_attribute(lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node) {
   error err;
-  char *key = NULL, *value = NULL;
+  bif_str_t key, value;
+  bool has_value = false;
 
-  /* Parse an attribute name */
+  /* Parse an attribute name, tokens stay valid until the lexer is gone */
   if (lex->type != TOKEN_NAME)
     return bif_expect(lex, TOKEN_NAME);
-  key = malloc(lex->len);
-  strcpy(key, lex->buffer);
+  key = lex->token;
   if ((err = bif_consume(lex, TOKEN_NAME)))
     return err;
 
@@ -382,164 +514,241 @@ static error bif_parse_attribute(lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node)
   if (!bif_consume(lex, '=')) {
     if (lex->type != TOKEN_NAME)
       return bif_expect(lex, TOKEN_NAME);
-    value = malloc(lex->len);
-    strcpy(value, lex->buffer);
+    value = lex->token;
+    has_value = true;
     if ((err = bif_consume(lex, TOKEN_NAME)))
       return err;
   }
 
-  /* If the value wasn't present, it stays NULL */
-  err = bif_node_set_attr(lex, cfg, node, key, value);
-
-  free(key);
-  free(value);
-
-  return err;
+  /* If the value wasn't present, NULL is passed */
+  return bif_node_set_attr(lex, cfg, node, key, has_value ? &value : NULL);
 }
 
-error bif_parse(const char *fname, bif_cfg_t *cfg) {
+static error bif_parse_lexer(lexer_t *lex, bif_cfg_t *cfg) {
   error err;
-  lexer_t lex;
   bif_node_t node;
 
-  /* Initialize the lexer */
-  if ((err = init_lexer(&lex, fname)))
-    return err;
-
   /* First parse the name */
-  if ((err = bif_expect(&lex, TOKEN_NAME)))
+  if ((err = bif_expect(lex, TOKEN_NAME)))
     return err;
-  if ((err = bif_expect(&lex, ':')))
+  if ((err = bif_expect(lex, ':')))
     return err;
-  if ((err = bif_expect(&lex, '{')))
+  if ((err = bif_expect(lex, '{')))
     return err;
   /* Parse the file list */
   do {
-    if ((err = bif_parse_file(&lex, cfg, &node)))
+    if ((err = bif_parse_file(lex, cfg, &node)))
       return err;
     if ((err = bif_cfg_add_node(cfg, &node)))
       return err;
-  } while (lex.type == TOKEN_NAME || lex.type == '[');
-  if ((err = bif_expect(&lex, '}')))
+  } while (lex->type == TOKEN_NAME || lex->type == '[');
+  if ((err = bif_expect(lex, '}')))
     return err;
 
+  return SUCCESS;
+}
+
+error bif_parse(const char *fname, bif_cfg_t *cfg) {
+  error err;
+  lexer_t lex;
+
+  /* Initialize the lexer */
+  if ((err = init_lexer(&lex, fname)))
+    return err;
+
+  err = bif_parse_lexer(&lex, cfg);
   deinit_lexer(&lex);
+  if (err)
+    return err;
 
-  return SUCCESS;
+  /* Put the nodes in the order they will appear in the image */
+  return bif_cfg_sort_nodes(cfg);
+}
+
+/* Parse a BIF held in memory, name is only used in the error messages */
+error bif_parse_text(const char *name, const char *text, size_t len, bif_cfg_t *cfg) {
+  error err;
+  lexer_t lex;
+
+  if ((err = init_lexer_text(&lex, name, text, len)))
+    return err;
+
+  err = bif_parse_lexer(&lex, cfg);
+  deinit_lexer(&lex);
+  if (err)
+    return err;
+
+  return bif_cfg_sort_nodes(cfg);
+}
+
+/* printf arguments for a "%.*s" conversion of a bif_str_t */
+#define STR_ARG(str) (int) (str).len, (str).ptr
+
+static inline bool str_eq(bif_str_t str, const char *lit) {
+  return str.len == strlen(lit) && memcmp(str.ptr, lit, str.len) == 0;
+}
+
+/* Parse a '0xhhhhhhhh' value, up to 8 hex digits are used */
+static bool parse_hex32(bif_str_t *str, uint32_t *val) {
+  size_t i;
+  int digit;
+
+  if (str->len < 3 || str->ptr[0] != '0' || str->ptr[1] != 'x')
+    return false;
+
+  *val = 0;
+  for (i = 2; i < str->len && i < 10; i++) {
+    if (isdigit((unsigned char) str->ptr[i]))
+      digit = str->ptr[i] - '0';
+    else if (isxdigit((unsigned char) str->ptr[i]))
+      digit = tolower((unsigned char) str->ptr[i]) - 'a' + 10;
+    else
+      break;
+    *val = (*val << 4) | digit;
+  }
+
+  return i > 2;
+}
+
+typedef enum bif_attr_type_t
+{
+  BIF_ATTR_FLAG, /* takes no value, sets the uint8_t field to 0xFF */
+  BIF_ATTR_HEX,  /* a '0xhhhhhhhh' value for the uint32_t field */
+  BIF_ATTR_MASK, /* a name from the mask table, its mask goes to the uint32_t field */
+} bif_attr_type_t;
+
+/* Node attributes known to the parser */
+typedef struct bif_attr_t {
+  const char *name; /* has to be first for the name index */
+  uint8_t arch;     /* BIF_ARCH_* the attribute is supported for */
+  bif_attr_type_t type;
+  size_t field; /* offset of the field in bif_node_t, NO_FIELD if it's only checked */
+  mask_name_t *masks;
+  uint8_t not_file; /* the node does not refer to a file */
+} bif_attr_t;
+
+#define BIF_ARCH_ALL (BIF_ARCH_ZYNQ | BIF_ARCH_ZYNQMP)
+#define NODE_FIELD(name) offsetof(bif_node_t, name)
+#define NO_FIELD ((size_t) -1)
+
+/* clang-format off */
+static const bif_attr_t bif_attrs[] = {
+  {"bootloader",         BIF_ARCH_ALL,    BIF_ATTR_FLAG, NODE_FIELD(bootloader),         NULL,                             0},
+  {"load",               BIF_ARCH_ALL,    BIF_ATTR_HEX,  NODE_FIELD(load),               NULL,                             0},
+  {"offset",             BIF_ARCH_ALL,    BIF_ATTR_HEX,  NODE_FIELD(offset),             NULL,                             0},
+  {"partition_owner",    BIF_ARCH_ALL,    BIF_ATTR_MASK, NO_FIELD,                       bootrom_part_attr_owner_names,    0},
+  {"fsbl_config",        BIF_ARCH_ZYNQMP, BIF_ATTR_FLAG, NODE_FIELD(fsbl_config),        NULL,                             1},
+  {"pmufw_image",        BIF_ARCH_ZYNQMP, BIF_ATTR_FLAG, NODE_FIELD(pmufw_image),        NULL,                             0},
+  {"destination_device", BIF_ARCH_ZYNQMP, BIF_ATTR_MASK, NODE_FIELD(destination_device), bootrom_part_attr_dest_dev_names, 0},
+  {"destination_cpu",    BIF_ARCH_ZYNQMP, BIF_ATTR_MASK, NODE_FIELD(destination_cpu),    bootrom_part_attr_dest_cpu_names, 0},
+  {"exception_level",    BIF_ARCH_ZYNQMP, BIF_ATTR_MASK, NODE_FIELD(exception_level),    bootrom_part_attr_exc_lvl_names,  0},
+  {"split_gap",          BIF_ARCH_ALL,    BIF_ATTR_HEX,  NODE_FIELD(split_gap),          NULL,                             0},
+  {"keep_compressed",    BIF_ARCH_ALL,    BIF_ATTR_FLAG, NODE_FIELD(keep_compressed),    NULL,                             0},
+};
+/* clang-format on */
+
+#define BIF_ATTRS_NUM (sizeof(bif_attrs) / sizeof(bif_attrs[0]))
+
+/* Perfect hashes of the attribute names and of their mask tables,
+ * they're built once when the first attribute is parsed */
+static name_index_t bif_attr_index;
+static name_index_t bif_attr_value_index[BIF_ATTRS_NUM];
+static error bif_attr_index_err;
+static pthread_once_t bif_attr_index_once = PTHREAD_ONCE_INIT;
+
+static void bif_attr_index_init(void) {
+  uint32_t i, n;
+
+  bif_attr_index_err =
+    name_index_build(&bif_attr_index, bif_attrs, sizeof(*bif_attrs), BIF_ATTRS_NUM);
+
+  for (i = 0; i < BIF_ATTRS_NUM && !bif_attr_index_err; i++) {
+    if (!bif_attrs[i].masks)
+      continue;
+
+    for (n = 0; bif_attrs[i].masks[n].name; n++)
+      ;
+    bif_attr_index_err = name_index_build(
+      &bif_attr_value_index[i], bif_attrs[i].masks, sizeof(*bif_attrs[i].masks), n);
+  }
 }
 
 error bif_node_set_attr(
-  lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node, char *attr_name, char *value) {
-  uint32_t mask;
-  /* TODO: parser errors on wrong scans */
+  lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node, bif_str_t attr_name, bif_str_t *value) {
+  const bif_attr_t *attr;
+  uint32_t *field;
+  int i, v;
+
+  pthread_once(&bif_attr_index_once, bif_attr_index_init);
+  if (bif_attr_index_err) {
+    errorf("could not index the BIF attributes\n");
+    return bif_attr_index_err;
+  }
 
-  if (strcmp(attr_name, "bootloader") == 0) {
-    node->bootloader = 0xFF;
-    return SUCCESS;
+  i = name_index_find(
+    &bif_attr_index, bif_attrs, sizeof(*bif_attrs), attr_name.ptr, attr_name.len);
+  if (i < 0 || !(bif_attrs[i].arch & cfg->arch)) {
+    perrorf(lex, "node attribute not supported: \"%.*s\"\n", STR_ARG(attr_name));
+    return ERROR_BIF_UNSUPPORTED_ATTR;
   }
 
-  if (strcmp(attr_name, "load") == 0) {
-    if (!value) {
-      perrorf(lex, "the \"%s\" attribute requires an argument\n", attr_name);
-      return ERROR_BIF_PARSER;
-    }
-    if (sscanf(value, "0x%08x", &(node->load)) < 1) {
-      perrorf(lex, "the value \"%s\" in an improper format, expected '0xhhhhhhhh' form\n", value);
-      return ERROR_BIF_PARSER;
-    }
+  attr = &bif_attrs[i];
+
+  if (attr->type == BIF_ATTR_FLAG) {
+    *((uint8_t *) node + attr->field) = 0xFF;
+    if (attr->not_file)
+      node->is_file = 0x00;
     return SUCCESS;
   }
 
-  if (strcmp(attr_name, "offset") == 0) {
-    if (!value) {
-      perrorf(lex, "the \"%s\" attribute requires an argument\n", attr_name);
-      return ERROR_BIF_PARSER;
-    }
-    if (sscanf(value, "0x%08x", &(node->offset)) < 1) {
-      perrorf(lex, "the value \"%s\" in an improper format, expected '0xhhhhhhhh' form\n", value);
-      return ERROR_BIF_PARSER;
-    }
-    return SUCCESS;
+  if (!value) {
+    perrorf(lex, "the \"%.*s\" attribute requires an argument\n", STR_ARG(attr_name));
+    return ERROR_BIF_PARSER;
   }
 
-  if (strcmp(attr_name, "partition_owner") == 0) {
-    if (!value) {
-      perrorf(lex, "the \"%s\" attribute requires an argument\n", attr_name);
+  field = attr->field != NO_FIELD ? (uint32_t *) ((uint8_t *) node + attr->field) : NULL;
+  if (attr->type == BIF_ATTR_HEX) {
+    if (!parse_hex32(value, field)) {
+      perrorf(lex,
+              "the value \"%.*s\" in an improper format, expected '0xhhhhhhhh' form\n",
+              STR_ARG(*value));
       return ERROR_BIF_PARSER;
     }
-    mask = map_name_to_mask(bootrom_part_attr_owner_names, value);
-    if (mask == NOMASK) {
-      perrorf(lex, "value: \"%s\" not supported for the \"%s\" attribute\n", value, attr_name);
-      return ERROR_BIF_UNSUPPORTED_VAL;
-    }
     return SUCCESS;
   }
 
-  /* Only handle these for zynqmp arch */
-  if (cfg->arch & BIF_ARCH_ZYNQMP) {
-    if (strcmp(attr_name, "fsbl_config") == 0) {
-      node->fsbl_config = 0xFF;
+  v = name_index_find(
+    &bif_attr_value_index[i], attr->masks, sizeof(*attr->masks), value->ptr, value->len);
+  if (v < 0) {
+    perrorf(lex,
+            "value: \"%.*s\" not supported for the \"%.*s\" attribute\n",
+            STR_ARG(*value),
+            STR_ARG(attr_name));
+    return ERROR_BIF_UNSUPPORTED_VAL;
+  }
 
-      /* This attribute does not refer to file */
-      node->is_file = 0x00;
-      return SUCCESS;
-    }
+  if (field)
+    *field = attr->masks[v].mask;
+  return SUCCESS;
+}
 
-    if (strcmp(attr_name, "pmufw_image") == 0) {
-      node->pmufw_image = 0xFF;
-      return SUCCESS;
-    }
+/* Copy a string to the arena of the config, it lives as long as the config */
+char *bif_cfg_add_string(bif_cfg_t *cfg, const char *str, size_t len) {
+  char *ret;
 
-    if (strcmp(attr_name, "destination_device") == 0) {
-      if (!value) {
-        perrorf(lex, "the \"%s\" attribute requires an argument\n", attr_name);
-        return ERROR_BIF_PARSER;
-      }
-      mask = map_name_to_mask(bootrom_part_attr_dest_dev_names, value);
-      if (mask == NOMASK) {
-        perrorf(lex, "value: \"%s\" not supported for the \"%s\" attribute\n", value, attr_name);
-        return ERROR_BIF_UNSUPPORTED_VAL;
-      }
-      node->destination_device = mask;
-      return SUCCESS;
-    }
-
-    if (strcmp(attr_name, "destination_cpu") == 0) {
-      if (!value) {
-        perrorf(lex, "the \"%s\" attribute requires an argument\n", attr_name);
-        return ERROR_BIF_PARSER;
-      }
-      mask = map_name_to_mask(bootrom_part_attr_dest_cpu_names, value);
-      if (mask == NOMASK) {
-        perrorf(lex, "value: \"%s\" not supported for the \"%s\" attribute\n", value, attr_name);
-        return ERROR_BIF_UNSUPPORTED_VAL;
-      }
-      node->destination_cpu = mask;
-      return SUCCESS;
-    }
+  if (!(ret = str_arena_alloc(&cfg->strings, len + 1)))
+    return NULL;
 
-    if (strcmp(attr_name, "exception_level") == 0) {
-      if (!value) {
-        perrorf(lex, "the \"%s\" attribute requires an argument\n", attr_name);
-        return ERROR_BIF_PARSER;
-      }
-      mask = map_name_to_mask(bootrom_part_attr_exc_lvl_names, value);
-      if (mask == NOMASK) {
-        perrorf(lex, "value: \"%s\" not supported for the \"%s\" attribute\n", value, attr_name);
-        return ERROR_BIF_UNSUPPORTED_VAL;
-      }
-      node->exception_level = mask;
-      return SUCCESS;
-    }
-  }
+  memcpy(ret, str, len);
+  ret[len] = '\0';
 
-  perrorf(lex, "node attribute not supported: \"%s\"\n", attr_name);
-  return ERROR_BIF_UNSUPPORTED_ATTR;
+  return ret;
 }
 
+/* Nodes are only appended here, the fname has to come from the
+ * string arena. bif_cfg_sort_nodes puts them in order afterwards. */
 error bif_cfg_add_node(bif_cfg_t *cfg, bif_node_t *node) {
-  uint16_t pos;
-  bif_node_t tmp_node;
+  bif_node_t *nodes;
 
   /* Check if initialized */
   if (cfg->nodes_avail == 0) {
@@ -547,46 +756,84 @@ error bif_cfg_add_node(bif_cfg_t *cfg, bif_node_t *node) {
     return ERROR_BIF_UNINITIALIZED;
   }
 
-  pos = cfg->nodes_num;
-  cfg->nodes[pos] = *node;
+  cfg->nodes[cfg->nodes_num++] = *node;
 
-  /* Move nodes without offset to the top */
-  while (pos >= 1 && cfg->nodes[pos - 1].offset && !cfg->nodes[pos].offset) {
-    tmp_node = cfg->nodes[pos - 1];
-    cfg->nodes[pos - 1] = cfg->nodes[pos];
-    cfg->nodes[pos] = tmp_node;
-    pos--;
+  /* Allocate more space if needed */
+  if (cfg->nodes_num >= cfg->nodes_avail) {
+    nodes = realloc(cfg->nodes, sizeof(bif_node_t) * cfg->nodes_avail * 2);
+    if (!nodes) {
+      return ERROR_NOMEM;
+    }
+    cfg->nodes = nodes;
+    cfg->nodes_avail *= 2;
   }
+  return SUCCESS;
+}
 
-  pos = cfg->nodes_num;
+/* Sort key of a node, see bif_cfg_sort_nodes */
+typedef struct bif_node_key_t {
+  uint32_t group;
+  uint32_t offset;
+  uint32_t order; /* tie breaker */
+  uint32_t idx;
+} bif_node_key_t;
 
-  /* Move special nodes to the top as well */
-  while (pos && (cfg->nodes[pos].fsbl_config || cfg->nodes[pos].pmufw_image)) {
-    tmp_node = cfg->nodes[pos - 1];
-    cfg->nodes[pos - 1] = cfg->nodes[pos];
-    cfg->nodes[pos] = tmp_node;
-    pos--;
-  }
+static int bif_node_key_cmp(const void *a, const void *b) {
+  const bif_node_key_t *ka = a, *kb = b;
 
-  pos = cfg->nodes_num;
+  if (ka->group != kb->group)
+    return ka->group < kb->group ? -1 : 1;
+  if (ka->offset != kb->offset)
+    return ka->offset < kb->offset ? -1 : 1;
 
-  /* Sort nodes via offset */
-  while (pos >= 1 && cfg->nodes[pos - 1].offset > cfg->nodes[pos].offset) {
-    tmp_node = cfg->nodes[pos - 1];
-    cfg->nodes[pos - 1] = cfg->nodes[pos];
-    cfg->nodes[pos] = tmp_node;
-    pos--;
-  }
+  return (ka->order > kb->order) - (ka->order < kb->order);
+}
 
-  (cfg->nodes_num)++;
+/* Order the nodes the way they go into the image: the special nodes
+ * (fsbl_config, pmufw_image) first, then the ones without an offset,
+ * then the rest sorted by offset. Other nodes that compare equal stay
+ * in the BIF order. */
+error bif_cfg_sort_nodes(bif_cfg_t *cfg) {
+  bif_node_key_t *keys;
+  bif_node_t *nodes;
+  uint32_t i;
 
-  /* Allocate more space if needed */
-  if (cfg->nodes_num >= cfg->nodes_avail) {
-    cfg->nodes_avail *= 2;
-    cfg->nodes = realloc(cfg->nodes, sizeof(bif_node_t) * cfg->nodes_avail);
-    if (!cfg->nodes) {
-      return ERROR_NOMEM;
+  if (cfg->nodes_num < 2)
+    return SUCCESS;
+
+  keys = malloc(sizeof(*keys) * cfg->nodes_num);
+  nodes = malloc(sizeof(*nodes) * cfg->nodes_avail);
+  if (!keys || !nodes) {
+    free(keys);
+    free(nodes);
+    return ERROR_NOMEM;
+  }
+
+  for (i = 0; i < cfg->nodes_num; i++) {
+    keys[i].idx = i;
+    keys[i].order = i;
+    keys[i].offset = cfg->nodes[i].offset;
+
+    if (cfg->nodes[i].fsbl_config || cfg->nodes[i].pmufw_image) {
+      /* Each special node used to be moved in front of the previous
+       * ones, keep listing them in the reverse BIF order */
+      keys[i].group = 0;
+      keys[i].order = UINT32_MAX - i;
+    } else if (!cfg->nodes[i].offset) {
+      keys[i].group = 1;
+    } else {
+      keys[i].group = 2;
     }
   }
+
+  qsort(keys, cfg->nodes_num, sizeof(*keys), bif_node_key_cmp);
+
+  for (i = 0; i < cfg->nodes_num; i++)
+    nodes[i] = cfg->nodes[keys[i].idx];
+
+  free(cfg->nodes);
+  cfg->nodes = nodes;
+  free(keys);
+
   return SUCCESS;
 }
@@ -1,6 +1,7 @@
 #ifndef BIF_PARSER_H
 #define BIF_PARSER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,10 @@
 #define BIF_ARCH_ZYNQ   (1 << 0)
 #define BIF_ARCH_ZYNQMP (1 << 1)
 
+/* ELF files get split into partitions where their loadable data is
+ * more than split_gap bytes apart, by default (0) they are never split */
+#define BIF_SPLIT_GAP_DEFAULT 0x00000000
+
 enum token_type
 {
   TOKEN_EOF = 0,
@@ -19,21 +24,36 @@ enum token_type
   TOKEN_NAME,
 };
 
+/* A chunk of the string arena, chunks never move once allocated */
+typedef struct bif_str_chunk_t {
+  struct bif_str_chunk_t *next;
+  size_t len, cap;
+  char data[];
+} bif_str_chunk_t;
+
+/* A string that is not NUL terminated, e.g. a token in the BIF file */
+typedef struct bif_str_t {
+  const char *ptr;
+  size_t len;
+} bif_str_t;
+
 typedef struct lexer_t {
-  FILE *file; /* the file being parsed */
+  mapped_file_t file; /* the file being parsed */
+  bool mapped;        /* otherwise file.data is on the heap */
   char *fname;
 
+  size_t pos; /* offset of the next char to scan */
   int line, column;
 
-  int type; /* type of the last token read */
-  struct {
-    char *buffer; /* tokens of the token */
-    int len, cap; /* current length and allocated size */
-  };
+  int type;        /* type of the last token read */
+  bif_str_t token; /* the last token, points into the file */
+
+  /* Strings with escape sequences have to be copied, they're kept here */
+  bif_str_chunk_t *escaped;
 } lexer_t;
 
 typedef struct bif_node_t {
-  char fname[PATH_MAX];
+  char *fname; /* stored in the string arena of bif_cfg_t */
 
   /* supported common attributes */
   uint8_t bootloader; /* boolean */
@@ -51,24 +71,30 @@ typedef struct bif_node_t {
   /* special, non-bootgen features */
   uint8_t is_file; /* for now equal to !fsbl_config */
   uint8_t numbits;
+  uint32_t split_gap;
+  uint8_t keep_compressed; /* boolean */
 } bif_node_t;
 
 typedef struct bif_cfg_t {
   uint8_t arch;
 
-  uint16_t nodes_num;
-  uint16_t nodes_avail;
+  uint32_t nodes_num;
+  uint32_t nodes_avail;
 
   bif_node_t *nodes;
+  bif_str_chunk_t *strings;
 } bif_cfg_t;
 
 error init_bif_cfg(bif_cfg_t *cfg);
 error deinit_bif_cfg(bif_cfg_t *cfg);
 
+char *bif_cfg_add_string(bif_cfg_t *cfg, const char *str, size_t len);
 error bif_cfg_add_node(bif_cfg_t *cfg, bif_node_t *node);
+error bif_cfg_sort_nodes(bif_cfg_t *cfg);
 error bif_node_set_attr(
-  lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node, char *attr_name, char *value);
+  lexer_t *lex, bif_cfg_t *cfg, bif_node_t *node, bif_str_t attr_name, bif_str_t *value);
 
 error bif_parse(const char *fname, bif_cfg_t *cfg);
+error bif_parse_text(const char *name, const char *text, size_t len, bif_cfg_t *cfg);
 
 #endif /* BIF_PARSER_H */
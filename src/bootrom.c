@@ -34,9 +34,11 @@
 #include <bif.h>
 #include <bootrom.h>
 #include <byteswap.h>
+#include <cache.h>
 #include <common.h>
 #include <fcntl.h>
 #include <file/bitstream.h>
+#include <file/compressed.h>
 #include <file/elf.h>
 #include <libgen.h>
 #include <sys/stat.h>
@@ -114,15 +116,6 @@ mask_name_t bootrom_part_attr_mask_names[] = {
 };
 /* clang-format on */
 
-uint32_t map_name_to_mask(mask_name_t mask_names[], char *name) {
-  int i;
-
-  for (i = 0; mask_names[i].name; i++)
-    if (strcmp(mask_names[i].name, name) == 0)
-      return mask_names[i].mask;
-  return NOMASK;
-}
-
 char *map_mask_to_name(mask_name_t mask_names[], uint32_t mask) {
   int i;
 
@@ -132,6 +125,258 @@ char *map_mask_to_name(mask_name_t mask_names[], uint32_t mask) {
   return "INVALID";
 }
 
+/* Read the magic word a file starts with, 0 if it is too short */
+static uint32_t get_file_magic(mapped_file_t *file) {
+  uint32_t file_header = 0;
+
+  if (file->size >= sizeof(file_header))
+    memcpy(&file_header, file->data, sizeof(file_header));
+
+  /* gzip files have only three bytes of magic */
+  if ((file_header & 0x00FFFFFF) == FILE_MAGIC_GZIP)
+    return FILE_MAGIC_GZIP;
+
+  return file_header;
+}
+
+/* ELF files and bitstreams have to be parsed, so compressed ones are
+ * decompressed to memory when planning. The contents replace the file,
+ * keeping its identity for the caches. Other compressed files are
+ * decompressed straight into their slot when loading them. */
+static error unpack_input(bif_node_t *node, mapped_file_t *file) {
+  mapped_file_t unpacked;
+  uint32_t magic;
+  uint64_t size;
+  void *data;
+  error err;
+
+  switch (get_file_magic(file)) {
+  case FILE_MAGIC_GZIP:
+  case FILE_MAGIC_XZ:
+  case FILE_MAGIC_ZSTD:
+    if (!node->keep_compressed)
+      break;
+    /* fall through */
+  default:
+    return SUCCESS;
+  }
+
+  if ((err = compressed_get_magic(file, &magic))) {
+    errorf("failed to decompress file: %s\n", node->fname);
+    return err;
+  }
+
+  if (magic != FILE_MAGIC_ELF && magic != FILE_MAGIC_XILINXBIT_0)
+    return SUCCESS;
+
+  if ((err = compressed_get_size(file, &size))) {
+    errorf("failed to decompress file: %s\n", node->fname);
+    return err;
+  }
+
+  if (size > SIZE_MAX || !(data = malloc(size ? size : 1))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  if ((err = compressed_extract(data, file, size))) {
+    errorf("failed to decompress file: %s\n", node->fname);
+    free(data);
+    return err;
+  }
+
+  unpacked = *file;
+  unpacked.data = data;
+  unpacked.size = size;
+  unpacked.kind = MAPPED_FILE_HEAP;
+
+  unmap_file(file);
+  *file = unpacked;
+
+  return SUCCESS;
+}
+
+/* Returns the number of bytes a file will take in the image,
+ * before the partition padding, via the last argument.
+ * The regular return value is the error code. */
+static error get_payload_size(mapped_file_t *file, bif_node_t *node, uint32_t *size) {
+  uint64_t unpacked;
+  error err;
+
+  switch (get_file_magic(file)) {
+  case FILE_MAGIC_ELF:
+    if ((err = elf_get_size(file, size))) {
+      errorf("failed to parse ELF file: %s\n", node->fname);
+      return err;
+    }
+    break;
+  case FILE_MAGIC_XILINXBIT_0:
+    if ((err = bitstream_verify(file))) {
+      errorf("not a valid bitstream file: %s.\n", node->fname);
+      return err;
+    }
+    if ((err = bitstream_get_size(file, size)))
+      return err;
+    break;
+  case FILE_MAGIC_GZIP:
+  case FILE_MAGIC_XZ:
+  case FILE_MAGIC_ZSTD:
+    /* The contents are copied as they are, see unpack_input */
+    if (!node->keep_compressed) {
+      if ((err = compressed_get_size(file, &unpacked))) {
+        errorf("failed to decompress file: %s\n", node->fname);
+        return err;
+      }
+      if (unpacked > UINT32_MAX) {
+        errorf("file too large: %s\n", node->fname);
+        return ERROR_BOOTROM_NOMEM;
+      }
+      *size = unpacked;
+      break;
+    }
+    /* fall through */
+  default:
+    if (file->size > UINT32_MAX) {
+      errorf("file too large: %s\n", node->fname);
+      return ERROR_BOOTROM_NOMEM;
+    }
+    *size = file->size;
+  }
+
+  return SUCCESS;
+}
+
+/* Copy a file which goes to the image as it is, it may be in its slot
+ * already if it was decompressed there */
+static void copy_payload(uint32_t *addr, mapped_file_t *file) {
+  if (file->size && file->data != (uint8_t *) addr)
+    memcpy(addr, file->data, file->size);
+}
+
+/* Look a processed payload up in the memory and then in the cache
+ * directory, a payload found in the directory is shared in memory too */
+static bool cache_lookup(const cache_t *cache,
+                         mapped_file_t *file,
+                         cache_kind_t kind,
+                         void *addr,
+                         uint32_t max_len,
+                         cache_meta_t *meta) {
+  cache_key_t key;
+
+  if (!cache)
+    return false;
+
+  if (cache->mem && cache_mem_load(cache->mem, file, addr, max_len, meta))
+    return true;
+
+  if (cache->lru && cache_lru_load(cache->lru, file, kind, addr, max_len, meta)) {
+    if (cache->mem)
+      cache_mem_store(cache->mem, file, addr, meta);
+    return true;
+  }
+
+  if (cache->dir) {
+    cache_make_key(&key, file, kind);
+    if (cache_load(cache->dir, &key, addr, max_len, meta)) {
+      if (cache->mem)
+        cache_mem_store(cache->mem, file, addr, meta);
+      if (cache->lru)
+        cache_lru_store(cache->lru, file, kind, addr, meta);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Store a freshly processed payload, meta is NULL if it failed */
+static void cache_update(const cache_t *cache,
+                         mapped_file_t *file,
+                         cache_kind_t kind,
+                         void *addr,
+                         cache_meta_t *meta) {
+  cache_key_t key;
+
+  if (!cache)
+    return;
+
+  if (cache->dir && meta) {
+    cache_make_key(&key, file, kind);
+    cache_store(cache->dir, &key, addr, meta);
+  }
+
+  if (cache->lru && meta)
+    cache_lru_store(cache->lru, file, kind, addr, meta);
+
+  if (cache->mem)
+    cache_mem_store(cache->mem, file, meta ? addr : NULL, meta);
+}
+
+/* Flatten an ELF file like elf_append does, reusing the result
+ * processed before if the cache has it */
+static error cached_elf_append(void *addr,
+                               mapped_file_t *file,
+                               uint32_t img_max_size,
+                               const cache_t *cache,
+                               uint32_t *img_size,
+                               uint8_t *elf_nbits,
+                               uint64_t *elf_load,
+                               uint64_t *elf_entry) {
+  cache_meta_t meta;
+  error err;
+
+  if (cache_lookup(cache, file, CACHE_KIND_ELF, addr, img_max_size, &meta)) {
+    *img_size = meta.size;
+    *elf_nbits = meta.nbits;
+    *elf_load = meta.load;
+    *elf_entry = meta.entry;
+    return SUCCESS;
+  }
+
+  err = elf_append(addr, file, img_max_size, img_size, elf_nbits, elf_load, elf_entry);
+  if (err) {
+    cache_update(cache, file, CACHE_KIND_ELF, addr, NULL);
+    return err;
+  }
+
+  meta.len = *img_size;
+  meta.size = *img_size;
+  meta.nbits = *elf_nbits;
+  meta.load = *elf_load;
+  meta.entry = *elf_entry;
+  cache_update(cache, file, CACHE_KIND_ELF, addr, &meta);
+
+  return SUCCESS;
+}
+
+/* Same as above for the bitstream data, img_max_size is the size
+ * of the bitstream data reported when planning */
+static error cached_bitstream_append(uint32_t *addr,
+                                     mapped_file_t *file,
+                                     uint32_t img_max_size,
+                                     const cache_t *cache,
+                                     uint32_t *img_size) {
+  cache_meta_t meta;
+  error err;
+
+  if (cache_lookup(cache, file, CACHE_KIND_BITSTREAM, addr, (img_max_size + 3) & ~3, &meta)) {
+    *img_size = meta.size;
+    return SUCCESS;
+  }
+
+  if ((err = bitstream_append(addr, file, img_size))) {
+    cache_update(cache, file, CACHE_KIND_BITSTREAM, addr, NULL);
+    return err;
+  }
+
+  memset(&meta, 0x0, sizeof(meta));
+  meta.len = (*img_size + 3) & ~3;
+  meta.size = *img_size;
+  cache_update(cache, file, CACHE_KIND_BITSTREAM, addr, &meta);
+
+  return SUCCESS;
+}
+
 /* Returns the offset by which the addr parameter should be moved
  * and partition header info via argument pointers.
  * The regular return value is the error code. */
@@ -139,16 +384,18 @@ error append_file_to_image(uint32_t *addr,
                            bootrom_ops_t *bops,
                            bootrom_offs_t *offs,
                            bif_node_t node,
+                           bootrom_part_layout_t *part,
                            bootrom_partition_hdr_t *part_hdr,
+                           const cache_t *cache,
                            uint32_t *img_size) {
-  uint32_t file_header;
-  struct stat cfile_stat;
-  FILE *cfile;
-  uint32_t elf_load;
-  uint32_t elf_entry;
+  mapped_file_t *cfile = &part->file;
+  bootrom_part_layout_t contents;
+  uint64_t elf_load;
+  uint64_t elf_entry;
   uint8_t elf_nbits;
   uint32_t img_size_init;
   linux_image_header_t linux_img;
+  uint32_t magic;
   error err;
 
   /* Initialize header with zeroes */
@@ -157,42 +404,28 @@ error append_file_to_image(uint32_t *addr,
   img_size_init = *img_size;
   *img_size = 0;
 
-  if (stat(node.fname, &cfile_stat)) {
-    errorf("could not stat file: %s\n", node.fname);
-    return ERROR_BOOTROM_NOFILE;
-  }
-  if (!S_ISREG(cfile_stat.st_mode)) {
-    errorf("not a regular file: %s\n", node.fname);
-    return ERROR_BOOTROM_NOFILE;
-  }
-  cfile = fopen(node.fname, "rb");
-
-  if (cfile == NULL) {
-    errorf("could not open file: %s\n", node.fname);
-    return ERROR_BOOTROM_NOFILE;
-  }
-
-  /* Check file format */
-  fread(&file_header, 1, sizeof(file_header), cfile);
-
-  switch (file_header) {
+  /* Check file format, the file is already mapped by the layout planner */
+  switch ((magic = get_file_magic(cfile))) {
   case FILE_MAGIC_ELF:
-    /* Init elf file (img_size_init is non-zero for a bootloader if there
-     * is PMU firmware waiting). File size is used as result size limit
-     * as estimate_boot_image_size() makes that same assumption when
-     * allocating the memory area for the boot image */
-    err = elf_append(addr + img_size_init / sizeof(uint32_t),
-                     node.fname,
-                     cfile_stat.st_size,
-                     img_size,
-                     &elf_nbits,
-                     &elf_load,
-                     &elf_entry);
+    if (part->region.size) {
+      /* A region of a split ELF file is a plain copy, not worth caching */
+      elf_load = part->region.load;
+      err = elf_append_region(addr, cfile, &part->region, img_size, &elf_nbits, &elf_entry);
+    } else {
+      /* Init elf file (img_size_init is non-zero for a bootloader if there
+       * is PMU firmware waiting). The planned size is used as result size
+       * limit as that is exactly the space reserved for it */
+      err = cached_elf_append(addr + img_size_init / sizeof(uint32_t),
+                              cfile,
+                              part->size,
+                              cache,
+                              img_size,
+                              &elf_nbits,
+                              &elf_load,
+                              &elf_entry);
+    }
     if (err) {
       errorf("ELF file reading failed\n");
-
-      /* Close the file */
-      fclose(cfile);
       return err;
     }
 
@@ -202,24 +435,18 @@ error append_file_to_image(uint32_t *addr,
      * 'init' size is added before initializing the partition header and
      * subtracted after the initialization is done */
     *img_size += img_size_init;
-    bops->init_part_hdr_elf(part_hdr, &node, img_size, elf_load, elf_entry, elf_nbits);
+    err = bops->init_part_hdr_elf(part_hdr, &node, img_size, elf_load, elf_entry, elf_nbits);
     *img_size -= img_size_init;
 
-    break;
-  case FILE_MAGIC_XILINXBIT_0:
-    /* Verify file */
-    if ((err = bitstream_verify(cfile))) {
-      errorf("not a valid bitstream file: %s.\n", node.fname);
-
-      /* Close the file */
-      fclose(cfile);
+    if (err) {
+      errorf("ELF file addresses don't fit in the partition header: %s\n", node.fname);
       return err;
     }
 
-    /* It matches, append it to the image */
-    err = bitstream_append(addr, cfile, img_size);
-
-    if (err)
+    break;
+  case FILE_MAGIC_XILINXBIT_0:
+    /* The bitstream was verified when planning, append it to the image */
+    if ((err = cached_bitstream_append(addr, cfile, part->size, cache, img_size)))
       return err;
 
     /* Init partition header */
@@ -227,210 +454,551 @@ error append_file_to_image(uint32_t *addr,
 
     break;
   case FILE_MAGIC_LINUX:
-    fseek(cfile, 0, SEEK_SET);
-    fread(&linux_img, 1, sizeof(linux_img), cfile);
+    memset(&linux_img, 0x0, sizeof(linux_img));
+    memcpy(&linux_img,
+           cfile->data,
+           cfile->size < sizeof(linux_img) ? cfile->size : sizeof(linux_img));
 
-    fseek(cfile, 0, SEEK_SET);
-    *img_size = fread(addr, 1, cfile_stat.st_size, cfile);
+    copy_payload(addr, cfile);
+    *img_size = cfile->size;
 
     /* Init partition header */
     bops->init_part_hdr_linux(part_hdr, &node, &linux_img);
 
     break;
   case FILE_MAGIC_DTB:
-    fseek(cfile, 0, SEEK_SET);
-    *img_size = fread(addr, 1, cfile_stat.st_size, cfile);
+    copy_payload(addr, cfile);
+    *img_size = cfile->size;
 
     bops->init_part_hdr_dtb(part_hdr, &node);
     break;
-  default: /* Treat as a binary file */
+  case FILE_MAGIC_GZIP:
+  case FILE_MAGIC_XZ:
+  case FILE_MAGIC_ZSTD:
+    if (!node.keep_compressed) {
+      /* Decompress into the slot, which has room for exactly the planned
+       * size. The contents are then appended like any other file, without
+       * decompressing them again. */
+      if ((err = compressed_extract(addr, cfile, part->size))) {
+        errorf("failed to decompress file: %s\n", node.fname);
+        return err;
+      }
 
-    fseek(cfile, 0, SEEK_SET);
-    *img_size = fread(addr, 1, cfile_stat.st_size, cfile);
+      contents = *part;
+      contents.file.data = (uint8_t *) addr;
+      contents.file.size = part->size;
+      contents.file.kind = MAPPED_FILE_BORROWED;
+      node.keep_compressed = 1;
+
+      *img_size = img_size_init;
+      return append_file_to_image(addr, bops, offs, node, &contents, part_hdr, NULL, img_size);
+    }
+    /* fall through */
+  default: /* Treat as a binary file */
+    copy_payload(addr, cfile);
+    *img_size = cfile->size;
 
     bops->init_part_hdr_default(part_hdr, &node);
   };
 
   *img_size += img_size_init;
+  /* Zero the rest of the last word as the buffer may hold anything,
+   * bitstreams are written in whole words already */
+  if (magic != FILE_MAGIC_XILINXBIT_0)
+    memset((uint8_t *) addr + *img_size, 0x0, -*img_size % 4);
   /* Convert size to 32bit words */
   *img_size = (*img_size + 3) / 4;
 
   /* Finish partition header */
   bops->finish_part_hdr(part_hdr, img_size, offs);
 
-  /* Close the file */
-  fclose(cfile);
+  return SUCCESS;
+}
+
+/* Computes the exact placement of every partition and the total image
+ * size before any data is copied. All the input files stay mapped
+ * in the layout until it is released. */
+error plan_boot_image(bif_cfg_t *bif_cfg, bootrom_ops_t *bops, bootrom_layout_t *layout) {
+  return plan_boot_image_from(bif_cfg, bops, NULL, NULL, layout);
+}
+
+/* Adds an empty partition of the node idx to the layout */
+static bootrom_part_layout_t *add_part(bootrom_layout_t *layout, uint32_t idx) {
+  bootrom_part_layout_t *parts, *part;
+  uint32_t avail;
+
+  if (layout->parts_num == layout->parts_avail) {
+    avail = layout->parts_avail ? 2 * layout->parts_avail : 16;
+    if (!(parts = realloc(layout->parts, avail * sizeof(*parts)))) {
+      errorf("out of memory\n");
+      return NULL;
+    }
+    layout->parts = parts;
+    layout->parts_avail = avail;
+  }
+
+  part = &layout->parts[layout->parts_num++];
+  memset(part, 0x0, sizeof(*part));
+  part->node = idx;
+
+  return part;
+}
+
+/* Adds the partitions of a node, the layout takes over the mapped file.
+ * ELF files other than the bootloader get a partition for every region
+ * of their loadable data, so that a large gap between the segments does
+ * not end up in the image. Only the first partition owns the mapping. */
+static error plan_node_parts(bootrom_layout_t *layout,
+                             bif_node_t *node,
+                             uint32_t idx,
+                             mapped_file_t *file) {
+  bootrom_part_layout_t *part;
+  elf_region_t *regions;
+  uint32_t regions_num = 0, r;
+
+  /* Broken files are reported when getting the payload size */
+  if (node->split_gap && !node->bootloader && get_file_magic(file) == FILE_MAGIC_ELF &&
+      elf_get_regions(file, node->split_gap, NULL, 0, &regions_num) != SUCCESS)
+    regions_num = 0;
+
+  if (regions_num < 2) {
+    if (!(part = add_part(layout, idx))) {
+      unmap_file(file);
+      return ERROR_NOMEM;
+    }
+
+    part->file = *file;
+    return get_payload_size(&part->file, node, &part->size);
+  }
+
+  if (!(regions = calloc(regions_num, sizeof(*regions)))) {
+    errorf("out of memory\n");
+    unmap_file(file);
+    return ERROR_NOMEM;
+  }
+  elf_get_regions(file, node->split_gap, regions, regions_num, &regions_num);
+
+  for (r = 0; r < regions_num; r++) {
+    if (!(part = add_part(layout, idx))) {
+      if (r == 0)
+        unmap_file(file);
+      free(regions);
+      return ERROR_NOMEM;
+    }
+
+    part->file = *file;
+    if (r > 0)
+      part->file.kind = MAPPED_FILE_BORROWED;
+    part->region = regions[r];
+    part->size = regions[r].size;
+  }
+
+  free(regions);
 
   return SUCCESS;
 }
 
-/* Returns an estimation of the output image size */
-uint32_t estimate_boot_image_size(bif_cfg_t *bif_cfg) {
-  uint8_t i;
-  uint32_t estimated_size;
-  struct stat st_file;
+/* Same as above, with the inputs supplied by get_input if it has them */
+error plan_boot_image_from(bif_cfg_t *bif_cfg,
+                           bootrom_ops_t *bops,
+                           bootrom_input_fn get_input,
+                           void *arg,
+                           bootrom_layout_t *layout) {
+  bootrom_offs_t offs;
+  bootrom_part_layout_t *part;
+  mapped_file_t file;
+  bif_node_t *node;
+  uint64_t coff, words, end;
+  uint32_t size, hdrs_end;
+  uint32_t i;
+  error err;
 
-  /* TODO the offset used hereshould be more
-   * dependent on the target architecture */
-  estimated_size = BOOTROM_BINS_OFF;
+  memset(layout, 0x0, sizeof(*layout));
 
+  /* Map the inputs and get their payload sizes */
   for (i = 0; i < bif_cfg->nodes_num; i++) {
+    node = &bif_cfg->nodes[i];
+
     /* Skip if param will not include a file */
-    if (!bif_cfg->nodes[i].is_file)
+    if (!node->is_file)
+      continue;
+
+    if (!(get_input && get_input(arg, node, &file)) && map_file(node->fname, &file)) {
+      release_boot_image_layout(layout);
+      return ERROR_BOOTROM_NOFILE;
+    }
+
+    if ((err = unpack_input(node, &file))) {
+      unmap_file(&file);
+      release_boot_image_layout(layout);
+      return err;
+    }
+
+    if (node->pmufw_image) {
+      unmap_file(&layout->pmufw);
+      layout->pmufw = file;
+      layout->pmufw_idx = i;
+
+      if ((err = get_payload_size(&layout->pmufw, node, &size))) {
+        release_boot_image_layout(layout);
+        return err;
+      }
+
+      if (get_file_magic(&layout->pmufw) != FILE_MAGIC_ELF || size > BOOTROM_PMUFW_MAX_SIZE) {
+        errorf("failed to parse ELF file: %s\n", node->fname);
+        release_boot_image_layout(layout);
+        return ERROR_BOOTROM_ELF;
+      }
+
+      /* The bootloader follows the firmware, keep it 8 byte aligned */
+      layout->pmufw_size = (size + 7) & ~7u;
       continue;
+    }
 
-    if (stat(bif_cfg->nodes[i].fname, &st_file)) {
-      errorf("could not stat %s\n", bif_cfg->nodes[i].fname);
-      return 0;
+    if ((err = plan_node_parts(layout, node, i, &file))) {
+      release_boot_image_layout(layout);
+      return err;
+    }
+
+    layout->imgs_count++;
+  }
+
+  /* Get the header area offsets */
+  bops->init_offs(NULL, layout->imgs_count, layout->parts_num, &offs);
+
+  /* Make sure the headers fit in front of the partition data */
+  hdrs_end = offs.part_hdr_off +
+             (layout->parts_num + bops->append_null_part) * sizeof(bootrom_partition_hdr_t);
+  if (offs.part_hdr_end_off)
+    hdrs_end += BOOTROM_PART_HDR_END_PADD;
+
+  if (offs.img_hdr_off + sizeof(bootrom_img_hdr_tab_t) +
+          layout->imgs_count * sizeof(bootrom_img_hdr_t) >
+        offs.part_hdr_off ||
+      hdrs_end > offs.bins_off) {
+    errorf("too many partitions to fit in the boot image headers\n");
+    release_boot_image_layout(layout);
+    return ERROR_BOOTROM_UNSUPPORTED;
+  }
+
+  layout->bins_off = offs.bins_off;
+  layout->mem_size = offs.bins_off;
+
+  /* Place the partitions, this follows what create_boot_image does */
+  coff = offs.bins_off / sizeof(uint32_t);
+  for (i = 0; i < layout->parts_num; i++) {
+    part = &layout->parts[i];
+    node = &bif_cfg->nodes[part->node];
+
+    /* The offset is the one of the first partition of a split file */
+    if (node->offset && (i == 0 || layout->parts[i - 1].node != part->node)) {
+      if (node->offset / sizeof(uint32_t) < coff) {
+        errorf("binary sections overlapping.\n");
+        release_boot_image_layout(layout);
+        return ERROR_BOOTROM_SEC_OVERLAP;
+      }
+      coff = node->offset / sizeof(uint32_t);
     }
 
-    if (bif_cfg->nodes[i].offset)
-      estimated_size = bif_cfg->nodes[i].offset;
+    size = part->size;
+    if (node->bootloader)
+      size += layout->pmufw_size;
+
+    words = (size + 3ull) / sizeof(uint32_t);
+    if (bops->append_bitstream_noop && get_file_magic(&part->file) == FILE_MAGIC_XILINXBIT_0)
+      words++;
+
+    /* Every partition is padded up to the image padding size */
+    part->offset = coff;
+    part->len = words;
+    while (part->len % (BOOTROM_IMG_PADDING_SIZE / sizeof(uint32_t)))
+      part->len++;
+
+    /* The padding of the last image is written, but it is not a part of the image */
+    end = coff + part->len;
+    if (i == layout->parts_num - 1 && part->node == bif_cfg->nodes_num - 1)
+      coff += words;
+    else
+      coff = end;
+
+    if (end * sizeof(uint32_t) > UINT32_MAX) {
+      errorf("the boot image would exceed 4GB\n");
+      release_boot_image_layout(layout);
+      return ERROR_BOOTROM_NOMEM;
+    }
 
-    estimated_size += st_file.st_size;
+    if (end * sizeof(uint32_t) > layout->mem_size)
+      layout->mem_size = end * sizeof(uint32_t);
   }
 
-  /* Add 3% to make sure padding is covered */
-  estimated_size *= 1.03;
+  layout->img_size = coff * sizeof(uint32_t);
 
-  return estimated_size;
+  return SUCCESS;
 }
 
-/* Returns total size of the created image via the last argument.
- * The regular return value is the error code. */
-error create_boot_image(uint32_t *img_ptr,
-                        bif_cfg_t *bif_cfg,
-                        bootrom_ops_t *bops,
-                        uint32_t *total_size) {
-  /* declare variables */
-  bootrom_hdr_t hdr;
+/* Unmaps the inputs and frees the layout */
+void release_boot_image_layout(bootrom_layout_t *layout) {
+  uint32_t i;
+
+  for (i = 0; i < layout->parts_num; i++)
+    unmap_file(&layout->parts[i].file);
+  unmap_file(&layout->pmufw);
+
+  free(layout->parts);
+  layout->parts = NULL;
+  layout->parts_num = 0;
+  layout->parts_avail = 0;
+}
+
+/* A single partition to be loaded into its planned slot */
+struct bootrom_load_task_t {
+  uint32_t *addr;
+  bif_node_t *node;
+  bootrom_part_layout_t *part;
+  bootrom_partition_hdr_t *part_hdr;
   bootrom_offs_t offs;
-  uint16_t i, j, f;
-  error err;
-  int img_term_n = 0;
-  uint8_t img_name[BOOTROM_IMG_MAX_NAME_LEN];
-  uint8_t pmufw_img[BOOTROM_PMUFW_MAX_SIZE];
-  uint32_t pmufw_img_load;
-  uint32_t pmufw_img_entry;
-  uint32_t pmufw_img_size;
-  uint8_t pmufw_img_nbits;
-  struct stat pmufile_stat;
-  uint8_t part_hdr_count;
+  uint32_t img_size; /* bytes already at addr on input, words taken on output */
+};
 
-  if (bops->append_null_part)
-    part_hdr_count = bif_cfg->nodes_num + 1;
-  else
-    part_hdr_count = bif_cfg->nodes_num;
+/* Register the inputs which get processed when loading, so the images
+ * of a batch sharing an input process it only once */
+error share_boot_image_inputs(bootrom_layout_t *layout, cache_mem_t *mem) {
+  bootrom_part_layout_t *part;
+  uint32_t i;
+  error err;
 
-  bootrom_partition_hdr_t part_hdr[part_hdr_count];
-  bootrom_img_hdr_t img_hdr[bif_cfg->nodes_num];
-  uint32_t img_size;
+  for (i = 0; i < layout->parts_num; i++) {
+    part = &layout->parts[i];
 
-  bootrom_img_hdr_tab_t img_hdr_tab;
+    /* The regions of split files are plain copies */
+    if (part->region.size)
+      continue;
 
-  img_hdr_tab.hdrs_count = 0;
-  for (i = 0; i < bif_cfg->nodes_num; i++) {
-    if (bif_cfg->nodes[i].is_file && !bif_cfg->nodes[i].pmufw_image)
-      img_hdr_tab.hdrs_count++;
+    switch (get_file_magic(&part->file)) {
+    case FILE_MAGIC_ELF:
+    case FILE_MAGIC_XILINXBIT_0:
+      if ((err = cache_mem_expect(mem, &part->file)))
+        return err;
+      break;
+    default:
+      break;
+    }
   }
 
-  /* Initialize offsets */
-  bops->init_offs(img_ptr, img_hdr_tab.hdrs_count, &offs);
+  if (layout->pmufw.data && (err = cache_mem_expect(mem, &layout->pmufw)))
+    return err;
 
-  /* Initialize header */
-  bops->init_header(&hdr, &offs);
+  return SUCCESS;
+}
 
-  /* Iterate through the images and write them */
-  for (i = 0, f = 0; i < bif_cfg->nodes_num; i++) {
-    /* i - index of all bif nodes
-     * f - index of bif node excluding non-file ones */
+/* Prepares the loads of all the partitions of the image, the PMU
+ * firmware (if any) is loaded here already. Every partition has its
+ * own slot in the layout, so they can be loaded independently of each
+ * other with load_boot_image_part. */
+error begin_boot_image(bootrom_build_t *build,
+                       uint32_t *img_ptr,
+                       bif_cfg_t *bif_cfg,
+                       bootrom_ops_t *bops,
+                       bootrom_layout_t *layout,
+                       const cache_t *cache) {
+  bootrom_load_task_t *task;
+  bootrom_part_layout_t *part;
+  bif_node_t *node;
+  uint64_t pmufw_img_load;
+  uint64_t pmufw_img_entry;
+  uint32_t pmufw_img_size;
+  uint8_t pmufw_img_nbits;
+  uint32_t i;
+  error err;
 
-    /* Skip if param will not include a file */
-    if (!bif_cfg->nodes[i].is_file)
-      continue;
+  memset(build, 0x0, sizeof(*build));
+  build->img_ptr = img_ptr;
+  build->bif_cfg = bif_cfg;
+  build->bops = bops;
+  build->layout = layout;
+  build->cache = cache;
+  build->tasks_num = layout->parts_num;
 
-    if (bif_cfg->nodes[i].pmufw_image) {
-      /* For now just assume the firmware is always the maximum length */
-      hdr.pmufw_len = BOOTROM_PMUFW_MAX_SIZE;
-      hdr.pmufw_total_len = hdr.pmufw_len;
+  /* Initialize offsets */
+  bops->init_offs(img_ptr, layout->imgs_count, layout->parts_num, &build->offs);
 
-      /* Prepare the array for the firmware */
-      memset(pmufw_img, 0x00, sizeof(pmufw_img));
+  /* Initialize header */
+  bops->init_header(&build->hdr, &build->offs);
+
+  /* The per partition tables are sized from the plan and share a single
+   * block, the partition headers get one more entry for the null one */
+  build->tasks = calloc(1,
+                        layout->parts_num * sizeof(*build->tasks) +
+                          (layout->parts_num + 1) * sizeof(*build->part_hdr) +
+                          layout->imgs_count * sizeof(*build->img_hdr));
+  if (!build->tasks) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
 
-      /* Open pmu file */
-      if (stat(bif_cfg->nodes[i].fname, &pmufile_stat)) {
-        errorf("could not stat file: %s\n", bif_cfg->nodes[i].fname);
-        return ERROR_BOOTROM_NOFILE;
-      }
-      if (!S_ISREG(pmufile_stat.st_mode)) {
-        errorf("not a regular file: %s\n", bif_cfg->nodes[i].fname);
-        return ERROR_BOOTROM_NOFILE;
-      }
-      err = elf_append(pmufw_img,
-                       bif_cfg->nodes[i].fname,
-                       hdr.pmufw_len,
-                       &pmufw_img_size,
-                       &pmufw_img_nbits,
-                       &pmufw_img_load,
-                       &pmufw_img_entry);
+  build->part_hdr = (bootrom_partition_hdr_t *) (build->tasks + layout->parts_num);
+  build->img_hdr = (bootrom_img_hdr_t *) (build->part_hdr + layout->parts_num + 1);
+
+  for (i = 0; i < layout->parts_num; i++) {
+    part = &layout->parts[i];
+    node = &bif_cfg->nodes[part->node];
+
+    task = &build->tasks[i];
+    task->addr = img_ptr + part->offset;
+    task->node = node;
+    task->part = part;
+    task->part_hdr = &build->part_hdr[i];
+
+    /* The partition is finished relative to its own slot */
+    task->offs = build->offs;
+    task->offs.coff = task->addr;
+
+    task->img_size = 0;
+
+    /* Flatten the PMU firmware straight in front of the bootloader */
+    if (node->bootloader && layout->pmufw_size) {
+      err = cached_elf_append(task->addr,
+                              &layout->pmufw,
+                              layout->pmufw_size,
+                              cache,
+                              &pmufw_img_size,
+                              &pmufw_img_nbits,
+                              &pmufw_img_load,
+                              &pmufw_img_entry);
       if (err) {
-        errorf("failed to parse ELF file: %s\n", bif_cfg->nodes[i].fname);
+        errorf("failed to parse ELF file: %s\n", bif_cfg->nodes[layout->pmufw_idx].fname);
+        cancel_boot_image(build);
         return ERROR_BOOTROM_ELF;
       }
-      continue;
-    }
 
-    if (bif_cfg->nodes[i].offset != 0 &&
-        (img_ptr + bif_cfg->nodes[i].offset / sizeof(uint32_t)) < offs.coff) {
-      errorf("binary sections overlapping.\n");
-      return ERROR_BOOTROM_SEC_OVERLAP;
-    } else {
-      /* Add 0xFF padding until this binary */
-      while (offs.coff < (bif_cfg->nodes[i].offset / sizeof(uint32_t) + img_ptr)) {
-        memset(offs.coff, 0xFF, sizeof(uint32_t));
-        offs.coff++;
-      }
-    }
+      /* Zero the alignment padding up to the bootloader */
+      memset((uint8_t *) task->addr + pmufw_img_size, 0x0, layout->pmufw_size - pmufw_img_size);
 
-    /* Append file content to memory */
-    if (bif_cfg->nodes[i].bootloader && hdr.pmufw_len) {
-      /* This is a bootloader image and we have a pmu fw waiting */
-      memcpy(offs.coff, pmufw_img, hdr.pmufw_len);
-      img_size = hdr.pmufw_len;
-    } else {
-      img_size = 0;
+      build->hdr.pmufw_len = layout->pmufw_size;
+      build->hdr.pmufw_total_len = build->hdr.pmufw_len;
+      task->img_size = build->hdr.pmufw_len;
     }
+  }
 
-    err =
-      append_file_to_image(offs.coff, bops, &offs, bif_cfg->nodes[i], &(part_hdr[f]), &img_size);
+  return SUCCESS;
+}
 
-    if (err) {
-      return err;
+/* Loads a single partition, this can be called from any thread */
+error load_boot_image_part(bootrom_build_t *build, uint32_t idx) {
+  bootrom_load_task_t *task = &build->tasks[idx];
+
+  return append_file_to_image(task->addr,
+                              build->bops,
+                              &task->offs,
+                              *task->node,
+                              task->part,
+                              task->part_hdr,
+                              build->cache,
+                              &task->img_size);
+}
+
+/* Drops an image which is not going to be finished */
+void cancel_boot_image(bootrom_build_t *build) {
+  free(build->tasks);
+  build->tasks = NULL;
+}
+
+/* run_parallel callback loading a single partition */
+static error load_partition(void *arg, uint32_t idx) {
+  return load_boot_image_part(arg, idx);
+}
+
+/* Returns total size of the created image via the last argument.
+ * The regular return value is the error code. */
+error create_boot_image(uint32_t *img_ptr,
+                        bif_cfg_t *bif_cfg,
+                        bootrom_ops_t *bops,
+                        bootrom_layout_t *layout,
+                        unsigned int jobs,
+                        const cache_t *cache,
+                        uint32_t *total_size) {
+  bootrom_build_t build;
+  error err;
+
+  if ((err = begin_boot_image(&build, img_ptr, bif_cfg, bops, layout, cache)))
+    return err;
+
+  if ((err = run_parallel(jobs, build.tasks_num, load_partition, &build))) {
+    cancel_boot_image(&build);
+    return err;
+  }
+
+  return finish_boot_image(&build, total_size);
+}
+
+/* Fills the gaps between the loaded partitions and writes all the
+ * headers, returns total size of the image via the last argument */
+error finish_boot_image(bootrom_build_t *build, uint32_t *total_size) {
+  bif_cfg_t *bif_cfg = build->bif_cfg;
+  bootrom_ops_t *bops = build->bops;
+  bootrom_layout_t *layout = build->layout;
+  bootrom_partition_hdr_t *part_hdr = build->part_hdr;
+  bootrom_img_hdr_t *img_hdr = build->img_hdr;
+  bootrom_load_task_t *tasks = build->tasks;
+  uint32_t *img_ptr = build->img_ptr;
+  bootrom_hdr_t hdr = build->hdr;
+  bootrom_offs_t offs = build->offs;
+  uint32_t i, j, f;
+  int img_term_n = 0;
+  uint8_t img_name[BOOTROM_IMG_MAX_NAME_LEN];
+  uint32_t img_size;
+  bootrom_part_layout_t *part;
+  bif_node_t *node;
+  bootrom_img_hdr_tab_t img_hdr_tab;
+
+  img_hdr_tab.hdrs_count = layout->parts_num;
+
+  /* Iterate through the loaded partitions and fill the gaps and headers */
+  for (i = 0, f = 0; i < layout->parts_num; i++) {
+    /* i - index of the partition
+     * f - index of the image, split files have a single one */
+    part = &layout->parts[i];
+    node = &bif_cfg->nodes[part->node];
+
+    /* Add 0xFF padding until this binary, overlaps were checked when planning */
+    while (offs.coff < tasks[i].addr) {
+      memset(offs.coff, 0xFF, sizeof(uint32_t));
+      offs.coff++;
     }
 
+    img_size = tasks[i].img_size;
+
     /* Check if dealing with bootloader (size is in words - thus x 4) */
-    if (bif_cfg->nodes[i].bootloader) {
-      bops->setup_fsbl_at_curr_off(&hdr, &offs, (part_hdr[f].pd_len * 4) - hdr.pmufw_len);
+    if (node->bootloader) {
+      bops->setup_fsbl_at_curr_off(&hdr, &offs, (part_hdr[i].pd_len * 4) - hdr.pmufw_len);
     }
 
     /* Update the offset, skip padding for the last image */
-    if (i == bif_cfg->nodes_num - 1) {
-      offs.coff += part_hdr[f].pd_len;
+    if (i == layout->parts_num - 1 && part->node == bif_cfg->nodes_num - 1) {
+      offs.coff += part_hdr[i].pd_len;
     } else {
       offs.coff += img_size;
     }
 
+    /* The other partitions of a split file are counted by its image */
+    if (i > 0 && layout->parts[i - 1].node == part->node) {
+      img_hdr[f - 1].name_len++;
+      continue;
+    }
+
     /* Create image headers for all of them */
     img_hdr[f].part_count = 0x0;
+    img_hdr[f].part_hdr_off =
+      (offs.part_hdr_off + i * sizeof(bootrom_partition_hdr_t)) / sizeof(uint32_t);
 
     /* filling this field as a helper */
-    img_hdr[f].name_len = strlen(basename(bif_cfg->nodes[i].fname));
+    img_hdr[f].name_len = strlen(basename(node->fname));
 
     /* Fill the name variable with zeroes */
     memset(img_name, 0x0, BOOTROM_IMG_MAX_NAME_LEN);
 
     /* Temporarily read the name */
-    memcpy(img_name, basename(bif_cfg->nodes[i].fname), img_hdr[f].name_len);
+    memcpy(img_name, basename(node->fname), img_hdr[f].name_len);
 
     /* Calculate number of string terminators, this should be 32b
      * however if the name length is divisible by 4 the bootgen
@@ -467,14 +1035,15 @@ error create_boot_image(uint32_t *img_ptr,
     /* Name length is not really the length of the name.
      * According to the documentation it is the value of the
      * actual partition count, however the bootgen binary
-     * always sets this field to 1. */
+     * always sets this field to 1. We do the same unless
+     * the file is split into more partitions. */
     img_hdr[f].name_len = 0x1;
 
     f++;
   }
 
   /* Create the image header table */
-  bops->init_img_hdr_tab(&img_hdr_tab, img_hdr, part_hdr, &offs);
+  bops->init_img_hdr_tab(&img_hdr_tab, img_hdr, layout->imgs_count, part_hdr, &offs);
 
   /* Copy the image header as all the fields should be filled by now */
   memcpy(offs.hoff, &(img_hdr_tab), sizeof(img_hdr_tab));
@@ -503,7 +1072,7 @@ error create_boot_image(uint32_t *img_ptr,
 
   /* Recalculate partition hdr end offset/padding */
   if (offs.part_hdr_end_off) {
-    offs.part_hdr_end_off = BOOTROM_PART_HDR_OFF +
+    offs.part_hdr_end_off = offs.part_hdr_off +
                             (img_hdr_tab.hdrs_count * sizeof(struct bootrom_partition_hdr_t)) +
                             BOOTROM_PART_HDR_END_PADD;
   }
@@ -523,7 +1092,249 @@ error create_boot_image(uint32_t *img_ptr,
   /* Finally write the header to the image */
   memcpy(img_ptr, &(hdr), sizeof(hdr));
 
+  cancel_boot_image(build);
+
   *total_size = offs.coff - img_ptr;
 
   return SUCCESS;
 }
+
+/* Unpack an image name packed in big-endian words by create_boot_image */
+static void get_img_name(char *dst, bootrom_img_hdr_t *img) {
+  uint32_t word;
+  int i, j, p = 0;
+
+  for (i = 0; i < BOOTROM_IMG_MAX_NAME_LEN; i += sizeof(word)) {
+    memcpy(&word, &img->name[i], sizeof(word));
+    if (!word)
+      break;
+
+    for (j = i + 3; j >= i; j--)
+      if (img->name[j] && img->name[j] != 0xFF)
+        dst[p++] = img->name[j];
+  }
+  dst[p] = '\0';
+}
+
+/* Walk the image header chain of an existing image, *img is NULL to get
+ * the first header. The image length is given in words and every offset
+ * is checked against it before use. The headers are written one after
+ * another, so a chain going back is broken (and could loop forever). */
+static error get_next_img_hdr(uint32_t *img_ptr, uint32_t img_len, bootrom_img_hdr_t **img) {
+  bootrom_img_hdr_tab_t *tab = (bootrom_img_hdr_tab_t *) (img_ptr + sizeof(bootrom_hdr_t) / 4);
+  uint32_t *field = *img ? &(*img)->next_img_off : &tab->part_img_hdr_off;
+  uint32_t prev = *img ? (uint32_t *) *img - img_ptr : 0;
+
+  if (!*field)
+    return ERROR_ITERATION_END;
+
+  if (*field <= prev || *field > img_len - sizeof(bootrom_img_hdr_t) / sizeof(uint32_t)) {
+    errorf("0x%08x: wrong offset 0x%08x\n", (uint32_t) (field - img_ptr) * 4, *field);
+    return ERROR_BIN_WADDR;
+  }
+
+  *img = (bootrom_img_hdr_t *) (img_ptr + *field);
+  return SUCCESS;
+}
+
+/* Get the n-th partition header of an image header and its data offset */
+static error get_img_part_hdr(uint32_t *img_ptr,
+                              uint32_t img_len,
+                              bootrom_ops_t *bops,
+                              bootrom_img_hdr_t *img,
+                              uint32_t n,
+                              bootrom_partition_hdr_t **part_hdr,
+                              bif_node_t *node,
+                              uint32_t *data_off) {
+  uint64_t off = img->part_hdr_off + (uint64_t) n * sizeof(bootrom_partition_hdr_t) / 4;
+
+  if (off > img_len - sizeof(bootrom_partition_hdr_t) / sizeof(uint32_t)) {
+    errorf("0x%08x: wrong offset 0x%08x\n",
+           (uint32_t) ((uint32_t *) &img->part_hdr_off - img_ptr) * 4,
+           img->part_hdr_off);
+    return ERROR_BIN_WADDR;
+  }
+
+  *part_hdr = (bootrom_partition_hdr_t *) (img_ptr + off);
+
+  memset(node, 0x0, sizeof(*node));
+  bops->read_part_hdr(*part_hdr, node, data_off);
+
+  if (*data_off >= img_len) {
+    errorf("0x%08x: wrong offset 0x%08x\n", (uint32_t) off * 4, *data_off);
+    return ERROR_BIN_WADDR;
+  }
+
+  return SUCCESS;
+}
+
+/* Plans replacing the contents of a single partition of an existing
+ * image of img_len words with the file fname. The new data has to fit
+ * in the space between the partition and the next one, only the last
+ * partition can grow (or shrink) the image. Nothing is written yet. */
+error plan_boot_image_patch(uint32_t *img_ptr,
+                            uint32_t img_len,
+                            bootrom_ops_t *bops,
+                            const char *name,
+                            const char *fname,
+                            bootrom_patch_t *patch) {
+  bootrom_hdr_t *hdr = (bootrom_hdr_t *) img_ptr;
+  bootrom_partition_hdr_t *part_hdr, *other_hdr;
+  bootrom_img_hdr_t *img, *found;
+  bif_node_t other;
+  char img_name[BOOTROM_IMG_MAX_NAME_LEN + 1];
+  uint32_t data_off, other_off, slot_end, len, padded_len, i;
+  bool last = true;
+  error err;
+
+  memset(patch, 0x0, sizeof(*patch));
+
+  if (img_len < (sizeof(bootrom_hdr_t) + sizeof(bootrom_img_hdr_tab_t)) / sizeof(uint32_t) ||
+      hdr->width_detect != BOOTROM_WIDTH_DETECT) {
+    errorf("not a boot image\n");
+    return ERROR_BIN_WADDR;
+  }
+
+  /* Find the image by name */
+  found = NULL;
+  for (img = NULL; !found && (err = get_next_img_hdr(img_ptr, img_len, &img)) == SUCCESS;) {
+    get_img_name(img_name, img);
+    if (strcmp(img_name, name) == 0)
+      found = img;
+  }
+  if (err && err != ERROR_ITERATION_END)
+    return err;
+
+  if (!found) {
+    errorf("no partition named %s in the image\n", name);
+    return ERROR_BOOTROM_NOFILE;
+  }
+
+  /* The partitions of a split file can only be replaced together */
+  if (found->name_len > 1) {
+    errorf("partition %s is split, it can't be replaced\n", name);
+    return ERROR_BOOTROM_UNSUPPORTED;
+  }
+
+  err = get_img_part_hdr(img_ptr, img_len, bops, found, 0, &part_hdr, &patch->node, &data_off);
+  if (err)
+    return err;
+
+  /* The partition can grow up to the next partition */
+  slot_end = img_len;
+  for (img = NULL; (err = get_next_img_hdr(img_ptr, img_len, &img)) == SUCCESS;) {
+    for (i = 0; i < img->name_len || i == 0; i++) {
+      err = get_img_part_hdr(img_ptr, img_len, bops, img, i, &other_hdr, &other, &other_off);
+      if (err)
+        return err;
+      if (other_off > data_off) {
+        last = false;
+        if (other_off < slot_end)
+          slot_end = other_off;
+      }
+    }
+  }
+  if (err != ERROR_ITERATION_END)
+    return err;
+
+  /* The PMU firmware in front of the bootloader stays where it is */
+  patch->node.bootloader = hdr->src_offset == data_off * sizeof(uint32_t);
+  patch->node.is_file = 1;
+  if (patch->node.bootloader && bops->pmufw_in_header)
+    patch->pmufw_len = hdr->pmufw_len;
+
+  patch->node.fname = (char *) fname;
+
+  if ((err = map_file(fname, &patch->part.file)))
+    return err;
+
+  if ((err = unpack_input(&patch->node, &patch->part.file)) ||
+      (err = get_payload_size(&patch->part.file, &patch->node, &patch->part.size))) {
+    release_boot_image_patch(patch);
+    return err;
+  }
+
+  /* Words taken by the new data, the same way finish_part_hdr counts them */
+  len = (patch->pmufw_len + patch->part.size + 3) / sizeof(uint32_t);
+  if (bops->append_bitstream_noop && get_file_magic(&patch->part.file) == FILE_MAGIC_XILINXBIT_0)
+    len++;
+  padded_len = (len + BOOTROM_IMG_PADDING_SIZE / 4 - 1) & ~(BOOTROM_IMG_PADDING_SIZE / 4 - 1);
+
+  patch->hdr_off = (uint32_t *) part_hdr - img_ptr;
+  patch->data_off = data_off;
+
+  if (last) {
+    /* The last partition is not padded in the image, but the padding
+     * is still written while loading it */
+    patch->img_len = data_off + len;
+    patch->mem_len = data_off + padded_len > img_len ? data_off + padded_len : img_len;
+  } else if (padded_len > slot_end - data_off) {
+    errorf("%s does not fit in partition %s (%u bytes needed, %u available)\n",
+           fname,
+           name,
+           padded_len * 4,
+           (slot_end - data_off) * 4);
+    release_boot_image_patch(patch);
+    return ERROR_BOOTROM_NOMEM;
+  } else {
+    patch->img_len = img_len;
+    patch->mem_len = img_len;
+  }
+
+  /* Whatever the old data took beyond the new one gets 0xFF filled */
+  patch->old_end = data_off + ((part_hdr->total_len + BOOTROM_IMG_PADDING_SIZE / 4 - 1) &
+                               ~(BOOTROM_IMG_PADDING_SIZE / 4 - 1));
+  if (patch->old_end > slot_end)
+    patch->old_end = slot_end;
+  patch->slot_end = slot_end;
+
+  return SUCCESS;
+}
+
+void release_boot_image_patch(bootrom_patch_t *patch) {
+  unmap_file(&patch->part.file);
+}
+
+/* Applies a planned patch to the image, which has to be at least
+ * patch->mem_len words long now. Only the partition data, its header
+ * and (for the bootloader) the main header are written. */
+error patch_boot_image(uint32_t *img_ptr,
+                       bootrom_ops_t *bops,
+                       bootrom_patch_t *patch,
+                       const cache_t *cache) {
+  bootrom_hdr_t *hdr = (bootrom_hdr_t *) img_ptr;
+  bootrom_partition_hdr_t *part_hdr = (bootrom_partition_hdr_t *) (img_ptr + patch->hdr_off);
+  bootrom_partition_hdr_t new_hdr;
+  bootrom_offs_t offs;
+  uint32_t img_size = patch->pmufw_len;
+  error err;
+
+  /* Load the partition into its slot just like create_boot_image does */
+  memset(&offs, 0x0, sizeof(offs));
+  offs.img_ptr = img_ptr;
+  offs.coff = img_ptr + patch->data_off;
+
+  /* The end of a partial last word is not written when loading, it's
+   * zero in a newly created image so it has to be zero here too */
+  if (patch->part.size)
+    offs.coff[(patch->pmufw_len + patch->part.size - 1) / sizeof(uint32_t)] = 0;
+
+  err = append_file_to_image(
+    offs.coff, bops, &offs, patch->node, &patch->part, &new_hdr, cache, &img_size);
+  if (err)
+    return err;
+
+  if (patch->data_off + img_size < patch->old_end)
+    memset(offs.coff + img_size,
+           0xFF,
+           (patch->old_end - patch->data_off - img_size) * sizeof(uint32_t));
+
+  bops->relink_part_hdr(&new_hdr, part_hdr);
+  memcpy(part_hdr, &new_hdr, sizeof(new_hdr));
+
+  /* Point the main header at the new bootloader */
+  if (patch->node.bootloader)
+    bops->setup_fsbl_at_curr_off(hdr, &offs, (new_hdr.pd_len * 4) - patch->pmufw_len);
+
+  return SUCCESS;
+}
@@ -2,9 +2,8 @@
 #define BOOTROM_H
 
 #include <bif.h>
-#include <gelf.h>
-
-#define NOMASK 0xFFFFFFFF
+#include <cache.h>
+#include <file/elf.h>
 
 /* BootROM Header based on ug585 and ug1085 */
 typedef struct bootrom_hdr_t {
@@ -250,6 +249,10 @@ typedef struct linux_image_header_t {
 #define FILE_MAGIC_LINUX 0x56190527
 #define FILE_MAGIC_DTB   0xedfe0dd0
 
+#define FILE_MAGIC_GZIP 0x00088b1f /* the fourth byte holds flags */
+#define FILE_MAGIC_XZ   0x587a37fd
+#define FILE_MAGIC_ZSTD 0xfd2fb528
+
 #define FILE_XILINXBIT_SEC_START 13
 #define FILE_XILINXBIT_SEC_DATA  'e'
 
@@ -293,14 +296,14 @@ extern mask_name_t bootrom_part_attr_a5x_exec_s_names[];
 extern mask_name_t bootrom_part_attr_exc_lvl_names[];
 extern mask_name_t bootrom_part_attr_trust_zone_names[];
 
-uint32_t map_name_to_mask(mask_name_t mask_names[], char *name);
 char *map_mask_to_name(mask_name_t mask_names[], uint32_t mask);
 
 /* bootrom operations */
 typedef struct bootrom_ops_t {
-  /* Initialize offsets - image pointer should be
-   * set before this one is called */
-  error (*init_offs)(uint32_t *, int, bootrom_offs_t *);
+  /* Initialize offsets for the given numbers of image and partition
+   * headers - image pointer should be set before this one is called,
+   * if it is NULL only the plain offset values are set */
+  error (*init_offs)(uint32_t *, uint32_t imgs_count, uint32_t parts_count, bootrom_offs_t *);
 
   /* Initialize the main bootrom header */
   error (*init_header)(bootrom_hdr_t *, bootrom_offs_t *);
@@ -308,9 +311,11 @@ typedef struct bootrom_ops_t {
   /* Setup bootloader at the current offset */
   error (*setup_fsbl_at_curr_off)(bootrom_hdr_t *, bootrom_offs_t *, uint32_t img_len);
 
-  /* Prepare image header table */
+  /* Prepare image header table, the image headers already point at
+   * their first partition header and hold their partition count */
   error (*init_img_hdr_tab)(bootrom_img_hdr_tab_t *,
                             bootrom_img_hdr_t *,
+                            uint32_t imgs_count,
                             bootrom_partition_hdr_t *,
                             bootrom_offs_t *);
 
@@ -320,19 +325,132 @@ typedef struct bootrom_ops_t {
   error (*init_part_hdr_elf)(bootrom_partition_hdr_t *,
                              bif_node_t *,
                              uint32_t *size,
-                             uint32_t load,
-                             uint32_t entry,
+                             uint64_t load,
+                             uint64_t entry,
                              uint8_t nbits);
   error (*init_part_hdr_bitstream)(bootrom_partition_hdr_t *, bif_node_t *);
   error (*init_part_hdr_linux)(bootrom_partition_hdr_t *, bif_node_t *, linux_image_header_t *);
   /* The finish function is common for all partition types */
   error (*finish_part_hdr)(bootrom_partition_hdr_t *, uint32_t *img_size, bootrom_offs_t *);
 
+  /* Patching related callbacks, the first one recovers the BIF attributes
+   * and the data offset (in words) of an existing partition header, the
+   * second copies links to other headers from the old header to the new
+   * one and updates its checksum */
+  error (*read_part_hdr)(bootrom_partition_hdr_t *, bif_node_t *, uint32_t *data_off);
+  error (*relink_part_hdr)(bootrom_partition_hdr_t *, bootrom_partition_hdr_t *old);
+
   /* Some archs require a null partition at the end */
   uint8_t append_null_part;
+
+  /* Some archs append a noop word after each bitstream */
+  uint8_t append_bitstream_noop;
+
+  /* Some archs keep the PMU firmware length in the main header */
+  uint8_t pmufw_in_header;
 } bootrom_ops_t;
 
-uint32_t estimate_boot_image_size(bif_cfg_t *);
-error create_boot_image(uint32_t *, bif_cfg_t *, bootrom_ops_t *, uint32_t *);
+/* Placement of a single partition in the output image. A BIF node gets
+ * a partition for every region of its ELF file if the file is split. */
+typedef struct bootrom_part_layout_t {
+  mapped_file_t file;  /* the input, mapped until the layout is released */
+  uint32_t node;       /* index of the BIF node */
+  elf_region_t region; /* the part of a split ELF file, size is 0 if not split */
+  uint32_t size;       /* payload size in bytes */
+  uint32_t offset;     /* word offset of the partition data */
+  uint32_t len;        /* words taken by the partition, including padding */
+} bootrom_part_layout_t;
+
+/* Exact layout of the whole image, computed before any data is copied */
+typedef struct bootrom_layout_t {
+  bootrom_part_layout_t *parts; /* one entry per partition, in image order */
+  uint32_t parts_num;
+  uint32_t parts_avail;
+
+  uint32_t imgs_count; /* BIF nodes with an image header */
+  mapped_file_t pmufw; /* PMU firmware put in front of the bootloader */
+  uint32_t pmufw_size; /* bytes taken by it */
+  uint32_t pmufw_idx;  /* BIF node holding the PMU firmware */
+
+  uint32_t bins_off; /* byte offset of the first partition */
+  uint32_t img_size; /* final image size in bytes */
+  uint32_t mem_size; /* bytes written while building, includes trailing padding */
+} bootrom_layout_t;
+
+/* Supplies the payload of a node from elsewhere than the file it names,
+ * e.g. from memory. Returns false to have the named file mapped. */
+typedef bool (*bootrom_input_fn)(void *arg, const bif_node_t *node, mapped_file_t *file);
+
+error plan_boot_image(bif_cfg_t *, bootrom_ops_t *, bootrom_layout_t *);
+error plan_boot_image_from(
+  bif_cfg_t *, bootrom_ops_t *, bootrom_input_fn, void *arg, bootrom_layout_t *);
+void release_boot_image_layout(bootrom_layout_t *);
+error create_boot_image(uint32_t *,
+                        bif_cfg_t *,
+                        bootrom_ops_t *,
+                        bootrom_layout_t *,
+                        unsigned int jobs,
+                        const cache_t *,
+                        uint32_t *);
+
+/* An image being built in steps, create_boot_image does all of them at
+ * once. Splitting it lets the partitions of many images be loaded by
+ * the same threads: begin_boot_image prepares tasks_num partition loads,
+ * load_boot_image_part does one of them (in any order, from any thread)
+ * and finish_boot_image writes the headers once they're all done. */
+typedef struct bootrom_load_task_t bootrom_load_task_t;
+
+typedef struct bootrom_build_t {
+  uint32_t *img_ptr;
+  bif_cfg_t *bif_cfg;
+  bootrom_ops_t *bops;
+  bootrom_layout_t *layout;
+  const cache_t *cache;
+
+  bootrom_hdr_t hdr;
+  bootrom_offs_t offs;
+
+  bootrom_load_task_t *tasks;
+  uint32_t tasks_num;
+  bootrom_partition_hdr_t *part_hdr;
+  bootrom_img_hdr_t *img_hdr;
+} bootrom_build_t;
+
+error share_boot_image_inputs(bootrom_layout_t *, cache_mem_t *);
+error begin_boot_image(bootrom_build_t *,
+                       uint32_t *,
+                       bif_cfg_t *,
+                       bootrom_ops_t *,
+                       bootrom_layout_t *,
+                       const cache_t *);
+error load_boot_image_part(bootrom_build_t *, uint32_t idx);
+error finish_boot_image(bootrom_build_t *, uint32_t *);
+void cancel_boot_image(bootrom_build_t *);
+
+/* Replacement of a single partition in an existing image */
+typedef struct bootrom_patch_t {
+  bootrom_part_layout_t part; /* the new file, mapped until the patch is released */
+  bif_node_t node;            /* attributes recovered from the partition header */
+  uint32_t pmufw_len;         /* bytes of PMU firmware kept in front of the data */
+
+  uint32_t hdr_off;  /* word offset of the partition header */
+  uint32_t data_off; /* word offset of the partition data */
+  uint32_t old_end;  /* word offset of the end of the old data */
+  uint32_t slot_end; /* word offset of the next partition or of the image end */
+  uint32_t mem_len;  /* image words written while patching */
+  uint32_t img_len;  /* image words after patching */
+} bootrom_patch_t;
+
+error plan_boot_image_patch(uint32_t *img_ptr,
+                            uint32_t img_len,
+                            bootrom_ops_t *,
+                            const char *name,
+                            const char *fname,
+                            bootrom_patch_t *);
+void release_boot_image_patch(bootrom_patch_t *);
+error patch_boot_image(uint32_t *img_ptr,
+                       bootrom_ops_t *,
+                       bootrom_patch_t *,
+                       const cache_t *);
 
 #endif /* BOOTROM_H */
@@ -0,0 +1,652 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cache.h>
+#include <common.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Bumped whenever the processing routines change their output,
+ * entries written by other versions are simply not used */
+#define CACHE_MAGIC   0x43424b4d /* "MKBC" */
+#define CACHE_VERSION 2
+
+typedef struct cache_hdr_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t len;
+  uint32_t size;
+  uint64_t load;
+  uint64_t entry;
+  uint8_t nbits;
+  uint8_t pad[7];
+} cache_hdr_t;
+
+/* xxHash64, fast enough not to matter next to the processing itself */
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  return rotl64(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const uint8_t *p, size_t len, uint64_t seed) {
+  const uint8_t *end = p + len;
+  uint64_t v1, v2, v3, v4, h;
+
+  if (len >= 32) {
+    v1 = seed + XXH_P1 + XXH_P2;
+    v2 = seed + XXH_P2;
+    v3 = seed;
+    v4 = seed - XXH_P1;
+
+    for (; p + 32 <= end; p += 32) {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+    }
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = seed + XXH_P5;
+  }
+
+  h += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+  }
+
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32(p) * XXH_P1;
+    h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+
+  for (; p < end; p++) {
+    h ^= *p * XXH_P5;
+    h = rotl64(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/* Create the cache directory unless it is already there */
+error cache_init_dir(const char *dir) {
+  struct stat st;
+
+  if (mkdir(dir, 0777) && errno != EEXIST) {
+    errorf("could not create cache directory: %s\n", dir);
+    return ERROR_CANT_WRITE;
+  }
+
+  if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+    errorf("not a directory: %s\n", dir);
+    return ERROR_CANT_WRITE;
+  }
+
+  return SUCCESS;
+}
+
+/* The key is a 128 bit hash of the input (two differently seeded
+ * 64 bit hashes) followed by the kind of processing applied to it */
+void cache_make_key(cache_key_t *key, const mapped_file_t *input, cache_kind_t kind) {
+  uint64_t h0, h1;
+
+  h0 = xxh64(input->data, input->size, 0);
+  h1 = xxh64(input->data, input->size, XXH_P3);
+
+  snprintf(key->name,
+           sizeof(key->name),
+           "%016llx%016llx.%s",
+           (unsigned long long) h0,
+           (unsigned long long) h1,
+           kind == CACHE_KIND_ELF ? "elf" : "bit");
+}
+
+static bool cache_path(char *path, size_t n, const char *dir, const char *name) {
+  return snprintf(path, n, "%s/%s", dir, name) < (int) n;
+}
+
+bool cache_load(
+  const char *dir, const cache_key_t *key, void *dst, uint32_t max_len, cache_meta_t *meta) {
+  char path[PATH_MAX];
+  cache_hdr_t hdr;
+  struct stat st;
+  uint8_t *data;
+  bool hit = false;
+  int fd;
+
+  if (!cache_path(path, sizeof(path), dir, key->name))
+    return false;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return false;
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(hdr)) {
+    close(fd);
+    return false;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  memcpy(&hdr, data, sizeof(hdr));
+
+  if (hdr.magic == CACHE_MAGIC && hdr.version == CACHE_VERSION && hdr.len <= max_len &&
+      (size_t) st.st_size - sizeof(hdr) == hdr.len) {
+    memcpy(dst, data + sizeof(hdr), hdr.len);
+
+    meta->len = hdr.len;
+    meta->size = hdr.size;
+    meta->load = hdr.load;
+    meta->entry = hdr.entry;
+    meta->nbits = hdr.nbits;
+    hit = true;
+  }
+
+  munmap(data, st.st_size);
+  return hit;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+  const uint8_t *ptr = data;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, ptr, len)) <= 0)
+      return false;
+    ptr += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+/* Entries are written to a temporary file and renamed into place,
+ * so concurrent builds sharing a cache never see partial entries */
+void cache_store(
+  const char *dir, const cache_key_t *key, const void *data, const cache_meta_t *meta) {
+  static atomic_uint tmp_count;
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  cache_hdr_t hdr;
+  bool ok;
+  int fd;
+
+  if (!cache_path(path, sizeof(path), dir, key->name))
+    return;
+
+  if (snprintf(tmp,
+               sizeof(tmp),
+               "%s/.%s.%ld.%u",
+               dir,
+               key->name,
+               (long) getpid(),
+               atomic_fetch_add(&tmp_count, 1)) >= (int) sizeof(tmp))
+    return;
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0)
+    return;
+
+  memset(&hdr, 0x0, sizeof(hdr));
+  hdr.magic = CACHE_MAGIC;
+  hdr.version = CACHE_VERSION;
+  hdr.len = meta->len;
+  hdr.size = meta->size;
+  hdr.load = meta->load;
+  hdr.entry = meta->entry;
+  hdr.nbits = meta->nbits;
+
+  ok = write_all(fd, &hdr, sizeof(hdr)) && write_all(fd, data, meta->len);
+  ok = !close(fd) && ok;
+
+  if (!ok || rename(tmp, path))
+    unlink(tmp);
+}
+
+/* In-memory cache entries go through these states, the entry
+ * is freed as soon as no more uses are expected */
+typedef enum cache_mem_state_t {
+  CACHE_MEM_EMPTY,      /* nobody has processed the input yet */
+  CACHE_MEM_PROCESSING, /* one of the users is processing it */
+  CACHE_MEM_READY,      /* the payload can be copied */
+} cache_mem_state_t;
+
+typedef struct cache_mem_entry_t {
+  struct cache_mem_entry_t *next;
+  uint64_t dev, ino;
+  int64_t mtime;
+  size_t size;
+
+  cache_mem_state_t state;
+  uint32_t uses; /* expected uses left */
+  cache_meta_t meta;
+  uint8_t *data;
+} cache_mem_entry_t;
+
+#define CACHE_MEM_BUCKETS 256
+
+struct cache_mem_t {
+  pthread_mutex_t lock;
+  pthread_cond_t ready; /* signaled when an entry stops being processed */
+  cache_mem_entry_t *buckets[CACHE_MEM_BUCKETS];
+};
+
+cache_mem_t *cache_mem_create(void) {
+  cache_mem_t *mem;
+
+  if (!(mem = calloc(1, sizeof(*mem)))) {
+    errorf("out of memory\n");
+    return NULL;
+  }
+
+  pthread_mutex_init(&mem->lock, NULL);
+  pthread_cond_init(&mem->ready, NULL);
+
+  return mem;
+}
+
+void cache_mem_destroy(cache_mem_t *mem) {
+  cache_mem_entry_t *entry, *next;
+  int i;
+
+  if (!mem)
+    return;
+
+  for (i = 0; i < CACHE_MEM_BUCKETS; i++) {
+    for (entry = mem->buckets[i]; entry; entry = next) {
+      next = entry->next;
+      free(entry->data);
+      free(entry);
+    }
+  }
+
+  pthread_cond_destroy(&mem->ready);
+  pthread_mutex_destroy(&mem->lock);
+  free(mem);
+}
+
+/* Find the link pointing at the entry of an input, or at the
+ * NULL at the end of its bucket, the lock has to be held */
+static cache_mem_entry_t **cache_mem_find(cache_mem_t *mem, const mapped_file_t *input) {
+  cache_mem_entry_t **link;
+
+  link = &mem->buckets[(input->ino ^ input->dev) % CACHE_MEM_BUCKETS];
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->dev == input->dev && (*link)->ino == input->ino &&
+        (*link)->mtime == input->mtime && (*link)->size == input->size)
+      break;
+  }
+
+  return link;
+}
+
+/* Use up a single use of the entry, the lock has to be held */
+static void cache_mem_release(cache_mem_t *mem, const mapped_file_t *input) {
+  cache_mem_entry_t **link = cache_mem_find(mem, input);
+  cache_mem_entry_t *entry = *link;
+
+  if (!entry || --entry->uses > 0)
+    return;
+
+  *link = entry->next;
+  free(entry->data);
+  free(entry);
+}
+
+error cache_mem_expect(cache_mem_t *mem, const mapped_file_t *input) {
+  cache_mem_entry_t **link, *entry;
+
+  /* Only files can be told apart */
+  if (!input->dev && !input->ino)
+    return SUCCESS;
+
+  pthread_mutex_lock(&mem->lock);
+
+  link = cache_mem_find(mem, input);
+  if (!(entry = *link)) {
+    if (!(entry = calloc(1, sizeof(*entry)))) {
+      pthread_mutex_unlock(&mem->lock);
+      errorf("out of memory\n");
+      return ERROR_NOMEM;
+    }
+
+    entry->dev = input->dev;
+    entry->ino = input->ino;
+    entry->mtime = input->mtime;
+    entry->size = input->size;
+    *link = entry;
+  }
+  entry->uses++;
+
+  pthread_mutex_unlock(&mem->lock);
+  return SUCCESS;
+}
+
+bool cache_mem_load(
+  cache_mem_t *mem, const mapped_file_t *input, void *dst, uint32_t max_len, cache_meta_t *meta) {
+  cache_mem_entry_t *entry;
+  bool hit;
+
+  pthread_mutex_lock(&mem->lock);
+
+  while ((entry = *cache_mem_find(mem, input)) && entry->state == CACHE_MEM_PROCESSING)
+    pthread_cond_wait(&mem->ready, &mem->lock);
+
+  if (!entry) {
+    pthread_mutex_unlock(&mem->lock);
+    return false;
+  }
+
+  if (entry->state == CACHE_MEM_EMPTY) {
+    entry->state = CACHE_MEM_PROCESSING;
+    pthread_mutex_unlock(&mem->lock);
+    return false;
+  }
+
+  /* The entry stays around until this use is released,
+   * so the copy can be done without holding the lock */
+  pthread_mutex_unlock(&mem->lock);
+
+  if ((hit = entry->meta.len <= max_len)) {
+    memcpy(dst, entry->data, entry->meta.len);
+    *meta = entry->meta;
+  }
+
+  pthread_mutex_lock(&mem->lock);
+  cache_mem_release(mem, input);
+  pthread_mutex_unlock(&mem->lock);
+
+  return hit;
+}
+
+void cache_mem_store(
+  cache_mem_t *mem, const mapped_file_t *input, const void *data, const cache_meta_t *meta) {
+  cache_mem_entry_t *entry;
+  uint8_t *copy = NULL;
+
+  pthread_mutex_lock(&mem->lock);
+
+  entry = *cache_mem_find(mem, input);
+  if (!entry || entry->state != CACHE_MEM_PROCESSING) {
+    pthread_mutex_unlock(&mem->lock);
+    return;
+  }
+
+  /* Nobody else is going to touch a processing entry, so the payload
+   * can be copied without holding the lock. There's no need to keep it
+   * if this is the last use. */
+  if (data && entry->uses > 1) {
+    pthread_mutex_unlock(&mem->lock);
+    copy = malloc(meta->len ? meta->len : 1);
+    if (copy)
+      memcpy(copy, data, meta->len);
+    pthread_mutex_lock(&mem->lock);
+  }
+
+  if (copy) {
+    entry->data = copy;
+    entry->meta = *meta;
+    entry->state = CACHE_MEM_READY;
+  } else {
+    entry->state = CACHE_MEM_EMPTY;
+  }
+
+  cache_mem_release(mem, input);
+  pthread_cond_broadcast(&mem->ready);
+  pthread_mutex_unlock(&mem->lock);
+}
+
+/* Entries of the bounded cache, the most recently used one is the
+ * head of the list and the tail is the first one to be evicted */
+typedef struct cache_lru_entry_t {
+  struct cache_lru_entry_t *next;             /* in the bucket */
+  struct cache_lru_entry_t *newer, *older; /* in the use order */
+  uint64_t dev, ino;
+  int64_t mtime;
+  size_t size;
+  cache_kind_t kind;
+
+  uint32_t readers; /* copies being made without the lock */
+  bool evicted;     /* freed by the last reader */
+  cache_meta_t meta;
+  uint8_t data[];
+} cache_lru_entry_t;
+
+#define CACHE_LRU_BUCKETS 1024
+
+struct cache_lru_t {
+  pthread_mutex_t lock;
+  size_t max_size, used;
+  cache_lru_entry_t *newest, *oldest;
+  cache_lru_entry_t *buckets[CACHE_LRU_BUCKETS];
+};
+
+cache_lru_t *cache_lru_create(size_t max_size) {
+  cache_lru_t *lru;
+
+  if (!(lru = calloc(1, sizeof(*lru)))) {
+    errorf("out of memory\n");
+    return NULL;
+  }
+
+  pthread_mutex_init(&lru->lock, NULL);
+  lru->max_size = max_size;
+
+  return lru;
+}
+
+void cache_lru_destroy(cache_lru_t *lru) {
+  cache_lru_entry_t *entry, *next;
+
+  if (!lru)
+    return;
+
+  for (entry = lru->newest; entry; entry = next) {
+    next = entry->older;
+    free(entry);
+  }
+
+  pthread_mutex_destroy(&lru->lock);
+  free(lru);
+}
+
+static inline cache_lru_entry_t **cache_lru_bucket(cache_lru_t *lru,
+                                                   const mapped_file_t *input) {
+  return &lru->buckets[(input->ino ^ input->dev ^ input->mtime) % CACHE_LRU_BUCKETS];
+}
+
+static cache_lru_entry_t **cache_lru_find(cache_lru_t *lru,
+                                          const mapped_file_t *input,
+                                          cache_kind_t kind) {
+  cache_lru_entry_t **link;
+
+  for (link = cache_lru_bucket(lru, input); *link; link = &(*link)->next) {
+    if ((*link)->dev == input->dev && (*link)->ino == input->ino &&
+        (*link)->mtime == input->mtime && (*link)->size == input->size &&
+        (*link)->kind == kind)
+      break;
+  }
+
+  return link;
+}
+
+static void cache_lru_unlink(cache_lru_t *lru, cache_lru_entry_t *entry) {
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    lru->newest = entry->older;
+
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    lru->oldest = entry->newer;
+}
+
+static void cache_lru_push(cache_lru_t *lru, cache_lru_entry_t *entry) {
+  entry->newer = NULL;
+  entry->older = lru->newest;
+
+  if (lru->newest)
+    lru->newest->newer = entry;
+  else
+    lru->oldest = entry;
+  lru->newest = entry;
+}
+
+/* Drop an entry found in the bucket of input, it's freed
+ * right away unless somebody is still copying it */
+static void cache_lru_evict(cache_lru_t *lru,
+                            const mapped_file_t *input,
+                            cache_lru_entry_t *entry) {
+  cache_lru_entry_t **link;
+
+  for (link = cache_lru_bucket(lru, input); *link != entry; link = &(*link)->next)
+    ;
+
+  *link = entry->next;
+  cache_lru_unlink(lru, entry);
+  lru->used -= entry->meta.len;
+
+  if (entry->readers)
+    entry->evicted = true;
+  else
+    free(entry);
+}
+
+/* Same as above for the least recently used entry */
+static void cache_lru_evict_oldest(cache_lru_t *lru) {
+  cache_lru_entry_t *entry = lru->oldest;
+  mapped_file_t input;
+
+  memset(&input, 0x0, sizeof(input));
+  input.dev = entry->dev;
+  input.ino = entry->ino;
+  input.mtime = entry->mtime;
+
+  cache_lru_evict(lru, &input, entry);
+}
+
+bool cache_lru_load(cache_lru_t *lru,
+                    const mapped_file_t *input,
+                    cache_kind_t kind,
+                    void *dst,
+                    uint32_t max_len,
+                    cache_meta_t *meta) {
+  cache_lru_entry_t *entry;
+
+  if (!input->dev && !input->ino)
+    return false;
+
+  pthread_mutex_lock(&lru->lock);
+
+  if (!(entry = *cache_lru_find(lru, input, kind)) || entry->meta.len > max_len) {
+    pthread_mutex_unlock(&lru->lock);
+    return false;
+  }
+
+  cache_lru_unlink(lru, entry);
+  cache_lru_push(lru, entry);
+  entry->readers++;
+
+  pthread_mutex_unlock(&lru->lock);
+
+  memcpy(dst, entry->data, entry->meta.len);
+  *meta = entry->meta;
+
+  pthread_mutex_lock(&lru->lock);
+  if (!--entry->readers && entry->evicted)
+    free(entry);
+  pthread_mutex_unlock(&lru->lock);
+
+  return true;
+}
+
+void cache_lru_store(cache_lru_t *lru,
+                     const mapped_file_t *input,
+                     cache_kind_t kind,
+                     const void *data,
+                     const cache_meta_t *meta) {
+  cache_lru_entry_t *entry, *old;
+
+  if ((!input->dev && !input->ino) || meta->len > lru->max_size)
+    return;
+
+  /* Copy the payload before taking the lock */
+  if (!(entry = malloc(sizeof(*entry) + meta->len)))
+    return;
+
+  memset(entry, 0x0, sizeof(*entry));
+  entry->dev = input->dev;
+  entry->ino = input->ino;
+  entry->mtime = input->mtime;
+  entry->size = input->size;
+  entry->kind = kind;
+  entry->meta = *meta;
+  memcpy(entry->data, data, meta->len);
+
+  pthread_mutex_lock(&lru->lock);
+
+  /* Another build might have stored the same input in the meantime */
+  if ((old = *cache_lru_find(lru, input, kind)))
+    cache_lru_evict(lru, input, old);
+
+  while (lru->oldest && lru->used + meta->len > lru->max_size)
+    cache_lru_evict_oldest(lru);
+
+  entry->next = NULL;
+  *cache_lru_find(lru, input, kind) = entry;
+  cache_lru_push(lru, entry);
+  lru->used += meta->len;
+
+  pthread_mutex_unlock(&lru->lock);
+}
@@ -0,0 +1,97 @@
+#ifndef MKBOOTIMAGE_CACHE_H
+#define MKBOOTIMAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <common.h>
+
+/* Kinds of processed payloads kept in the cache, the kind is a part
+ * of the key so the same input processed differently never clashes */
+typedef enum cache_kind_t {
+  CACHE_KIND_ELF = 1,       /* flattened ELF file */
+  CACHE_KIND_BITSTREAM = 2, /* byte swapped bitstream data */
+} cache_kind_t;
+
+/* Name of a cache entry, derived from the input contents */
+#define CACHE_KEY_LEN 36
+
+typedef struct cache_key_t {
+  char name[CACHE_KEY_LEN + 1];
+} cache_key_t;
+
+/* Everything the partition header needs besides the payload itself */
+typedef struct cache_meta_t {
+  uint32_t len;  /* payload bytes stored in the entry */
+  uint32_t size; /* size reported by the processing routine */
+  uint64_t load;
+  uint64_t entry;
+  uint8_t nbits;
+} cache_meta_t;
+
+error cache_init_dir(const char *dir);
+void cache_make_key(cache_key_t *key, const mapped_file_t *input, cache_kind_t kind);
+
+/* Copy a cached payload to dst if there is a valid entry not larger
+ * than max_len bytes, returns false on any kind of miss */
+bool cache_load(
+  const char *dir, const cache_key_t *key, void *dst, uint32_t max_len, cache_meta_t *meta);
+
+/* Store a payload, failures are ignored as the cache is optional */
+void cache_store(
+  const char *dir, const cache_key_t *key, const void *data, const cache_meta_t *meta);
+
+/* Processed payloads shared in memory by the images built in a single
+ * process. Every expected use of an input is registered up front, the
+ * first use processes it and the other ones copy the result, which is
+ * dropped after the last use. Inputs are told apart by the identity of
+ * their files, not by the contents. */
+typedef struct cache_mem_t cache_mem_t;
+
+cache_mem_t *cache_mem_create(void);
+void cache_mem_destroy(cache_mem_t *mem);
+
+/* Register one more use of an input */
+error cache_mem_expect(cache_mem_t *mem, const mapped_file_t *input);
+
+/* Copy the payload of an input to dst, waiting for it if it is being
+ * processed. On a miss of a registered input the caller is the one to
+ * process it and has to call cache_mem_store afterwards. */
+bool cache_mem_load(
+  cache_mem_t *mem, const mapped_file_t *input, void *dst, uint32_t max_len, cache_meta_t *meta);
+
+/* Publish the processed payload, data is NULL if the processing
+ * failed so the next use of the input gets to try it again */
+void cache_mem_store(
+  cache_mem_t *mem, const mapped_file_t *input, const void *data, const cache_meta_t *meta);
+
+/* Processed payloads kept in memory by a long running process, up to
+ * max_size bytes of them. The least recently used ones are dropped
+ * first. Like above the inputs are told apart by file identity, so
+ * a changed file never matches an entry made before the change. */
+typedef struct cache_lru_t cache_lru_t;
+
+cache_lru_t *cache_lru_create(size_t max_size);
+void cache_lru_destroy(cache_lru_t *lru);
+
+bool cache_lru_load(cache_lru_t *lru,
+                    const mapped_file_t *input,
+                    cache_kind_t kind,
+                    void *dst,
+                    uint32_t max_len,
+                    cache_meta_t *meta);
+void cache_lru_store(cache_lru_t *lru,
+                     const mapped_file_t *input,
+                     cache_kind_t kind,
+                     const void *data,
+                     const cache_meta_t *meta);
+
+/* All the places processed payloads are looked up in */
+typedef struct cache_t {
+  const char *dir;  /* on-disk cache directory, NULL if not used */
+  cache_mem_t *mem; /* payloads shared in memory, NULL if not used */
+  cache_lru_t *lru; /* payloads kept between builds, NULL if not used */
+} cache_t;
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <checksum.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+/* Summing kernels, all of them return the wrapping 32 bit sum of the
+ * words at data, which doesn't need to be aligned. Adding the lanes
+ * separately and folding them at the end gives the same result since
+ * the addition is done modulo 2^32 either way. */
+typedef uint32_t (*sum_words_fn)(const uint8_t *data, size_t words);
+
+static uint32_t sum_words_scalar(const uint8_t *data, size_t words) {
+  uint32_t word, sum = 0;
+  size_t i;
+
+  for (i = 0; i < words; i++) {
+    memcpy(&word, data + i * sizeof(word), sizeof(word));
+    sum += word;
+  }
+
+  return sum;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse2"))) static uint32_t sum_words_sse2(const uint8_t *data,
+                                                               size_t words) {
+  __m128i acc0 = _mm_setzero_si128();
+  __m128i acc1 = _mm_setzero_si128();
+  size_t i;
+
+  for (i = 0; i + 8 <= words; i += 8) {
+    acc0 = _mm_add_epi32(acc0, _mm_loadu_si128((const __m128i *) (data + i * 4)));
+    acc1 = _mm_add_epi32(acc1, _mm_loadu_si128((const __m128i *) (data + i * 4 + 16)));
+  }
+
+  acc0 = _mm_add_epi32(acc0, acc1);
+  acc0 = _mm_add_epi32(acc0, _mm_shuffle_epi32(acc0, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc0 = _mm_add_epi32(acc0, _mm_shuffle_epi32(acc0, _MM_SHUFFLE(2, 3, 0, 1)));
+
+  return (uint32_t) _mm_cvtsi128_si32(acc0) + sum_words_scalar(data + i * 4, words - i);
+}
+
+__attribute__((target("avx2"))) static uint32_t sum_words_avx2(const uint8_t *data,
+                                                               size_t words) {
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  __m128i acc;
+  size_t i;
+
+  for (i = 0; i + 16 <= words; i += 16) {
+    acc0 = _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i *) (data + i * 4)));
+    acc1 = _mm256_add_epi32(acc1, _mm256_loadu_si256((const __m256i *) (data + i * 4 + 32)));
+  }
+
+  acc0 = _mm256_add_epi32(acc0, acc1);
+  acc = _mm_add_epi32(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+  return (uint32_t) _mm_cvtsi128_si32(acc) + sum_words_sse2(data + i * 4, words - i);
+}
+
+__attribute__((target("avx512f"))) static uint32_t sum_words_avx512(const uint8_t *data,
+                                                                    size_t words) {
+  __m512i acc0 = _mm512_setzero_si512();
+  __m512i acc1 = _mm512_setzero_si512();
+  size_t i;
+
+  for (i = 0; i + 32 <= words; i += 32) {
+    acc0 = _mm512_add_epi32(acc0, _mm512_loadu_si512((const void *) (data + i * 4)));
+    acc1 = _mm512_add_epi32(acc1, _mm512_loadu_si512((const void *) (data + i * 4 + 64)));
+  }
+
+  acc0 = _mm512_add_epi32(acc0, acc1);
+
+  return (uint32_t) _mm512_reduce_add_epi32(acc0) + sum_words_avx2(data + i * 4, words - i);
+}
+#endif
+
+static sum_words_fn sum_words_impl = sum_words_scalar;
+static pthread_once_t sum_words_once = PTHREAD_ONCE_INIT;
+
+/* Pick the widest kernel the CPU we're running on supports */
+static void sum_words_select(void) {
+#ifdef CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    sum_words_impl = sum_words_avx512;
+  else if (__builtin_cpu_supports("avx2"))
+    sum_words_impl = sum_words_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    sum_words_impl = sum_words_sse2;
+#endif
+}
+
+/* Headers are only a few dozen words, don't bother dispatching for them */
+#define CHECKSUM_SCALAR_MAX 32
+
+static uint32_t sum_words(const void *data, size_t words) {
+  if (words <= CHECKSUM_SCALAR_MAX)
+    return sum_words_scalar(data, words);
+
+  pthread_once(&sum_words_once, sum_words_select);
+  return sum_words_impl(data, words);
+}
+
+uint32_t checksum_words(const void *data, size_t words) {
+  return ~sum_words(data, words);
+}
@@ -0,0 +1,9 @@
+#ifndef MKBOOTIMAGE_CHECKSUM_H
+#define MKBOOTIMAGE_CHECKSUM_H
+
+/* The bootrom checksum of a buffer: a plain 32 bit sum of the words
+ * (wrapping around) inverted at the end. Buffers longer than headers
+ * are summed by the widest SIMD kernel the CPU supports. */
+uint32_t checksum_words(const void *data, size_t words);
+
+#endif
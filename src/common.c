@@ -1,37 +1,83 @@
+#include <errno.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <checksum.h>
 #include <common.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Where the error messages of the thread go, stderr if nothing is set */
+static _Thread_local error_sink_t thread_error_sink;
+
+error_sink_t set_error_sink(error_sink_t sink) {
+  error_sink_t prev = thread_error_sink;
+
+  thread_error_sink = sink;
+  return prev;
+}
+
+void set_error_stream(FILE *f) {
+  set_error_sink((error_sink_t){.stream = f});
+}
 
 int errorf(const char *fmt, ...) {
-  int n;
+  error_sink_t *sink = &thread_error_sink;
+  FILE *f = sink->stream ? sink->stream : stderr;
+  char buf[512], *msg = buf;
   va_list args;
+  int n;
+
+  if (!sink->fn) {
+    /* Keep the prefix and the message together if there are more threads */
+    flockfile(f);
+    va_start(args, fmt);
+    fprintf(f, "error: ");
+    n = vfprintf(f, fmt, args);
+    va_end(args);
+    funlockfile(f);
 
+    return n;
+  }
+
+  /* The callback gets the message as a whole, without the newline */
   va_start(args, fmt);
-  fprintf(stderr, "error: ");
-  n = vfprintf(stderr, fmt, args);
+  n = vsnprintf(buf, sizeof(buf), fmt, args);
   va_end(args);
 
+  if (n >= (int) sizeof(buf) && (msg = malloc(n + 1))) {
+    va_start(args, fmt);
+    vsnprintf(msg, n + 1, fmt, args);
+    va_end(args);
+  } else if (n >= (int) sizeof(buf)) {
+    msg = buf;
+    n = sizeof(buf) - 1;
+  }
+
+  if (n > 0 && msg[n - 1] == '\n')
+    msg[n - 1] = '\0';
+  sink->fn(sink->arg, msg);
+
+  if (msg != buf)
+    free(msg);
+
   return n;
 }
 
+/* Checksum the words from start_addr up to and including end_addr */
 uint32_t calc_checksum(uint32_t *start_addr, uint32_t *end_addr) {
-  uint32_t *ptr;
-  uint32_t sum;
-
-  sum = 0;
-  ptr = start_addr;
-
-  while (ptr <= end_addr) {
-    sum += *ptr;
-    ptr++;
-  }
+  if (end_addr < start_addr)
+    return ~0u;
 
-  return ~sum;
+  return checksum_words(start_addr, end_addr - start_addr + 1);
 }
 
 /* Check if pfix is a postifx of string */
@@ -48,3 +94,265 @@ bool is_on_list(char *list[], char *s) {
       return true;
   return false;
 }
+
+/* Read whatever is left in a descriptor that can't be mapped */
+static error read_fd(int fd, const char *fname, mapped_file_t *file) {
+  uint8_t *data = NULL, *tmp;
+  size_t cap = 0;
+  ssize_t n;
+
+  do {
+    if (file->size == cap) {
+      cap = cap ? 2 * cap : 65536;
+      if (!(tmp = realloc(data, cap))) {
+        errorf("out of memory\n");
+        free(data);
+        return ERROR_NOMEM;
+      }
+      data = tmp;
+    }
+
+    if ((n = read(fd, data + file->size, cap - file->size)) > 0)
+      file->size += n;
+  } while (n > 0 || (n < 0 && errno == EINTR));
+
+  if (n < 0) {
+    errorf("could not read file: %s\n", fname);
+    free(data);
+    return ERROR_CANT_READ;
+  }
+
+  file->data = data;
+  file->kind = MAPPED_FILE_HEAP;
+
+  return SUCCESS;
+}
+
+/* Map the whole contents of a regular file read-only, fname is only
+ * used in the error messages. The descriptor is not needed once the
+ * mapping exists. Other kinds of files are read to memory if streams
+ * are allowed. */
+static error map_fd_as(int fd, const char *fname, mapped_file_t *file, bool streams) {
+  struct stat st;
+  void *data;
+
+  memset(file, 0x0, sizeof(*file));
+
+  if (fstat(fd, &st)) {
+    errorf("could not stat file: %s\n", fname);
+    return ERROR_CANT_READ;
+  }
+
+  if (!S_ISREG(st.st_mode)) {
+    if (streams)
+      return read_fd(fd, fname, file);
+
+    errorf("not a regular file: %s\n", fname);
+    return ERROR_CANT_READ;
+  }
+
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+
+  /* Empty files can't be mapped, leave them with a NULL data pointer */
+  if (st.st_size == 0)
+    return SUCCESS;
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    errorf("could not map file: %s\n", fname);
+    return ERROR_CANT_READ;
+  }
+
+  file->data = data;
+  file->size = st.st_size;
+
+  return SUCCESS;
+}
+
+/* Open a regular file and map its whole contents read-only */
+error map_file(const char *fname, mapped_file_t *file) {
+  error err;
+  int fd;
+
+  memset(file, 0x0, sizeof(*file));
+
+  if ((fd = open(fname, O_RDONLY)) < 0) {
+    errorf("could not open file: %s\n", fname);
+    return ERROR_CANT_READ;
+  }
+
+  err = map_fd_as(fd, fname, file, false);
+  close(fd);
+
+  return err;
+}
+
+/* Same for a file that is already open, pipes and such are read to
+ * memory. The descriptor stays open. */
+error map_fd(int fd, const char *fname, mapped_file_t *file) {
+  return map_fd_as(fd, fname, file, true);
+}
+
+void unmap_file(mapped_file_t *file) {
+  if (file->data && file->kind == MAPPED_FILE_MMAP)
+    munmap((void *) file->data, file->size);
+  else if (file->kind == MAPPED_FILE_HEAP)
+    free((void *) file->data);
+
+  memset(file, 0x0, sizeof(*file));
+}
+
+/* State shared by the run_parallel workers */
+typedef struct parallel_t {
+  error (*fn)(void *, uint32_t);
+  void *arg;
+  uint32_t count;
+  atomic_uint next;
+  atomic_bool failed;
+  error *errs;
+  error_sink_t error_sink; /* the one of the calling thread */
+} parallel_t;
+
+static void *parallel_worker(void *data) {
+  parallel_t *p = data;
+  uint32_t i;
+
+  set_error_sink(p->error_sink);
+
+  while (!atomic_load(&p->failed) && (i = atomic_fetch_add(&p->next, 1)) < p->count)
+    if ((p->errs[i] = p->fn(p->arg, i)))
+      atomic_store(&p->failed, true);
+
+  return NULL;
+}
+
+/* Call fn for every index below count using up to jobs threads.
+ * No new calls are started after one of them fails. The error of the
+ * lowest failed index is returned, so the result doesn't depend on
+ * the scheduling. */
+error run_parallel(unsigned int jobs, uint32_t count, error (*fn)(void *, uint32_t), void *arg) {
+  pthread_t *threads;
+  parallel_t p;
+  unsigned int t, started;
+  uint32_t i;
+  error err;
+
+  if (jobs > count)
+    jobs = count;
+
+  /* Just do it in order if there is nothing to parallelize */
+  if (jobs <= 1) {
+    for (i = 0; i < count; i++)
+      if ((err = fn(arg, i)))
+        return err;
+    return SUCCESS;
+  }
+
+  p.fn = fn;
+  p.arg = arg;
+  p.count = count;
+  p.error_sink = thread_error_sink;
+  atomic_init(&p.next, 0);
+  atomic_init(&p.failed, false);
+
+  p.errs = calloc(count, sizeof(*p.errs));
+  threads = malloc((jobs - 1) * sizeof(*threads));
+  if (!p.errs || !threads) {
+    free(p.errs);
+    free(threads);
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  /* The calling thread is one of the workers, carry on with
+   * fewer threads if some of them can't be created */
+  for (started = 0; started < jobs - 1; started++)
+    if (pthread_create(&threads[started], NULL, parallel_worker, &p))
+      break;
+
+  parallel_worker(&p);
+
+  for (t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+
+  err = SUCCESS;
+  for (i = 0; i < count && !err; i++)
+    err = p.errs[i];
+
+  free(p.errs);
+  free(threads);
+
+  return err;
+}
+
+/* FNV-1a, the seed is mixed into the offset basis */
+static uint32_t name_hash(uint32_t seed, const char *str, size_t len) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t) str[i];
+    h *= 16777619u;
+  }
+
+  return h ^ (h >> 16);
+}
+
+static inline const char *name_at(const void *table, size_t stride, uint32_t i) {
+  return *(const char *const *) ((const uint8_t *) table + i * stride);
+}
+
+/* Look for a seed that maps every name to its own slot. The table
+ * starts at twice the number of names and grows if no seed is found. */
+error name_index_build(name_index_t *idx, const void *table, size_t stride, uint32_t count) {
+  const char *name;
+  uint32_t slots, seed, i, h;
+
+  for (slots = 4; slots < 2 * count; slots *= 2)
+    ;
+
+  for (; slots <= NAME_INDEX_MAX_SLOTS; slots *= 2) {
+    for (seed = 0; seed < 4096; seed++) {
+      memset(idx->slots, 0, sizeof(idx->slots));
+
+      for (i = 0; i < count; i++) {
+        name = name_at(table, stride, i);
+        h = name_hash(seed, name, strlen(name)) & (slots - 1);
+        if (idx->slots[h])
+          break;
+        idx->slots[h] = i + 1;
+      }
+
+      if (i == count) {
+        idx->seed = seed;
+        idx->mask = slots - 1;
+        return SUCCESS;
+      }
+    }
+  }
+
+  return ERROR_NOMEM;
+}
+
+/* Returns the index of the entry named str, -1 if there's none */
+int name_index_find(const name_index_t *idx,
+                    const void *table,
+                    size_t stride,
+                    const char *str,
+                    size_t len) {
+  const char *name;
+  uint8_t slot;
+
+  slot = idx->slots[name_hash(idx->seed, str, len) & idx->mask];
+  if (!slot)
+    return -1;
+
+  /* The slot is the only candidate, it still has to be compared */
+  name = name_at(table, stride, slot - 1);
+  if (strncmp(name, str, len) || name[len] != '\0')
+    return -1;
+
+  return slot - 1;
+}
@@ -1,6 +1,8 @@
 #ifndef MKBOOTIMAGE_COMMON_H
 #define MKBOOTIMAGE_COMMON_H
 
+#include <stdio.h>
+
 typedef enum error
 {
   /* The job was ended sucessfully */
@@ -32,11 +34,72 @@ typedef enum error
   ERROR_BIN_FILE_EXISTS,
   ERROR_BIN_NOFILE,
   ERROR_BIN_WADDR,
+  ERROR_BIN_CHECKSUM,
+  ERROR_BIN_OVERLAP,
 } error;
 
+/* How the data of a mapped_file_t gets released */
+typedef enum mapped_file_kind_t
+{
+  MAPPED_FILE_MMAP = 0, /* a mapping of the file */
+  MAPPED_FILE_HEAP,     /* the contents read to a malloc'ed buffer */
+  MAPPED_FILE_BORROWED, /* memory owned by somebody else */
+} mapped_file_kind_t;
+
+/* A read-only mapping of an input file */
+typedef struct mapped_file_t {
+  const uint8_t *data;
+  size_t size;
+  mapped_file_kind_t kind;
+
+  /* Identity of the mapped file, all zero if there is no file */
+  uint64_t dev, ino;
+  int64_t mtime; /* in nanoseconds */
+} mapped_file_t;
+
 int errorf(const char *fmt, ...);
+
+/* Where errorf messages go: a callback getting every message without
+ * the "error: " prefix and the newline, or a stream, stderr if neither
+ * of them is set */
+typedef struct error_sink_t {
+  void (*fn)(void *arg, const char *msg);
+  void *arg;
+  FILE *stream;
+} error_sink_t;
+
+/* Send the errors reported by the calling thread (and the run_parallel
+ * workers it starts) to the sink, the previous sink is returned so it
+ * can be restored */
+error_sink_t set_error_sink(error_sink_t sink);
+void set_error_stream(FILE *f);
+
 uint32_t calc_checksum(uint32_t *, uint32_t *);
 bool is_postfix(char *, char *);
 bool is_on_list(char **, char *);
 
+error map_file(const char *fname, mapped_file_t *file);
+error map_fd(int fd, const char *fname, mapped_file_t *file);
+void unmap_file(mapped_file_t *file);
+
+error run_parallel(unsigned int jobs, uint32_t count, error (*fn)(void *, uint32_t), void *arg);
+
+/* Perfect hash over a small fixed table of names. The table entries
+ * have to start with the name pointer, entry i is found at slot
+ * hash(name) & mask as i + 1, empty slots are 0. */
+#define NAME_INDEX_MAX_SLOTS 64
+
+typedef struct name_index_t {
+  uint32_t seed;
+  uint32_t mask;
+  uint8_t slots[NAME_INDEX_MAX_SLOTS];
+} name_index_t;
+
+error name_index_build(name_index_t *idx, const void *table, size_t stride, uint32_t count);
+int name_index_find(const name_index_t *idx,
+                    const void *table,
+                    size_t stride,
+                    const char *str,
+                    size_t len);
+
 #endif
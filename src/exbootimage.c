@@ -24,6 +24,11 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* copy_file_range */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -36,13 +41,18 @@
 #include <argp.h>
 #include <bif.h>
 #include <bootrom.h>
+#include <checksum.h>
 #include <common.h>
+#include <fcntl.h>
 #include <file/bitstream.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 /* A macro constructor of struct fmt */
-#define FORMAT(name, type, field, fmt) \
-  { name, offsetof(type, field), print_##fmt }
+#define FORMAT(name, key, type, field, fmt) \
+  { name, key, offsetof(type, field), print_##fmt, json_##fmt }
 
 /* Calculate absolute value of a byte or word address */
 #define ABS_BADDR(base, addr) ((void *) ((uint8_t *) (base) + (addr)))
@@ -58,11 +68,35 @@
 /* Check if an absolute address is relatively NULL  */
 #define IS_REL_NULL(base, addr) ((void *) (addr) <= (void *) (base))
 
+/* Nesting of the JSON output never goes deeper than a few levels */
+#define JSON_MAX_DEPTH 8
+
+/* Size of the stdout buffer used for the JSON output */
+#define JSON_BUF_SIZE (1 << 16)
+
+/* A JSON writer, it goes through the stdio buffer of the stream */
+typedef struct json_t {
+  FILE *f;
+  bool compact; /* the whole document in a single line */
+  bool empty;   /* nothing was written at the current depth yet */
+  int depth;
+  char closing[JSON_MAX_DEPTH];
+} json_t;
+
 /* A struct for describing binary data layout */
 struct format {
   char *name;
+  char *key; /* the name used in the JSON output */
   char offset;
   int (*print)(FILE *, void *, int);
+  int (*json)(json_t *, char *, void *, int);
+};
+
+/* Output formats of the descriptions */
+enum output_format {
+  OUTPUT_TEXT = 0,
+  OUTPUT_JSON,
+  OUTPUT_JSONL,
 };
 
 /* Prepare struct for holding parsed arguments */
@@ -76,8 +110,13 @@ struct arguments {
 
   bool force;
   bool extract;
+  bool verify;
+  unsigned int jobs;
+  enum output_format output;
   int extract_count;
   char **extract_names;
+  int verify_count;
+  char **verify_names;
 
   char *design;
   char *part;
@@ -102,11 +141,26 @@ int print_dbl_word(FILE *f, void *base, int offset);
 int print_name(FILE *f, void *base, int offset);
 int print_attr(FILE *f, void *base, int offset);
 
+int json_dec(json_t *js, char *key, void *base, int offset);
+int json_word(json_t *js, char *key, void *base, int offset);
+int json_dbl_word(json_t *js, char *key, void *base, int offset);
+int json_name(json_t *js, char *key, void *base, int offset);
+int json_attr(json_t *js, char *key, void *base, int offset);
+
 static int name_to_string(char *dst, void *base, int offset);
 static int print_padding(FILE *f, int times, char ch);
 
-static error verify_waddr(void *base, uint32_t size, uint32_t *poffset);
+static error verify_waddr(void *base, uint32_t size, uint32_t *poffset, uint32_t len);
 static error get_next_image(void *base, uint32_t size, img_hdr_t **img);
+static error get_image_part(void *base,
+                            uint32_t size,
+                            img_hdr_t *img,
+                            uint32_t n,
+                            int zynqmp,
+                            part_hdr_t **part);
+static void release_range(void *addr, size_t len);
+static error write_range(FILE *f, void *addr, size_t len);
+static error copy_range(FILE *f, int fd, void *base, void *addr, size_t len);
 
 /* Prepare global variables for arg parser */
 const char *argp_program_version = MKBOOTIMAGE_VER;
@@ -121,7 +175,10 @@ static char args_doc[] =
   "[--parts|-p] "
   "[--bitstream|-bDESIGN,PART-NAME] "
   "[--swap|-s] "
-  "<input_bit_file> <files_to_extract>";
+  "[--jobs|-j N] "
+  "[--format|-F FORMAT] "
+  "<input_bit_file> <files_to_extract>\n"
+  "--verify|-v [--zynqmp|-u] [--parts|-p] [--jobs|-j N] <input_bit_file...>";
 
 static struct argp_option argp_options[] = {
   {"zynqmp", 'u', 0, 0, "Expect files for ZynqMP (default is Zynq)", 0},
@@ -131,82 +188,85 @@ static struct argp_option argp_options[] = {
   {"describe", 'd', 0, 0, "Describe the boot image (-hip equivalent)", 0},
   {"header", 'h', 0, 0, "Print main boot image header", 0},
   {"images", 'i', 0, 0, "Print partition image headers", 0},
-  {"parts", 'p', 0, 0, "Print partition headers", 0},
+  {"parts", 'p', 0, 0, "Print partition headers, with -v the partition data checksums", 0},
   {"bitstream", 'b', "DESIGN,PART-NAME", 0, "Reconstruct bitstream with headers on extraction", 0},
   {"swap", 's', 0, 0, "Swap bitstream bytes but don't reconstruct headers", 0},
+  {"jobs", 'j', "N", 0, "Extract up to N partitions in parallel (default is 1)", 0},
+  {"format", 'F', "FORMAT", 0, "Output format: text (default), json or jsonl", 0},
+  {"verify", 'v', 0, 0, "Check the header checksums and the layout of all the given images", 0},
   {0},
 };
 
 /* clang-format off */
 static struct format hdr_fmt[] = {
-  FORMAT("Width Detection Word",    hdr_t, width_detect,      word),
-  FORMAT("Header Signature",        hdr_t, img_id,            word),
-  FORMAT("Key Source",              hdr_t, encryption_status, word),
-  FORMAT("Header Version",          hdr_t, fsbl_defined_0,    word),
-  FORMAT("Source Byte Offset",      hdr_t, src_offset,        word),
-  FORMAT("FSBL Image Length",       hdr_t, img_len,           dec),
-  FORMAT("FSBL Load Address",       hdr_t, pmufw_total_len,   word),
-  FORMAT("FSBL Execution Address",  hdr_t, start_of_exec,     word),
-  FORMAT("Total FSBL Length",       hdr_t, total_img_len,     dec),
-  FORMAT("QSPI configuration Word", hdr_t, reserved_1,        word),
-  FORMAT("Boot Header Checksum",    hdr_t, checksum,          word),
+  FORMAT("Width Detection Word",    "width_detection_word", hdr_t, width_detect,      word),
+  FORMAT("Header Signature",        "header_signature",     hdr_t, img_id,            word),
+  FORMAT("Key Source",              "key_source",           hdr_t, encryption_status, word),
+  FORMAT("Header Version",          "header_version",       hdr_t, fsbl_defined_0,    word),
+  FORMAT("Source Byte Offset",      "source_offset",        hdr_t, src_offset,        word),
+  FORMAT("FSBL Image Length",       "fsbl_length",          hdr_t, img_len,           dec),
+  FORMAT("FSBL Load Address",       "fsbl_load_address",    hdr_t, pmufw_total_len,   word),
+  FORMAT("FSBL Execution Address",  "fsbl_exec_address",    hdr_t, start_of_exec,     word),
+  FORMAT("Total FSBL Length",       "total_fsbl_length",    hdr_t, total_img_len,     dec),
+  FORMAT("QSPI configuration Word", "qspi_config_word",     hdr_t, reserved_1,        word),
+  FORMAT("Boot Header Checksum",    "checksum",             hdr_t, checksum,          word),
   {0},
 };
 
 static struct format img_hdr_tab_fmt[] = {
-  FORMAT("Version",                       img_hdr_tab_t, version,          word),
-  FORMAT("Header Count",                  img_hdr_tab_t, hdrs_count,       dec),
-  FORMAT("Partition Header Offset",       img_hdr_tab_t, part_hdr_off,     word),
-  FORMAT("Partition Image Header Offset", img_hdr_tab_t, part_img_hdr_off, word),
-  FORMAT("Header Authentication Offset",  img_hdr_tab_t, auth_hdr_off,     word),
+  FORMAT("Version",                       "version",         img_hdr_tab_t, version,          word),
+  FORMAT("Header Count",                  "header_count",    img_hdr_tab_t, hdrs_count,       dec),
+  FORMAT("Partition Header Offset",       "part_hdr_offset", img_hdr_tab_t, part_hdr_off,     word),
+  FORMAT("Partition Image Header Offset", "img_hdr_offset",  img_hdr_tab_t, part_img_hdr_off, word),
+  FORMAT("Header Authentication Offset",  "auth_hdr_offset", img_hdr_tab_t, auth_hdr_off,     word),
   {0},
 };
 
 static struct format zynqmp_img_hdr_tab_fmt[] = {
-  FORMAT("(ZynqMP) Boot Device", img_hdr_tab_t, boot_dev, word),
-  FORMAT("(ZynqMP) Checksum",    img_hdr_tab_t, checksum, word),
+  FORMAT("(ZynqMP) Boot Device", "boot_device", img_hdr_tab_t, boot_dev, word),
+  FORMAT("(ZynqMP) Checksum",    "checksum",    img_hdr_tab_t, checksum, word),
   {0},
 };
 
 static struct format img_hdr_fmt[] = {
-  FORMAT("Next Image Offset",          img_hdr_t, next_img_off, word),
-  FORMAT("Partition Header Offset",    img_hdr_t, part_hdr_off, word),
-  FORMAT("Partition Count (always 0)", img_hdr_t, part_count,   dec),
-  FORMAT("Name Length (usually 1)",    img_hdr_t, name_len,     dec),
-  FORMAT("Image Name",                 img_hdr_t, name,         name),
+  FORMAT("Next Image Offset",          "next_img_offset", img_hdr_t, next_img_off, word),
+  FORMAT("Partition Header Offset",    "part_hdr_offset", img_hdr_t, part_hdr_off, word),
+  FORMAT("Partition Count (always 0)", "part_count",      img_hdr_t, part_count,   dec),
+  FORMAT("Name Length (usually 1)",    "name_length",     img_hdr_t, name_len,     dec),
+  FORMAT("Image Name",                 "name",            img_hdr_t, name,         name),
   {0},
 };
 
 static struct format zynq_hdr_fmt[] = {
-  FORMAT("Encrypted Data Length",   zynq_hdr_t, pd_len,         dec),
-  FORMAT("Unencrypted Data Length", zynq_hdr_t, ed_len,         dec),
-  FORMAT("Total Length",            zynq_hdr_t, total_len,      dec),
-  FORMAT("Load Address",            zynq_hdr_t, dest_load_addr, word),
-  FORMAT("Execution Address",       zynq_hdr_t, dest_exec_addr, word),
-  FORMAT("Partition Data Offset",   zynq_hdr_t, data_off,       word),
-  FORMAT("Attributes",              zynq_hdr_t, attributes,     attr),
-  FORMAT("Section Count",           zynq_hdr_t, section_count,  dec),
-  FORMAT("Checksum Offset",         zynq_hdr_t, checksum_off,   word),
-  FORMAT("Image Header Offset",     zynq_hdr_t, img_hdr_off,    word),
-  FORMAT("Certificate Offset",      zynq_hdr_t, cert_off,       word),
-  FORMAT("Checksum",                zynq_hdr_t, checksum,       word),
+  FORMAT("Encrypted Data Length",   "encrypted_len",   zynq_hdr_t, pd_len,         dec),
+  FORMAT("Unencrypted Data Length", "unencrypted_len", zynq_hdr_t, ed_len,         dec),
+  FORMAT("Total Length",            "total_len",       zynq_hdr_t, total_len,      dec),
+  FORMAT("Load Address",            "load_address",    zynq_hdr_t, dest_load_addr, word),
+  FORMAT("Execution Address",       "exec_address",    zynq_hdr_t, dest_exec_addr, word),
+  FORMAT("Partition Data Offset",   "data_offset",     zynq_hdr_t, data_off,       word),
+  FORMAT("Attributes",              "attributes",      zynq_hdr_t, attributes,     attr),
+  FORMAT("Section Count",           "section_count",   zynq_hdr_t, section_count,  dec),
+  FORMAT("Checksum Offset",         "checksum_offset", zynq_hdr_t, checksum_off,   word),
+  FORMAT("Image Header Offset",     "img_hdr_offset",  zynq_hdr_t, img_hdr_off,    word),
+  FORMAT("Certificate Offset",      "cert_offset",     zynq_hdr_t, cert_off,       word),
+  FORMAT("Checksum",                "checksum",        zynq_hdr_t, checksum,       word),
   {0},
 };
 
 static struct format zynqmp_hdr_fmt[] = {
-  FORMAT("Encrypted Data Length",   zynqmp_hdr_t, pd_len,            dec),
-  FORMAT("Unencrypted Data Length", zynqmp_hdr_t, ed_len,            dec),
-  FORMAT("Total Length",            zynqmp_hdr_t, total_len,         dec),
-  FORMAT("Next Header Offset",      zynqmp_hdr_t, next_part_hdr_off, word),
-  FORMAT("Load Address",            zynqmp_hdr_t, dest_load_addr_lo, dbl_word),
-  FORMAT("Execution Address",       zynqmp_hdr_t, dest_exec_addr_lo, dbl_word),
-  FORMAT("Partition Data Offset",   zynqmp_hdr_t, actual_part_off,   word),
-  FORMAT("Attributes",              zynqmp_hdr_t, attributes,        attr),
-  FORMAT("Section Count",           zynqmp_hdr_t, section_count,     dec),
-  FORMAT("Checksum Offset",         zynqmp_hdr_t, checksum_off,      word),
-  FORMAT("Image Header Offset",     zynqmp_hdr_t, img_hdr_off,       word),
-  FORMAT("Certificate Offset",      zynqmp_hdr_t, cert_off,          word),
-  FORMAT("Checksum",                zynqmp_hdr_t, checksum,          word),
+  FORMAT("Encrypted Data Length",   "encrypted_len",   zynqmp_hdr_t, pd_len,            dec),
+  FORMAT("Unencrypted Data Length", "unencrypted_len", zynqmp_hdr_t, ed_len,            dec),
+  FORMAT("Total Length",            "total_len",       zynqmp_hdr_t, total_len,         dec),
+  FORMAT("Next Header Offset",      "next_hdr_offset", zynqmp_hdr_t, next_part_hdr_off, word),
+  FORMAT("Load Address",            "load_address",    zynqmp_hdr_t, dest_load_addr_lo, dbl_word),
+  FORMAT("Execution Address",       "exec_address",    zynqmp_hdr_t, dest_exec_addr_lo, dbl_word),
+  FORMAT("Partition Data Offset",   "data_offset",     zynqmp_hdr_t, actual_part_off,   word),
+  FORMAT("Attributes",              "attributes",      zynqmp_hdr_t, attributes,        attr),
+  FORMAT("Section Count",           "section_count",   zynqmp_hdr_t, section_count,     dec),
+  FORMAT("Checksum Offset",         "checksum_offset", zynqmp_hdr_t, checksum_off,      word),
+  FORMAT("Image Header Offset",     "img_hdr_offset",  zynqmp_hdr_t, img_hdr_off,       word),
+  FORMAT("Certificate Offset",      "cert_offset",     zynqmp_hdr_t, cert_off,          word),
+  FORMAT("Checksum",                "checksum",        zynqmp_hdr_t, checksum,          word),
   {0},
 };
 /* clang-format on */
@@ -361,99 +421,825 @@ error print_partition_headers(FILE *f, hdr_t *base, uint32_t size, int zynqmp) {
   error err = SUCCESS;
   img_hdr_t *img;
   part_hdr_t *part;
+  uint32_t n;
 
   print_section(f, "PARTITION HEADERS SECTION");
   for (img = NULL; (err = get_next_image(base, size, &img)) == SUCCESS;) {
-    if ((err = verify_waddr(base, size, &img->part_hdr_off)))
+    for (n = 0; (err = get_image_part(base, size, img, n, zynqmp, &part)) == SUCCESS; n++) {
+      print_name(f, img, offsetof(img_hdr_t, name));
+      fprintf(f, ":\n");
+
+      if (zynqmp)
+        print_struct(f, part, zynqmp_hdr_fmt);
+      else
+        print_struct(f, part, zynq_hdr_fmt);
+      fputc('\n', f);
+    }
+
+    if (err != ERROR_ITERATION_END)
       return err;
-    part = ABS_WADDR(base, img->part_hdr_off);
+  }
 
-    print_name(f, img, offsetof(img_hdr_t, name));
-    fprintf(f, ":\n");
+  return err == ERROR_ITERATION_END ? SUCCESS : err;
+}
 
-    if (zynqmp)
-      print_struct(f, part, zynqmp_hdr_fmt);
+/* Write a quoted and escaped string */
+static void json_put_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf(f, "\\u%04x", *s);
     else
-      print_struct(f, part, zynq_hdr_fmt);
-    fputc('\n', f);
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void json_init(json_t *js, FILE *f, bool compact) {
+  memset(js, 0x0, sizeof(*js));
+  js->f = f;
+  js->compact = compact;
+  js->empty = true;
+}
+
+/* Separate the value from the previous one and write its key,
+ * the key is NULL for array elements and the top level value */
+static void json_begin_value(json_t *js, const char *key) {
+  if (!js->empty)
+    fputc(',', js->f);
+  js->empty = false;
+
+  if (!js->compact && js->depth) {
+    fputc('\n', js->f);
+    print_padding(js->f, 2 * js->depth, ' ');
+  }
+
+  if (key) {
+    json_put_string(js->f, key);
+    fputs(js->compact ? ":" : ": ", js->f);
+  }
+}
+
+/* Start an object ('{') or an array ('[') */
+static void json_open(json_t *js, const char *key, char bracket) {
+  if (js->depth >= JSON_MAX_DEPTH)
+    return;
+
+  json_begin_value(js, key);
+  fputc(bracket, js->f);
+
+  js->closing[js->depth++] = bracket == '{' ? '}' : ']';
+  js->empty = true;
+}
+
+static void json_close(json_t *js) {
+  if (!js->depth)
+    return;
+
+  js->depth--;
+  if (!js->compact && !js->empty) {
+    fputc('\n', js->f);
+    print_padding(js->f, 2 * js->depth, ' ');
+  }
+  fputc(js->closing[js->depth], js->f);
+  js->empty = false;
+}
+
+/* Close whatever is still open, so the output is valid even if
+ * the description stopped halfway because of an error */
+static void json_finish(json_t *js) {
+  while (js->depth)
+    json_close(js);
+  fputc('\n', js->f);
+}
+
+static void json_uint(json_t *js, const char *key, uint64_t value) {
+  json_begin_value(js, key);
+  fprintf(js->f, "%llu", (unsigned long long) value);
+}
+
+static void json_string(json_t *js, const char *key, const char *value) {
+  json_begin_value(js, key);
+  json_put_string(js->f, value);
+}
+
+/* Print the fields of a struct as members of the current object */
+static void json_fields(json_t *js, void *base, struct format fmt[]) {
+  int i;
+
+  for (i = 0; fmt[i].name; i++)
+    fmt[i].json(js, fmt[i].key, base, fmt[i].offset);
+}
+
+/* Words are plain numbers in JSON, no matter how they're printed */
+int json_dec(json_t *js, char *key, void *base, int offset) {
+  json_uint(js, key, *(uint32_t *) ABS_BADDR(base, offset));
+  return 0;
+}
+
+int json_word(json_t *js, char *key, void *base, int offset) {
+  return json_dec(js, key, base, offset);
+}
+
+int json_dbl_word(json_t *js, char *key, void *base, int lo_offset) {
+  uint64_t lo, hi;
+
+  lo = *((uint32_t *) ABS_BADDR(base, lo_offset));
+  hi = *((uint32_t *) ABS_BADDR(base, lo_offset) + 1);
+
+  json_uint(js, key, hi << 32 | lo);
+  return 0;
+}
+
+int json_name(json_t *js, char *key, void *base, int offset) {
+  char name[BOOTROM_IMG_MAX_NAME_LEN];
+
+  name_to_string(name, base, offset);
+  json_string(js, key, name);
+
+  return 0;
+}
+
+/* Attributes are decoded into an object, the keys are the names
+ * of the attributes in lower case, e.g. "destination_cpu" */
+int json_attr(json_t *js, char *key, void *base, int offset) {
+  uint32_t attr = *(uint32_t *) ABS_BADDR(base, offset);
+  mask_name_t *masks = bootrom_part_attr_mask_names;
+  char name[64];
+  size_t j;
+  int i;
+
+  json_open(js, key, '{');
+  json_uint(js, "value", attr);
+
+  for (i = 0; masks[i].name; i++) {
+    for (j = 0; masks[i].name[j] && j < sizeof(name) - 1; j++)
+      name[j] = isalnum((unsigned char) masks[i].name[j]) ? tolower(masks[i].name[j]) : '_';
+    name[j] = '\0';
+
+    json_string(js, name, map_mask_to_name(masks[i].submasks, attr & masks[i].mask));
+  }
+
+  json_close(js);
+  return 0;
+}
+
+error json_file_list(json_t *js, hdr_t *base, uint32_t size) {
+  error err = SUCCESS;
+  img_hdr_t *img;
+
+  json_open(js, "files", '[');
+  for (img = NULL; (err = get_next_image(base, size, &img)) == SUCCESS;)
+    json_name(js, NULL, img, offsetof(img_hdr_t, name));
+  json_close(js);
+
+  return err == ERROR_ITERATION_END ? SUCCESS : err;
+}
+
+error json_file_header(json_t *js, hdr_t *base, int zynqmp) {
+  img_hdr_tab_t *tab = ABS_BADDR(base, sizeof(hdr_t));
+
+  json_open(js, "header", '{');
+  json_fields(js, base, hdr_fmt);
+  json_close(js);
+
+  json_open(js, "image_header_table", '{');
+  json_fields(js, tab, img_hdr_tab_fmt);
+  if (zynqmp)
+    json_fields(js, tab, zynqmp_img_hdr_tab_fmt);
+  json_close(js);
+
+  return SUCCESS;
+}
+
+error json_image_headers(json_t *js, hdr_t *base, uint32_t size) {
+  error err = SUCCESS;
+  img_hdr_t *img;
+
+  json_open(js, "images", '[');
+  for (img = NULL; (err = get_next_image(base, size, &img)) == SUCCESS;) {
+    json_open(js, NULL, '{');
+    json_fields(js, img, img_hdr_fmt);
+    json_close(js);
   }
+  json_close(js);
 
   return err == ERROR_ITERATION_END ? SUCCESS : err;
 }
 
-error print_partition_contents(FILE *f, hdr_t *base, uint32_t size, struct arguments *arguments) {
+/* Besides the raw header every partition gets the offset and
+ * the size of its data in bytes, the header has them in words */
+error json_partition_headers(json_t *js, hdr_t *base, uint32_t size, int zynqmp) {
   error err = SUCCESS;
-  uint32_t partsize;
   img_hdr_t *img;
   part_hdr_t *part;
+  uint32_t data_off, n;
+
+  json_open(js, "partitions", '[');
+  for (img = NULL; (err = get_next_image(base, size, &img)) == SUCCESS;) {
+    for (n = 0; (err = get_image_part(base, size, img, n, zynqmp, &part)) == SUCCESS; n++) {
+      if (zynqmp)
+        data_off = ((zynqmp_hdr_t *) part)->actual_part_off;
+      else
+        data_off = ((zynq_hdr_t *) part)->data_off;
+
+      json_open(js, NULL, '{');
+      json_name(js, "name", img, offsetof(img_hdr_t, name));
+      json_uint(js, "offset", (uint64_t) data_off * sizeof(uint32_t));
+      json_uint(js, "size", (uint64_t) part->total_len * sizeof(uint32_t));
+
+      json_open(js, "header", '{');
+      json_fields(js, part, zynqmp ? zynqmp_hdr_fmt : zynq_hdr_fmt);
+      json_close(js);
+
+      json_close(js);
+    }
+
+    if (err != ERROR_ITERATION_END)
+      break;
+  }
+  json_close(js);
+
+  return err == ERROR_ITERATION_END ? SUCCESS : err;
+}
+
+/* A single partition to be written to a file */
+typedef struct extract_task_t {
+  char name[BOOTROM_IMG_MAX_NAME_LEN];
+  img_hdr_t *img;
   void *data;
-  struct stat bstat;
+  uint32_t partsize; /* in words */
+  uint32_t parts;    /* more than one for split files */
+  bool skip;         /* overwritten by a later partition of the same name */
+  bool done;
+} extract_task_t;
+
+typedef struct extract_t {
+  struct arguments *arguments;
+  int fd;     /* the image file, the source of the plain copies, -1 if none */
+  void *base; /* the image mapping */
+  uint32_t size;
+  extract_task_t *tasks;
+} extract_t;
+
+/* Order the tasks by name, equal names keep the image order */
+static int cmp_task_names(const void *a, const void *b) {
+  const extract_task_t *ta = *(extract_task_t *const *) a;
+  const extract_task_t *tb = *(extract_task_t *const *) b;
+  int r = strcmp(ta->name, tb->name);
+
+  return r ? r : (ta > tb) - (ta < tb);
+}
+
+/* Mark all but the last of the partitions sharing a name as skipped,
+ * the result is the same as if they were written one after another.
+ * Without -f the second one stops the extraction, its index is
+ * returned via the last argument (count if there is no such one). */
+static error find_duplicates(extract_task_t *tasks, uint32_t count, bool force, uint32_t *stop) {
+  extract_task_t **sorted;
+  uint32_t i;
+
+  *stop = count;
+  if (!(sorted = malloc(count * sizeof(*sorted)))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  for (i = 0; i < count; i++)
+    sorted[i] = &tasks[i];
+
+  qsort(sorted, count, sizeof(*sorted), cmp_task_names);
+
+  for (i = 1; i < count; i++) {
+    if (strcmp(sorted[i - 1]->name, sorted[i]->name))
+      continue;
+
+    if (force)
+      sorted[i - 1]->skip = true;
+    else if ((uint32_t) (sorted[i] - tasks) < *stop)
+      *stop = sorted[i] - tasks;
+  }
+
+  free(sorted);
+  return SUCCESS;
+}
+
+/* Offset of the partition data, in words */
+static uint32_t *part_data_off(part_hdr_t *part, int zynqmp) {
+  if (zynqmp)
+    return &((zynqmp_hdr_t *) part)->actual_part_off;
+  return &((zynq_hdr_t *) part)->data_off;
+}
+
+/* Address the partition data is loaded to */
+static uint64_t part_load_addr(part_hdr_t *part, int zynqmp) {
+  zynqmp_hdr_t *hdr = (zynqmp_hdr_t *) part;
+
+  if (zynqmp)
+    return (uint64_t) hdr->dest_load_addr_hi << 32 | hdr->dest_load_addr_lo;
+  return ((zynq_hdr_t *) part)->dest_load_addr;
+}
+
+/* Count the partitions of the image of a task, the ones of a split file
+ * have to be in the image and follow each other in load address order */
+static error count_image_parts(void *base, uint32_t size, extract_task_t *task, int zynqmp) {
+  uint64_t load, end = 0;
+  part_hdr_t *part;
+  uint32_t n;
+  error err;
+
+  for (n = 0; (err = get_image_part(base, size, task->img, n, zynqmp, &part)) == SUCCESS; n++) {
+    err = verify_waddr(base, size, part_data_off(part, zynqmp), part->total_len * sizeof(uint32_t));
+    if (err)
+      return err;
+
+    load = part_load_addr(part, zynqmp);
+    if (n > 0 && load < end) {
+      errorf("partitions of %s overlap\n", task->name);
+      return ERROR_BIN_OVERLAP;
+    }
+    end = load + part->total_len * sizeof(uint32_t);
+  }
+
+  task->parts = n;
+  return err == ERROR_ITERATION_END ? SUCCESS : err;
+}
+
+/* Write the partitions of a split file at their load addresses relative
+ * to the first one, the gaps between them are left as holes. The result
+ * is the same file as the one extracted from an image it isn't split in. */
+static error copy_split_parts(FILE *f, extract_t *ext, extract_task_t *task) {
+  int zynqmp = ext->arguments->zynqmp;
+  uint64_t first = 0, load;
+  part_hdr_t *part;
+  uint32_t n;
+  error err;
+
+  for (n = 0; n < task->parts; n++) {
+    if ((err = get_image_part(ext->base, ext->size, task->img, n, zynqmp, &part)))
+      return err;
+
+    load = part_load_addr(part, zynqmp);
+    if (n == 0)
+      first = load;
+
+    if (fseeko(f, load - first, SEEK_SET))
+      return ERROR_CANT_WRITE;
+
+    err = copy_range(f,
+                     ext->fd,
+                     ext->base,
+                     ABS_WADDR(ext->base, *part_data_off(part, zynqmp)),
+                     part->total_len * sizeof(uint32_t));
+    if (err)
+      return err;
+  }
+
+  return SUCCESS;
+}
+
+/* run_parallel callback writing a single partition */
+static error extract_partition(void *arg, uint32_t i) {
+  extract_t *ext = arg;
+  extract_task_t *task = &ext->tasks[i];
+  struct arguments *arguments = ext->arguments;
+  uint32_t partsize = task->partsize;
+  error err = SUCCESS;
   FILE *bfile;
-  char name[BOOTROM_IMG_MAX_NAME_LEN];
+
+  if (task->skip) {
+    task->done = true;
+    return SUCCESS;
+  }
+
+  if (!(bfile = fopen(task->name, "wb"))) {
+    errorf("could not open file: %s\n", task->name);
+    return ERROR_BIN_NOFILE;
+  }
+
+  /* Treat split and bitstream files in a separate way */
+  if (task->parts > 1) {
+    err = copy_split_parts(bfile, ext, task);
+  } else if (is_postfix(task->name, ".bit")) {
+    /* Zynq bitstream partisions are appended with an extra noop */
+    if (!arguments->zynqmp)
+      partsize--;
+
+    /* Reconstruct headers for bit files if it was requested */
+    if (arguments->part)
+      err = bitstream_write_header(bfile, partsize, arguments->design, arguments->part);
+
+    /* Perform byteswapped extraction if it was requested */
+    if (err == SUCCESS && arguments->swap) {
+      err = bitstream_write(bfile, partsize, task->data);
+      release_range(task->data, partsize * sizeof(uint32_t));
+    } else if (err == SUCCESS) {
+      err = copy_range(bfile, ext->fd, ext->base, task->data, partsize * sizeof(uint32_t));
+    }
+  } else {
+    err = copy_range(bfile, ext->fd, ext->base, task->data, partsize * sizeof(uint32_t));
+  }
+
+  if (ferror(bfile) && err == SUCCESS)
+    err = ERROR_CANT_WRITE;
+
+  if (fclose(bfile) && err == SUCCESS)
+    err = ERROR_CANT_WRITE;
+
+  if (err) {
+    errorf("could not write file: %s\n", task->name);
+    return err;
+  }
+
+  task->done = true;
+  return SUCCESS;
+}
+
+/* Write the partitions to files named after them. The partitions are
+ * collected first and then written by up to arguments->jobs threads, the
+ * output and the errors are the same as if it was done one by one. The
+ * names of the written files go to js instead of f if it is not NULL. */
+error print_partition_contents(
+  FILE *f, json_t *js, hdr_t *base, uint32_t size, int fd, struct arguments *arguments) {
+  error err = SUCCESS, werr;
+  extract_task_t *tasks = NULL, *tmp;
+  uint32_t count = 0, avail = 0, stop, i;
+  img_hdr_t *img;
+  part_hdr_t *part;
+  uint32_t *data_off;
+  struct stat bstat;
+  extract_t ext;
 
   for (img = NULL; (err = get_next_image(base, size, &img)) == SUCCESS;) {
-    name_to_string(name, img, offsetof(img_hdr_t, name));
+    if (count == avail) {
+      avail = avail ? 2 * avail : 16;
+      if (!(tmp = realloc(tasks, avail * sizeof(*tasks)))) {
+        errorf("out of memory\n");
+        free(tasks);
+        return ERROR_NOMEM;
+      }
+      tasks = tmp;
+    }
+
+    memset(&tasks[count], 0x0, sizeof(tasks[count]));
+    name_to_string(tasks[count].name, img, offsetof(img_hdr_t, name));
 
     /* Check if we're interested */
-    if (arguments->extract_names && !is_on_list(arguments->extract_names, name))
+    if (arguments->extract_names && !is_on_list(arguments->extract_names, tasks[count].name))
       continue;
 
     /* Get partition header pointer */
-    if ((err = verify_waddr(base, size, &img->part_hdr_off)))
-      return err;
+    if ((err = verify_waddr(base, size, &img->part_hdr_off, sizeof(*part))))
+      break;
     part = ABS_WADDR(base, img->part_hdr_off);
 
     /* Get partition size in bytes */
-    partsize = part->total_len;
+    tasks[count].partsize = part->total_len;
 
     /* Get partition data pointer */
-    if (arguments->zynqmp) {
-      if ((err = verify_waddr(base, size, &((zynqmp_hdr_t *) part)->actual_part_off)))
-        return err;
-      data = ABS_WADDR(base, ((zynqmp_hdr_t *) part)->actual_part_off);
-    } else {
-      if ((err = verify_waddr(base, size, &((zynq_hdr_t *) part)->data_off)))
-        return err;
-      data = ABS_WADDR(base, ((zynq_hdr_t *) part)->data_off);
-    }
+    data_off = part_data_off(part, arguments->zynqmp);
+    if ((err = verify_waddr(base, size, data_off, part->total_len * sizeof(uint32_t))))
+      break;
+    tasks[count].data = ABS_WADDR(base, *data_off);
+    tasks[count].img = img;
 
-    /* Check if the file is fine */
-    if (!stat(name, &bstat) && !arguments->force) {
-      errorf("file %s already exists, use -f to force\n", name);
-      return ERROR_BIN_FILE_EXISTS;
+    if ((err = count_image_parts(base, size, &tasks[count], arguments->zynqmp)))
+      break;
+
+    count++;
+  }
+
+  /* Anything collected before an error is still extracted */
+  if (err == ERROR_ITERATION_END)
+    err = SUCCESS;
+
+  if ((werr = find_duplicates(tasks, count, arguments->force, &stop))) {
+    free(tasks);
+    return werr;
+  }
+
+  /* Check if the files are fine */
+  for (i = 0; i < stop; i++) {
+    if (!stat(tasks[i].name, &bstat) && !arguments->force) {
+      stop = i;
+      break;
     }
-    if (!(bfile = fopen(name, "wb"))) {
-      errorf("could not open file: %s\n", name);
-      return ERROR_BIN_NOFILE;
+  }
+
+  ext.arguments = arguments;
+  ext.fd = fd;
+  ext.base = base;
+  ext.size = size;
+  ext.tasks = tasks;
+  werr = run_parallel(arguments->jobs, stop, extract_partition, &ext);
+
+  if (js)
+    json_open(js, "extracted", '[');
+
+  for (i = 0; i < stop && tasks[i].done; i++) {
+    if (js)
+      json_string(js, NULL, tasks[i].name);
+    else
+      fprintf(f, "Extracting %s... done\n", tasks[i].name);
+  }
+
+  if (js)
+    json_close(js);
+
+  if (!werr && stop < count) {
+    errorf("file %s already exists, use -f to force\n", tasks[stop].name);
+    werr = ERROR_BIN_FILE_EXISTS;
+  }
+
+  free(tasks);
+  return werr ? werr : err;
+}
+
+/* A range of the image taken by headers or partition data, in words */
+typedef struct verify_range_t {
+  uint32_t start;
+  uint32_t end;
+  char what[BOOTROM_IMG_MAX_NAME_LEN + 32];
+} verify_range_t;
+
+/* An image checked by --verify, the errors found in it are kept
+ * and reported in the order of the images once all are checked */
+typedef struct verify_task_t {
+  const char *fname;
+  char *msgs; /* one per line */
+  size_t msgs_len;
+  char *sums; /* "name: checksum" of every partition, one per line */
+  size_t sums_len;
+  error err;
+} verify_task_t;
+
+typedef struct verify_t {
+  verify_task_t *tasks;
+  bool zynqmp;
+  bool sums; /* checksum the partition data too */
+} verify_t;
+
+/* Order the ranges by their start, then by their end */
+static int cmp_ranges(const void *a, const void *b) {
+  const verify_range_t *ra = a;
+  const verify_range_t *rb = b;
+
+  if (ra->start != rb->start)
+    return (ra->start > rb->start) - (ra->start < rb->start);
+  return (ra->end > rb->end) - (ra->end < rb->end);
+}
+
+/* Remember the first problem found, the checks go on after it */
+static void note_error(error *err, error found) {
+  if (!*err)
+    *err = found;
+}
+
+/* Add a range to the ones checked for overlaps, empty ones are skipped */
+static error add_range(verify_range_t **ranges,
+                       uint32_t *count,
+                       uint32_t *avail,
+                       uint32_t start,
+                       uint32_t len,
+                       const char *what,
+                       const char *name) {
+  verify_range_t *tmp;
+
+  if (!len)
+    return SUCCESS;
+
+  if (*count == *avail) {
+    *avail = *avail ? 2 * *avail : 32;
+    if (!(tmp = realloc(*ranges, *avail * sizeof(**ranges)))) {
+      errorf("out of memory\n");
+      return ERROR_NOMEM;
     }
+    *ranges = tmp;
+  }
+
+  (*ranges)[*count].start = start;
+  (*ranges)[*count].end = start + len;
+  snprintf((*ranges)[*count].what, sizeof((*ranges)[*count].what), "%s%s", what, name);
+  (*count)++;
+
+  return SUCCESS;
+}
+
+/* Add a line to a buffer of lines, a line that doesn't fit is dropped */
+static void append_line(char **buf, size_t *len, const char *line) {
+  size_t n = strlen(line);
+  char *tmp;
+
+  if (!(tmp = realloc(*buf, *len + n + 2)))
+    return;
+
+  memcpy(tmp + *len, line, n);
+  tmp[*len + n] = '\n';
+  tmp[*len + n + 1] = '\0';
+  *buf = tmp;
+  *len += n + 1;
+}
 
-    fprintf(f, "Extracting %s... ", name);
+/* Check the checksums of all the headers, that the headers and the
+ * partition data are inside the file and that none of them overlap.
+ * The error of the first problem found is returned, those of the broken
+ * offsets stop the checks as there is nothing more to follow. If sums
+ * is given, the checksum of the data of every partition inside the file
+ * is added to its list. */
+static error verify_image(hdr_t *base, uint32_t size, bool zynqmp, verify_task_t *sums) {
+  img_hdr_tab_t *tab = ABS_BADDR(base, sizeof(hdr_t));
+  verify_range_t *ranges = NULL;
+  uint32_t count = 0, avail = 0, images = 0, words = size / sizeof(uint32_t);
+  uint32_t data_off, last, i, n;
+  char name[BOOTROM_IMG_MAX_NAME_LEN], line[BOOTROM_IMG_MAX_NAME_LEN + 16];
+  img_hdr_t *img;
+  part_hdr_t *part;
+  error err = SUCCESS, walk;
 
-    /* Treat bitstream files in a separate way */
-    if (is_postfix(name, ".bit")) {
-      /* Zynq bitstream partisions are appended with an extra noop */
-      if (!arguments->zynqmp)
-        partsize--;
+  if (base->width_detect != BOOTROM_WIDTH_DETECT ||
+      memcmp(&base->img_id, BOOTROM_IMG_ID, sizeof(base->img_id))) {
+    errorf("not a boot image\n");
+    return ERROR_BIN_NOFILE;
+  }
 
-      /* Reconstruct headers for bit files if it was requested */
-      if (arguments->part)
-        bitstream_write_header(bfile, partsize, arguments->design, arguments->part);
+  if (base->checksum != calc_checksum(&base->width_detect, &base->checksum - 1)) {
+    errorf("wrong boot header checksum\n");
+    note_error(&err, ERROR_BIN_CHECKSUM);
+  }
+
+  if (zynqmp && tab->checksum != calc_checksum(&tab->version, &tab->checksum - 1)) {
+    errorf("wrong image header table checksum\n");
+    note_error(&err, ERROR_BIN_CHECKSUM);
+  }
+
+  if ((uint64_t) base->src_offset + base->total_img_len > size) {
+    errorf("the bootloader runs past the end of the file\n");
+    note_error(&err, ERROR_BIN_WADDR);
+  }
 
-      /* Perform byteswapped extraction if it was requested */
-      if (arguments->swap)
-        bitstream_write(bfile, partsize, data);
+  walk = add_range(&ranges,
+                   &count,
+                   &avail,
+                   0,
+                   (sizeof(hdr_t) + sizeof(img_hdr_tab_t)) / sizeof(uint32_t),
+                   "the boot header",
+                   "");
+
+  for (img = NULL; !walk && (walk = get_next_image(base, size, &img)) == SUCCESS;) {
+    /* Every image header takes some room, so there can't be more of them */
+    if (++images > size / sizeof(img_hdr_t)) {
+      errorf("the image headers form a loop\n");
+      walk = ERROR_BIN_WADDR;
+      break;
+    }
+
+    name_to_string(name, img, offsetof(img_hdr_t, name));
+    walk = add_range(&ranges,
+                     &count,
+                     &avail,
+                     REL_BADDR(base, img) / sizeof(uint32_t),
+                     sizeof(img_hdr_t) / sizeof(uint32_t),
+                     "the image header of ",
+                     name);
+
+    for (n = 0; !walk && (walk = get_image_part(base, size, img, n, zynqmp, &part)) == SUCCESS;
+         n++) {
+      if (part->checksum != calc_checksum(&part->pd_len, &part->checksum - 1)) {
+        errorf("wrong partition header checksum: %s\n", name);
+        note_error(&err, ERROR_BIN_CHECKSUM);
+      }
+
+      if (zynqmp)
+        data_off = ((zynqmp_hdr_t *) part)->actual_part_off;
       else
-        fwrite(data, partsize, sizeof(uint32_t), bfile);
-    } else {
-      fwrite(data, partsize, sizeof(uint32_t), bfile);
+        data_off = ((zynq_hdr_t *) part)->data_off;
+
+      walk = add_range(&ranges,
+                       &count,
+                       &avail,
+                       REL_BADDR(base, part) / sizeof(uint32_t),
+                       sizeof(part_hdr_t) / sizeof(uint32_t),
+                       "the partition header of ",
+                       name);
+
+      if ((uint64_t) data_off + part->total_len > words) {
+        errorf("partition runs past the end of the file: %s\n", name);
+        note_error(&err, ERROR_BIN_WADDR);
+      } else if (!walk) {
+        walk = add_range(&ranges, &count, &avail, data_off, part->total_len, "partition ", name);
+
+        if (sums) {
+          snprintf(line,
+                   sizeof(line),
+                   "%s: 0x%08x",
+                   name,
+                   checksum_words(ABS_WADDR(base, data_off), part->total_len));
+          append_line(&sums->sums, &sums->sums_len, line);
+        }
+      }
     }
 
-    fclose(bfile);
+    if (walk == ERROR_ITERATION_END)
+      walk = SUCCESS;
+  }
 
-    fprintf(f, "done\n");
+  if (walk != ERROR_ITERATION_END) {
+    free(ranges);
+    return err ? err : walk;
   }
 
-  return err == ERROR_ITERATION_END ? SUCCESS : err;
+  /* Each range is checked against the one reaching the furthest before it */
+  qsort(ranges, count, sizeof(*ranges), cmp_ranges);
+  for (last = 0, i = 1; i < count; i++) {
+    if (ranges[i].start < ranges[last].end) {
+      errorf("%s overlaps %s\n", ranges[i].what, ranges[last].what);
+      note_error(&err, ERROR_BIN_OVERLAP);
+    }
+    if (ranges[i].end > ranges[last].end)
+      last = i;
+  }
+
+  free(ranges);
+  return err;
+}
+
+/* error_sink_t callback keeping the messages of a verified image */
+static void keep_message(void *arg, const char *msg) {
+  verify_task_t *task = arg;
+
+  append_line(&task->msgs, &task->msgs_len, msg);
+}
+
+/* run_parallel callback verifying a single image */
+static error verify_file(void *arg, uint32_t i) {
+  verify_t *ver = arg;
+  verify_task_t *task = &ver->tasks[i];
+  error_sink_t prev = set_error_sink((error_sink_t){.fn = keep_message, .arg = task});
+  mapped_file_t image;
+
+  if (map_file(task->fname, &image)) {
+    task->err = ERROR_BIN_NOFILE;
+  } else if (image.size < sizeof(hdr_t) + sizeof(img_hdr_tab_t) || image.size > UINT32_MAX) {
+    errorf("not a boot image\n");
+    task->err = ERROR_BIN_NOFILE;
+    unmap_file(&image);
+  } else {
+    /* Only the headers are read unless the data is summed as well */
+    madvise((void *) image.data, image.size, ver->sums ? MADV_SEQUENTIAL : MADV_RANDOM);
+    task->err =
+      verify_image((hdr_t *) image.data, image.size, ver->zynqmp, ver->sums ? task : NULL);
+    unmap_file(&image);
+  }
+
+  set_error_sink(prev);
+
+  /* A broken image doesn't stop the others from being checked */
+  return SUCCESS;
+}
+
+/* Verify the images given on the command line, up to arguments->jobs at
+ * the same time. A line with the result of each of them goes to f, the
+ * problems found are reported as errors. The error of the first broken
+ * image is returned. */
+error verify_images(FILE *f, struct arguments *arguments) {
+  verify_task_t *tasks;
+  verify_t ver;
+  error err = SUCCESS;
+  char *msg, *end;
+  int i;
+
+  if (!(tasks = calloc(arguments->verify_count, sizeof(*tasks)))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  for (i = 0; i < arguments->verify_count; i++)
+    tasks[i].fname = arguments->verify_names[i];
+
+  ver.tasks = tasks;
+  ver.zynqmp = arguments->zynqmp;
+  ver.sums = arguments->partitions;
+  run_parallel(arguments->jobs, arguments->verify_count, verify_file, &ver);
+
+  for (i = 0; i < arguments->verify_count; i++) {
+    for (msg = tasks[i].msgs; msg && (end = strchr(msg, '\n')); msg = end + 1)
+      errorf("%s: %.*s\n", tasks[i].fname, (int) (end - msg), msg);
+
+    fprintf(f, "%s: %s\n", tasks[i].fname, tasks[i].err ? "FAILED" : "OK");
+    for (msg = tasks[i].sums; msg && (end = strchr(msg, '\n')); msg = end + 1)
+      fprintf(f, "  %.*s\n", (int) (end - msg), msg);
+
+    if (!err)
+      err = tasks[i].err;
+
+    free(tasks[i].msgs);
+    free(tasks[i].sums);
+  }
+
+  free(tasks);
+  return err;
 }
 
 /* Convert a name encoded as big-endian 32bit words to string */
@@ -474,11 +1260,12 @@ static int name_to_string(char *dst, void *base, int offset) {
   return p;
 }
 
-/* Checkes wether poffset points to a correct word offset */
-static error verify_waddr(void *base, uint32_t size, uint32_t *poffset) {
+/* Checkes wether poffset points to a correct word offset
+ * followed by at least len bytes of the image */
+static error verify_waddr(void *base, uint32_t size, uint32_t *poffset, uint32_t len) {
   uint32_t rel;
 
-  if (*poffset < size)
+  if ((uint64_t) *poffset * sizeof(uint32_t) + len <= size)
     return SUCCESS;
   rel = REL_BADDR(base, poffset);
   errorf("0x%08x: wrong offset 0x%08x\n", rel, *poffset);
@@ -494,10 +1281,10 @@ static error get_next_image(void *base, uint32_t size, img_hdr_t **img) {
     /* Initialize *img if it was NULL */
     tab = ABS_BADDR(base, sizeof(hdr_t));
 
-    if ((err = verify_waddr(base, size, &tab->part_img_hdr_off)))
+    if ((err = verify_waddr(base, size, &tab->part_img_hdr_off, sizeof(img_hdr_t))))
       return err;
     *img = ABS_WADDR(base, tab->part_img_hdr_off);
-  } else if ((err = verify_waddr(base, size, &(*img)->next_img_off))) {
+  } else if ((err = verify_waddr(base, size, &(*img)->next_img_off, sizeof(img_hdr_t)))) {
     /* Return error if the next image offset is incorrect */
     return err;
   } else {
@@ -510,10 +1297,43 @@ static error get_next_image(void *base, uint32_t size, img_hdr_t **img) {
   return SUCCESS;
 }
 
+/* Get the n-th partition header of an image, the partitions of a split
+ * file follow each other and point back at their image header. Their
+ * number is kept in the name length, which is 1 otherwise. */
+static error get_image_part(void *base,
+                            uint32_t size,
+                            img_hdr_t *img,
+                            uint32_t n,
+                            int zynqmp,
+                            part_hdr_t **part) {
+  uint64_t off = img->part_hdr_off + (uint64_t) n * sizeof(part_hdr_t) / sizeof(uint32_t);
+  uint32_t img_off;
+  error err;
+
+  if (n == 0) {
+    if ((err = verify_waddr(base, size, &img->part_hdr_off, sizeof(part_hdr_t))))
+      return err;
+    *part = ABS_WADDR(base, img->part_hdr_off);
+    return SUCCESS;
+  }
+
+  if (n >= img->name_len || off * sizeof(uint32_t) + sizeof(part_hdr_t) > size)
+    return ERROR_ITERATION_END;
+
+  *part = ABS_WADDR(base, off);
+  if (zynqmp)
+    img_off = ((zynqmp_hdr_t *) *part)->img_hdr_off;
+  else
+    img_off = ((zynq_hdr_t *) *part)->img_hdr_off;
+
+  return img_off == REL_BADDR(base, img) / sizeof(uint32_t) ? SUCCESS : ERROR_ITERATION_END;
+}
+
 /* Define argument parser */
 static error_t argp_parser(int key, char *arg, struct argp_state *state) {
   struct arguments *arguments = state->input;
-  char *s;
+  char *s, *end;
+  long n;
 
   switch (key) {
   case 'u':
@@ -542,9 +1362,28 @@ static error_t argp_parser(int key, char *arg, struct argp_state *state) {
   case 'p':
     arguments->partitions = true;
     break;
+  case 'v':
+    arguments->verify = true;
+    break;
   case 's':
     arguments->swap = true;
     break;
+  case 'j':
+    n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > 1024)
+      argp_error(state, "invalid number of jobs: %s", arg);
+    arguments->jobs = n;
+    break;
+  case 'F':
+    if (!strcmp(arg, "text"))
+      arguments->output = OUTPUT_TEXT;
+    else if (!strcmp(arg, "json"))
+      arguments->output = OUTPUT_JSON;
+    else if (!strcmp(arg, "jsonl"))
+      arguments->output = OUTPUT_JSONL;
+    else
+      argp_error(state, "unknown output format: %s", arg);
+    break;
   case 'b':
     if (!(s = strchr(arg, ',')))
       argp_usage(state);
@@ -556,7 +1395,16 @@ static error_t argp_parser(int key, char *arg, struct argp_state *state) {
     arguments->swap = true;
     break;
   case ARGP_KEY_ARG:
-    if (state->arg_num == 0) {
+    if (arguments->verify) {
+      if (!arguments->verify_names) {
+        arguments->verify_names = calloc(state->argc + 1, sizeof(char *));
+        if (!arguments->verify_names)
+          return EXIT_FAILURE;
+      }
+      arguments->verify_names[arguments->verify_count++] = arg;
+      if (state->arg_num == 0)
+        arguments->fname = arg;
+    } else if (state->arg_num == 0) {
       arguments->fname = arg;
     } else if (arguments->extract) {
       if (arguments->extract_count <= 0) {
@@ -585,63 +1433,167 @@ static error_t argp_parser(int key, char *arg, struct argp_state *state) {
 /* Finally initialize argp struct */
 static struct argp argp = {argp_options, argp_parser, args_doc, doc, 0, 0, 0};
 
+/* Drop the pages of a mapped range from the process, partially
+ * covered pages at the ends are kept */
+static void release_range(void *addr, size_t len) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t) addr + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t) addr + len) & ~(page - 1);
+
+  if (end > start)
+    madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* Write a mapped range to a file, releasing the pages that were
+ * written on the way so big partitions don't take their size in memory */
+static error write_range(FILE *f, void *addr, size_t len) {
+  const size_t chunk = 8 << 20;
+  uint8_t *ptr = addr;
+  size_t n;
+
+  while (len > 0) {
+    n = len < chunk ? len : chunk;
+    if (fwrite(ptr, 1, n, f) != n)
+      return ERROR_CANT_WRITE;
+    release_range(ptr, n);
+    ptr += n;
+    len -= n;
+  }
+
+  return SUCCESS;
+}
+
+/* Whether a failed copy_file_range or sendfile only means that the
+ * kernel can't do it for these files, anything else is a write error */
+static bool copy_unsupported(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP;
+}
+
+/* Copy a range of the image to a file without passing the data through
+ * the user space if the kernel can do it, on filesystems supporting
+ * reflinks copy_file_range doesn't even copy it. The mapped range is
+ * only used if neither copy_file_range nor sendfile work, or if fd is -1. */
+static error copy_range(FILE *f, int fd, void *base, void *addr, size_t len) {
+  int out_fd = fileno(f);
+  off_t off = REL_BADDR(base, addr);
+  uint8_t *ptr = addr;
+  ssize_t n;
+
+  if (fflush(f))
+    return ERROR_CANT_WRITE;
+
+  if (fd < 0)
+    return write_range(f, ptr, len);
+
+  while (len > 0 && (n = copy_file_range(fd, &off, out_fd, NULL, len, 0)) > 0) {
+    ptr += n;
+    len -= n;
+  }
+
+  if (len > 0 && n < 0 && !copy_unsupported(errno))
+    return ERROR_CANT_WRITE;
+
+  while (len > 0 && (n = sendfile(out_fd, fd, &off, len)) > 0) {
+    ptr += n;
+    len -= n;
+  }
+
+  if (len > 0 && n < 0 && !copy_unsupported(errno))
+    return ERROR_CANT_WRITE;
+
+  return write_range(f, ptr, len);
+}
+
 /* Declare the main function */
 int main(int argc, char *argv[]) {
   error err;
   struct arguments arguments;
-  struct stat bfile_stat;
+  mapped_file_t image;
   uint32_t size;
-  FILE *bfile;
   hdr_t *base;
+  json_t json, *js;
+  int fd;
 
   /* Init non-string arguments */
   memset(&arguments, 0, sizeof(arguments));
+  arguments.jobs = 1;
 
   /* Parse program arguments */
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-  if (stat(arguments.fname, &bfile_stat)) {
-    errorf("could not stat file: %s\n", arguments.fname);
+  if (arguments.verify)
+    return verify_images(stdout, &arguments);
+
+  /* Map the image instead of reading it, so only the pages that are
+   * actually used (the headers, unless extracting) are ever read. The
+   * descriptor is kept to copy the partitions out of the same file. */
+  if ((fd = open(arguments.fname, O_RDONLY)) < 0) {
+    errorf("could not open file: %s\n", arguments.fname);
     return ERROR_BIN_NOFILE;
   }
-  if (!(bfile = fopen(arguments.fname, "rb"))) {
-    errorf("could not open file: %s\n", arguments.fname);
+
+  if (map_fd(fd, arguments.fname, &image)) {
+    close(fd);
     return ERROR_BIN_NOFILE;
   }
 
-  /* Load the image */
-  size = bfile_stat.st_size;
+  if (image.size < sizeof(hdr_t) + sizeof(img_hdr_tab_t) || image.size > UINT32_MAX) {
+    errorf("not a boot image: %s\n", arguments.fname);
+    unmap_file(&image);
+    close(fd);
+    return ERROR_BIN_NOFILE;
+  }
 
-  if (!(base = malloc(size)))
-    return ERROR_NOMEM;
+  size = image.size;
+  base = (hdr_t *) image.data;
+
+  /* The headers are scattered, reading ahead around them is a waste */
+  madvise((void *) image.data, image.size, MADV_RANDOM);
 
-  fread(base, sizeof(uint8_t), bfile_stat.st_size, bfile);
-  fclose(bfile);
+  err = SUCCESS;
 
-  if (arguments.list)
+  /* The JSON document describes everything that was requested,
+   * it is fully buffered as it is meant to be read by tools */
+  js = NULL;
+  if (arguments.output != OUTPUT_TEXT) {
+    setvbuf(stdout, NULL, _IOFBF, JSON_BUF_SIZE);
+    json_init(&json, stdout, arguments.output == OUTPUT_JSONL);
+    js = &json;
+
+    json_open(js, NULL, '{');
+    json_string(js, "file", arguments.fname);
+    json_string(js, "arch", arguments.zynqmp ? "zynqmp" : "zynq");
+  }
+
+  if (arguments.list && !err)
     /* Print partition names */
-    if ((err = print_file_list(stdout, base, size)))
-      return err;
+    err = js ? json_file_list(js, base, size) : print_file_list(stdout, base, size);
 
-  if (arguments.header)
+  if (arguments.header && !err)
     /* Print boot image's header */
-    if ((err = print_file_header(stdout, base, arguments.zynqmp)))
-      return err;
+    err = js ? json_file_header(js, base, arguments.zynqmp)
+             : print_file_header(stdout, base, arguments.zynqmp);
 
-  if (arguments.images)
+  if (arguments.images && !err)
     /* Print parition image headers */
-    if ((err = print_image_headers(stdout, base, size)))
-      return err;
+    err = js ? json_image_headers(js, base, size) : print_image_headers(stdout, base, size);
 
-  if (arguments.partitions)
+  if (arguments.partitions && !err)
     /* Print partition headers */
-    if ((err = print_partition_headers(stdout, base, size, arguments.zynqmp)))
-      return err;
+    err = js ? json_partition_headers(js, base, size, arguments.zynqmp)
+             : print_partition_headers(stdout, base, size, arguments.zynqmp);
 
-  if (arguments.extract)
-    /* Write partition contents to files */
-    if ((err = print_partition_contents(stdout, base, size, &arguments)))
-      return err;
+  if (arguments.extract && !err)
+    /* Write partition contents to files, copied straight from the file
+     * unless it had to be read to memory */
+    err = print_partition_contents(
+      stdout, js, base, size, image.kind == MAPPED_FILE_MMAP ? fd : -1, &arguments);
+
+  if (js)
+    json_finish(js);
+
+  unmap_file(&image);
+  close(fd);
 
-  return EXIT_SUCCESS;
+  return err ? err : EXIT_SUCCESS;
 }
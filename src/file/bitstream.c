@@ -24,49 +24,144 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* fallocate */
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <bootrom.h>
 #include <common.h>
+#include <fcntl.h>
 #include <file/bitstream.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITSTREAM_SWAP_X86
+#endif
+
+/* Byte-swapping kernels, all of them copy words from src to dst
+ * swapping the byte order of each one, src doesn't need to be aligned */
+typedef void (*swap_words_fn)(uint32_t *dst, const uint8_t *src, size_t words);
+
+static void swap_words_scalar(uint32_t *dst, const uint8_t *src, size_t words) {
+  uint32_t word;
+  size_t i;
+
+  for (i = 0; i < words; i++) {
+    memcpy(&word, src + i * sizeof(word), sizeof(word));
+    dst[i] = __builtin_bswap32(word);
+  }
+}
+
+#ifdef BITSTREAM_SWAP_X86
+__attribute__((target("ssse3"))) static void
+swap_words_ssse3(uint32_t *dst, const uint8_t *src, size_t words) {
+  const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  __m128i v;
+  size_t i;
 
-error bitstream_verify(FILE *bitfile) {
-  uint32_t fhdr;
+  for (i = 0; i + 4 <= words; i += 4) {
+    v = _mm_loadu_si128((const __m128i *) (src + i * sizeof(uint32_t)));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(v, mask));
+  }
+
+  swap_words_scalar(dst + i, src + i * sizeof(uint32_t), words - i);
+}
+
+__attribute__((target("avx2"))) static void
+swap_words_avx2(uint32_t *dst, const uint8_t *src, size_t words) {
+  /* The shuffle works within 128bit lanes, so both lanes use the same mask */
+  const __m256i mask = _mm256_broadcastsi128_si256(
+    _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+  __m256i v0, v1;
+  size_t i;
+
+  for (i = 0; i + 16 <= words; i += 16) {
+    v0 = _mm256_loadu_si256((const __m256i *) (src + i * sizeof(uint32_t)));
+    v1 = _mm256_loadu_si256((const __m256i *) (src + (i + 8) * sizeof(uint32_t)));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(v0, mask));
+    _mm256_storeu_si256((__m256i *) (dst + i + 8), _mm256_shuffle_epi8(v1, mask));
+  }
+
+  swap_words_ssse3(dst + i, src + i * sizeof(uint32_t), words - i);
+}
 
-  /* Seek to the start of the file */
-  rewind(bitfile);
+__attribute__((target("avx512f,avx512bw"))) static void
+swap_words_avx512(uint32_t *dst, const uint8_t *src, size_t words) {
+  const __m512i mask = _mm512_broadcast_i32x4(
+    _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+  __m512i v0, v1;
+  size_t i;
+
+  for (i = 0; i + 32 <= words; i += 32) {
+    v0 = _mm512_loadu_si512((const void *) (src + i * sizeof(uint32_t)));
+    v1 = _mm512_loadu_si512((const void *) (src + (i + 16) * sizeof(uint32_t)));
+    _mm512_storeu_si512((void *) (dst + i), _mm512_shuffle_epi8(v0, mask));
+    _mm512_storeu_si512((void *) (dst + i + 16), _mm512_shuffle_epi8(v1, mask));
+  }
 
-  fread(&fhdr, 1, sizeof(fhdr), bitfile);
-  if (fhdr != FILE_MAGIC_XILINXBIT_0)
+  swap_words_avx2(dst + i, src + i * sizeof(uint32_t), words - i);
+}
+#endif
+
+static swap_words_fn swap_words_impl = swap_words_scalar;
+static pthread_once_t swap_words_once = PTHREAD_ONCE_INIT;
+
+/* Pick the widest kernel the CPU we're running on supports */
+static void swap_words_select(void) {
+#ifdef BITSTREAM_SWAP_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw"))
+    swap_words_impl = swap_words_avx512;
+  else if (__builtin_cpu_supports("avx2"))
+    swap_words_impl = swap_words_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    swap_words_impl = swap_words_ssse3;
+#endif
+}
+
+void bitstream_swap_words(uint32_t *dst, const void *src, size_t words) {
+  pthread_once(&swap_words_once, swap_words_select);
+  swap_words_impl(dst, src, words);
+}
+
+error bitstream_verify(mapped_file_t *bitfile) {
+  uint32_t fhdr[2];
+
+  if (bitfile->size < sizeof(fhdr))
+    return ERROR_BOOTROM_BITSTREAM;
+
+  memcpy(fhdr, bitfile->data, sizeof(fhdr));
+  if (fhdr[0] != FILE_MAGIC_XILINXBIT_0)
     return ERROR_BOOTROM_BITSTREAM;
 
   /* Xilinx header is 64b, check the other half */
-  fread(&fhdr, 1, sizeof(fhdr), bitfile);
-  if (fhdr != FILE_MAGIC_XILINXBIT_1)
+  if (fhdr[1] != FILE_MAGIC_XILINXBIT_1)
     return ERROR_BOOTROM_BITSTREAM;
 
   /* Both halves match */
   return SUCCESS;
 }
 
-int bitstream_write_header_part(FILE *bitfile, const uint8_t tag, const char *data) {
+/* Append a header section to buf, returns the number of bytes used */
+static size_t bitstream_put_header_part(uint8_t *buf, const uint8_t tag, const char *data) {
   uint16_t len = strlen(data) + 1;
-  uint8_t n;
 
-  fwrite(&tag, sizeof(uint8_t), 1, bitfile);
+  buf[0] = tag;
+  buf[1] = (len >> 8) & 0xFF;
+  buf[2] = len & 0xFF;
+  memcpy(buf + 3, data, len);
 
-  n = (len >> 8) & 0xFF;
-  fwrite(&n, sizeof(uint8_t), 1, bitfile);
-  n = len & 0xFF;
-  fwrite(&n, sizeof(uint8_t), 1, bitfile);
-
-  fwrite(data, sizeof(uint8_t), len, bitfile);
-
-  return 0;
+  return 3 + len;
 }
 
 error bitstream_write_header(FILE *bitfile, uint32_t size, const char *design, const char *part) {
@@ -86,95 +181,193 @@ error bitstream_write_header(FILE *bitfile, uint32_t size, const char *design, c
     0x01,
   };
 
-  int i;
-  uint8_t n;
-
-  char stime[80];
+  char sdate[80], stime[80];
   time_t gtime;
   struct tm ltime;
+  uint8_t *buf;
+  size_t len;
+  int i;
 
   gtime = time(NULL);
-  ltime = *localtime(&gtime);
+  localtime_r(&gtime, &ltime);
+
+  strftime(sdate, sizeof(sdate) - 1, "%Y/%m/%d", &ltime);
+  strftime(stime, sizeof(stime) - 1, "%H:%M:%S", &ltime);
 
-  /* TODO: the header sections are similar, generalize it */
+  /* The whole header is put together first and written at once,
+   * each section takes a tag, a 16bit length and the string */
+  len = sizeof(header) + 5;
+  len += 3 + strlen(design) + 1;
+  len += 3 + strlen(part) + 1;
+  len += 3 + strlen(sdate) + 1;
+  len += 3 + strlen(stime) + 1;
+
+  if (!(buf = malloc(len))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  /* Magic numbers */
+  memcpy(buf, header, sizeof(header));
+  len = sizeof(header);
 
-  /* Write magic numbers */
-  fwrite(header, sizeof(uint8_t), sizeof(header), bitfile);
+  /* Sections 'a' to 'd' */
+  len += bitstream_put_header_part(buf + len, 'a', design);
+  len += bitstream_put_header_part(buf + len, 'b', part);
+  len += bitstream_put_header_part(buf + len, 'c', sdate);
+  len += bitstream_put_header_part(buf + len, 'd', stime);
 
-  /* Write the section 'a' */
+  /* The start of the section 'e', it has a 32bit length */
+  buf[len++] = 'e';
+  for (i = 3; i >= 0; i--)
+    buf[len++] = (size >> (i * 8)) & 0xFF;
 
-  bitstream_write_header_part(bitfile, 'a', design);
+  if (fwrite(buf, sizeof(uint8_t), len, bitfile) != len) {
+    free(buf);
+    return ERROR_CANT_WRITE;
+  }
 
-  /* Write the section 'b' */
-  bitstream_write_header_part(bitfile, 'b', part);
+  free(buf);
+  return SUCCESS;
+}
 
-  /* Write the section 'c' */
-  strftime(stime, sizeof(stime) - 1, "%Y/%m/%d", &ltime);
-  bitstream_write_header_part(bitfile, 'c', stime);
+/* Swap the words straight into the output file mapped at its current
+ * position. Only regular files can be mapped, the space is allocated
+ * beforehand so running out of it is an error and not a SIGBUS. */
+static bool bitstream_write_mapped(FILE *bitfile, uint32_t size, const uint32_t *data) {
+  size_t len = (size_t) size * sizeof(uint32_t);
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  int fd = fileno(bitfile);
+  struct stat st;
+  uint8_t *map;
+  off_t pos, start;
 
-  /* Write the section 'd' */
-  strftime(stime, sizeof(stime) - 1, "%H:%M:%S", &ltime);
-  bitstream_write_header_part(bitfile, 'd', stime);
+  if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+    return false;
 
-  /* Write the start of the section 'e' */
-  n = 'e';
-  fwrite(&n, sizeof(uint8_t), 1, bitfile);
+  if ((pos = ftello(bitfile)) < 0)
+    return false;
 
-  for (i = 3; i >= 0; i--) {
-    n = (size >> (i * 8)) & 0xFF;
-    fwrite(&n, sizeof(uint8_t), 1, bitfile);
-  }
+  if (fallocate(fd, 0, pos, len))
+    return false;
 
-  return SUCCESS;
+  start = pos & ~(off_t) (page - 1);
+  map = mmap(NULL, len + (pos - start), PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+  if (map == MAP_FAILED)
+    return false;
+
+  bitstream_swap_words((uint32_t *) (map + (pos - start)), data, size);
+  munmap(map, len + (pos - start));
+
+  return fseeko(bitfile, pos + len, SEEK_SET) == 0;
 }
 
 error bitstream_write(FILE *bitfile, uint32_t size, uint32_t *data) {
-  uint32_t swapped;
-  unsigned int i;
+  /* Large enough for the writes to bypass the stdio buffer */
+  const size_t chunk = (1 << 20) / sizeof(uint32_t);
+  uint32_t *buf;
+  size_t n;
+
+  if (size == 0)
+    return SUCCESS;
+
+  if (fflush(bitfile))
+    return ERROR_CANT_WRITE;
 
-  for (i = 0; i < size; i++) {
-    swapped = __builtin_bswap32(data[i]);
-    fwrite(&swapped, 1, sizeof(swapped), bitfile);
+  if (bitstream_write_mapped(bitfile, size, data))
+    return SUCCESS;
+
+  /* Otherwise go through a staging buffer, a chunk at a time */
+  if (!(buf = malloc(chunk * sizeof(uint32_t)))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
   }
+
+  for (; size > 0; size -= n, data += n) {
+    n = size < chunk ? size : chunk;
+    bitstream_swap_words(buf, data, n);
+
+    if (fwrite(buf, sizeof(uint32_t), n, bitfile) != n) {
+      free(buf);
+      return ERROR_CANT_WRITE;
+    }
+  }
+
+  free(buf);
   return SUCCESS;
 }
 
-error bitstream_append(uint32_t *addr, FILE *bitfile, uint32_t *img_size) {
-  uint32_t *dest = addr;
-  uint32_t chunk, rchunk;
-  uint8_t section_size;
-  char section_data[255];
-  char section_hdr[2];
-  unsigned int i;
+/* Find the data section, returns its offset and length in bytes */
+static error bitstream_find_data(mapped_file_t *bitfile, size_t *data_off, uint32_t *data_len) {
+  const uint8_t *data = bitfile->data;
+  size_t off;
 
   /* Skip the header - it is already checked */
-  fseek(bitfile, FILE_XILINXBIT_SEC_START, SEEK_SET);
+  off = FILE_XILINXBIT_SEC_START;
   while (1) {
-    fread(&section_hdr, 1, sizeof(section_hdr), bitfile);
-    if (section_hdr[1] != 0x1 && section_hdr[1] != 0x0) {
-      fclose(bitfile);
+    /* Every section starts with a tag and its length */
+    if (off + 3 > bitfile->size) {
+      errorf("bitstream file ended before the data section.\n");
+      return ERROR_BOOTROM_BITSTREAM;
+    }
+
+    if (data[off + 1] != 0x1 && data[off + 1] != 0x0) {
       errorf("bitstream file seems to have mismatched sections.\n");
       return ERROR_BOOTROM_BITSTREAM;
     }
 
-    if (section_hdr[0] == FILE_XILINXBIT_SEC_DATA)
+    if (data[off] == FILE_XILINXBIT_SEC_DATA)
       break;
 
-    fread(&section_size, 1, sizeof(uint8_t), bitfile);
-    fread(&section_data, 1, section_size, bitfile);
+    off += 3 + data[off + 2];
   }
 
-  fseek(bitfile, -1, SEEK_CUR);
-  fread(img_size, 1, 4, bitfile);
+  /* The data section has a 32bit length instead of the 16bit one */
+  if (off + 5 > bitfile->size) {
+    errorf("bitstream file ended before the data section.\n");
+    return ERROR_BOOTROM_BITSTREAM;
+  }
 
-  *img_size = __builtin_bswap32(*img_size);
-  uint32_t read_size = (*img_size + 3) & ~3;
+  memcpy(data_len, data + off + 1, sizeof(*data_len));
+  *data_len = __builtin_bswap32(*data_len);
+  *data_off = off + 5;
 
-  for (i = 0; i < read_size; i += sizeof(chunk)) {
-    fread(&chunk, 1, sizeof(chunk), bitfile);
-    rchunk = __builtin_bswap32(chunk);
-    memcpy(dest, &rchunk, sizeof(rchunk));
-    dest++;
+  return SUCCESS;
+}
+
+error bitstream_get_size(mapped_file_t *bitfile, uint32_t *img_size) {
+  size_t off;
+
+  return bitstream_find_data(bitfile, &off, img_size);
+}
+
+error bitstream_append(uint32_t *addr, mapped_file_t *bitfile, uint32_t *img_size) {
+  uint32_t *dest = addr;
+  uint32_t chunk;
+  uint32_t read_size;
+  size_t off, avail, i;
+  error err;
+
+  if ((err = bitstream_find_data(bitfile, &off, img_size)))
+    return err;
+
+  read_size = (*img_size + 3) & ~3;
+
+  /* Don't read past the end of the file, zero the missing part */
+  avail = bitfile->size - off;
+  if (avail > read_size)
+    avail = read_size;
+
+  /* Swap all the complete words straight into the image in one go */
+  i = avail & ~(sizeof(chunk) - 1);
+  bitstream_swap_words(dest, bitfile->data + off, i / sizeof(chunk));
+  dest += i / sizeof(chunk);
+
+  for (; i < read_size; i += sizeof(chunk)) {
+    chunk = 0;
+    if (i < avail)
+      memcpy(&chunk, bitfile->data + off + i, avail - i);
+    *dest++ = __builtin_bswap32(chunk);
   }
 
   return SUCCESS;
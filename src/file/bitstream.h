@@ -2,13 +2,21 @@
 #define BITSTREAM_H
 
 /* Check if this really is a bitstream file */
-error bitstream_verify(FILE *bitfile);
+error bitstream_verify(mapped_file_t *bitfile);
+
+/* Copy words from src to dst swapping their byte order, uses the
+ * fastest SIMD kernel available on the host CPU */
+void bitstream_swap_words(uint32_t *dst, const void *src, size_t words);
 
 error bitstream_write_header(FILE *bfile, uint32_t size, const char *design, const char *part);
 error bitstream_write(FILE *bfile, uint32_t size, uint32_t *data);
 
+/* Returns the bitstream data size in bytes via the last argument.
+ * The regular return value is the error code. */
+error bitstream_get_size(mapped_file_t *bitfile, uint32_t *img_size);
+
 /* Returns the appended bitstream size via the last argument.
  * The regular return value is the error code. */
-error bitstream_append(uint32_t *addr, FILE *bitfile, uint32_t *img_size);
+error bitstream_append(uint32_t *addr, mapped_file_t *bitfile, uint32_t *img_size);
 
 #endif
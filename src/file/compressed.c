@@ -0,0 +1,482 @@
+/* Copyright (c) 2013-2021, Antmicro Ltd
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bootrom.h>
+#include <common.h>
+#include <file/compressed.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/* Size of the buffer reused by the passes not keeping the data */
+#define COMPRESSED_SCRATCH_SIZE (64 * 1024)
+
+typedef enum decode_status_t
+{
+  DECODE_MORE = 0,
+  DECODE_END,
+  DECODE_ERROR,
+} decode_status_t;
+
+typedef enum decode_mode_t
+{
+  DECODE_HEAD,  /* fill the buffer with the start of the data */
+  DECODE_COUNT, /* decompress all the data reusing the buffer */
+  DECODE_ALL,   /* decompress all the data, which has to fill the buffer exactly */
+} decode_mode_t;
+
+/* A streaming decoder, every step consumes some of the input and
+ * produces some output, advancing both of the buffers */
+typedef struct decoder_ops_t {
+  void *(*open)(void);
+  decode_status_t (*step)(void *state,
+                          const uint8_t **in,
+                          size_t *in_len,
+                          uint8_t **out,
+                          size_t *out_len);
+  void (*close)(void *state);
+
+  /* Gets the decompressed size recorded in the file, ERROR_ITERATION_END
+   * is returned if there is none to be trusted. NULL if the format never
+   * records it. */
+  error (*recorded_size)(mapped_file_t *file, uint64_t *size);
+} decoder_ops_t;
+
+typedef struct compressed_format_t {
+  uint32_t magic;
+  uint32_t magic_mask;
+  const char *name;
+  const decoder_ops_t *ops; /* NULL if the library is not built in */
+} compressed_format_t;
+
+#ifdef WITH_ZLIB
+static void *gzip_open(void) {
+  z_stream *strm = calloc(1, sizeof(*strm));
+
+  /* Expect the gzip wrapper only */
+  if (strm && inflateInit2(strm, 16 + MAX_WBITS) != Z_OK) {
+    free(strm);
+    return NULL;
+  }
+
+  return strm;
+}
+
+static decode_status_t
+gzip_step(void *state, const uint8_t **in, size_t *in_len, uint8_t **out, size_t *out_len) {
+  z_stream *strm = state;
+  uInt in_n = *in_len < UINT_MAX ? *in_len : UINT_MAX;
+  uInt out_n = *out_len < UINT_MAX ? *out_len : UINT_MAX;
+  int ret;
+
+  strm->next_in = (Bytef *) *in;
+  strm->avail_in = in_n;
+  strm->next_out = *out;
+  strm->avail_out = out_n;
+
+  ret = inflate(strm, Z_NO_FLUSH);
+
+  *in += in_n - strm->avail_in;
+  *in_len -= in_n - strm->avail_in;
+  *out += out_n - strm->avail_out;
+  *out_len -= out_n - strm->avail_out;
+
+  switch (ret) {
+  case Z_STREAM_END:
+    /* The data of the next member is appended, as gzip does */
+    if (*in_len) {
+      inflateReset(strm);
+      return DECODE_MORE;
+    }
+    return DECODE_END;
+  case Z_OK:
+  case Z_BUF_ERROR:
+    return DECODE_MORE;
+  default:
+    return DECODE_ERROR;
+  }
+}
+
+static void gzip_close(void *state) {
+  inflateEnd(state);
+  free(state);
+}
+
+static const decoder_ops_t gzip_ops = {
+  .open = gzip_open,
+  .step = gzip_step,
+  .close = gzip_close,
+  /* The size at the end of the file is only the one of the last member,
+   * so it can't be trusted */
+  .recorded_size = NULL,
+};
+#define GZIP_OPS (&gzip_ops)
+#else
+#define GZIP_OPS NULL
+#endif
+
+#ifdef WITH_LZMA
+static void *xz_open(void) {
+  lzma_stream init = LZMA_STREAM_INIT;
+  lzma_stream *strm = malloc(sizeof(*strm));
+
+  if (!strm)
+    return NULL;
+
+  /* Concatenated streams are decompressed one after another, as xz does */
+  *strm = init;
+  if (lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+    free(strm);
+    return NULL;
+  }
+
+  return strm;
+}
+
+static decode_status_t
+xz_step(void *state, const uint8_t **in, size_t *in_len, uint8_t **out, size_t *out_len) {
+  lzma_stream *strm = state;
+  lzma_ret ret;
+
+  strm->next_in = *in;
+  strm->avail_in = *in_len;
+  strm->next_out = *out;
+  strm->avail_out = *out_len;
+
+  /* All of the input is there from the start */
+  ret = lzma_code(strm, LZMA_FINISH);
+
+  *in = strm->next_in;
+  *in_len = strm->avail_in;
+  *out = strm->next_out;
+  *out_len = strm->avail_out;
+
+  switch (ret) {
+  case LZMA_STREAM_END:
+    return DECODE_END;
+  case LZMA_OK:
+  case LZMA_BUF_ERROR:
+    return DECODE_MORE;
+  default:
+    return DECODE_ERROR;
+  }
+}
+
+static void xz_close(void *state) {
+  lzma_end(state);
+  free(state);
+}
+
+/* Sum the sizes in the indexes of the streams, going from the end of
+ * the file as the footer of a stream points at its index */
+static error xz_recorded_size(mapped_file_t *file, uint64_t *size) {
+  lzma_stream_flags flags;
+  lzma_index *index;
+  uint64_t memlimit, stream_size;
+  size_t end = file->size, pos;
+  lzma_ret ret;
+
+  *size = 0;
+  while (end > 0) {
+    /* Skip the padding between the streams */
+    while (end >= 4 && !memcmp(file->data + end - 4, "\0\0\0\0", 4))
+      end -= 4;
+
+    if (end < 2 * LZMA_STREAM_HEADER_SIZE)
+      return ERROR_ITERATION_END;
+
+    pos = end - LZMA_STREAM_HEADER_SIZE;
+    if (lzma_stream_footer_decode(&flags, file->data + pos) != LZMA_OK ||
+        flags.backward_size > pos)
+      return ERROR_ITERATION_END;
+
+    index = NULL;
+    memlimit = UINT64_MAX;
+    end = pos;
+    pos -= flags.backward_size;
+    ret = lzma_index_buffer_decode(&index, &memlimit, NULL, file->data, &pos, end);
+    if (ret != LZMA_OK)
+      return ERROR_ITERATION_END;
+
+    *size += lzma_index_uncompressed_size(index);
+    stream_size = lzma_index_stream_size(index);
+    lzma_index_end(index, NULL);
+
+    end += LZMA_STREAM_HEADER_SIZE;
+    if (stream_size > end)
+      return ERROR_ITERATION_END;
+    end -= stream_size;
+  }
+
+  return SUCCESS;
+}
+
+static const decoder_ops_t xz_ops = {
+  .open = xz_open,
+  .step = xz_step,
+  .close = xz_close,
+  .recorded_size = xz_recorded_size,
+};
+#define XZ_OPS (&xz_ops)
+#else
+#define XZ_OPS NULL
+#endif
+
+#ifdef WITH_ZSTD
+static void *zstd_open(void) {
+  return ZSTD_createDCtx();
+}
+
+static decode_status_t
+zstd_step(void *state, const uint8_t **in, size_t *in_len, uint8_t **out, size_t *out_len) {
+  ZSTD_inBuffer in_buf = {*in, *in_len, 0};
+  ZSTD_outBuffer out_buf = {*out, *out_len, 0};
+  size_t ret;
+
+  ret = ZSTD_decompressStream(state, &out_buf, &in_buf);
+
+  *in += in_buf.pos;
+  *in_len -= in_buf.pos;
+  *out += out_buf.pos;
+  *out_len -= out_buf.pos;
+
+  if (ZSTD_isError(ret))
+    return DECODE_ERROR;
+
+  /* The next frame (if any) starts once a frame is finished */
+  return ret == 0 && !*in_len ? DECODE_END : DECODE_MORE;
+}
+
+static void zstd_close(void *state) {
+  ZSTD_freeDCtx(state);
+}
+
+/* Frames may have their content size, it has to be there in all of them */
+static error zstd_recorded_size(mapped_file_t *file, uint64_t *size) {
+  unsigned long long frame_size;
+  size_t pos, len;
+
+  *size = 0;
+  for (pos = 0; pos < file->size; pos += len) {
+    frame_size = ZSTD_getFrameContentSize(file->data + pos, file->size - pos);
+    if (frame_size == ZSTD_CONTENTSIZE_UNKNOWN || frame_size == ZSTD_CONTENTSIZE_ERROR)
+      return ERROR_ITERATION_END;
+
+    len = ZSTD_findFrameCompressedSize(file->data + pos, file->size - pos);
+    if (ZSTD_isError(len))
+      return ERROR_ITERATION_END;
+
+    *size += frame_size;
+  }
+
+  return SUCCESS;
+}
+
+static const decoder_ops_t zstd_ops = {
+  .open = zstd_open,
+  .step = zstd_step,
+  .close = zstd_close,
+  .recorded_size = zstd_recorded_size,
+};
+#define ZSTD_OPS (&zstd_ops)
+#else
+#define ZSTD_OPS NULL
+#endif
+
+/* gzip has only three bytes of magic, the fourth one holds flags */
+static const compressed_format_t compressed_formats[] = {
+  {FILE_MAGIC_GZIP, 0x00FFFFFF, "gzip", GZIP_OPS},
+  {FILE_MAGIC_XZ,   0xFFFFFFFF, "xz",   XZ_OPS  },
+  {FILE_MAGIC_ZSTD, 0xFFFFFFFF, "zstd", ZSTD_OPS},
+};
+
+#define COMPRESSED_FORMATS_NUM (sizeof(compressed_formats) / sizeof(compressed_formats[0]))
+
+/* Find the format of the file and check if it can be decompressed */
+static error get_format(mapped_file_t *file, const compressed_format_t **format) {
+  uint32_t magic = 0;
+  uint32_t i;
+
+  if (file->size >= sizeof(magic))
+    memcpy(&magic, file->data, sizeof(magic));
+
+  for (i = 0; i < COMPRESSED_FORMATS_NUM; i++) {
+    *format = &compressed_formats[i];
+    if ((magic & (*format)->magic_mask) != (*format)->magic)
+      continue;
+
+    if (!(*format)->ops) {
+      errorf("this build does not support %s compressed files\n", (*format)->name);
+      return ERROR_BOOTROM_UNSUPPORTED;
+    }
+
+    return SUCCESS;
+  }
+
+  errorf("not a compressed file\n");
+  return ERROR_BOOTROM_UNSUPPORTED;
+}
+
+/* Run the decoder over the whole file, or only until the buffer is
+ * full for DECODE_HEAD. The number of bytes decompressed is returned
+ * via the last argument. The regular return value is the error code. */
+static error decode(const compressed_format_t *format,
+                    mapped_file_t *file,
+                    uint8_t *buf,
+                    size_t buf_len,
+                    decode_mode_t mode,
+                    uint64_t *total) {
+  const uint8_t *in = file->data;
+  size_t in_len = file->size, in_left, out_len = buf_len, out_left;
+  uint8_t *out = buf, probe;
+  decode_status_t status = DECODE_MORE;
+  void *state;
+  error err = SUCCESS;
+
+  if (!(state = format->ops->open())) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  *total = 0;
+  while (status == DECODE_MORE) {
+    if (!out_len) {
+      if (mode == DECODE_HEAD)
+        break;
+
+      /* All the data has to fit, a single byte more is an error */
+      if (mode == DECODE_ALL) {
+        out = &probe;
+        out_len = 1;
+      } else {
+        out = buf;
+        out_len = buf_len;
+      }
+    }
+
+    in_left = in_len;
+    out_left = out_len;
+    status = format->ops->step(state, &in, &in_len, &out, &out_len);
+    *total += out_left - out_len;
+
+    if (status == DECODE_ERROR) {
+      errorf("broken %s data\n", format->name);
+      err = ERROR_CANT_READ;
+    } else if (mode == DECODE_ALL && *total > buf_len) {
+      errorf("%s data longer than the size recorded in it\n", format->name);
+      err = ERROR_CANT_READ;
+    } else if (status == DECODE_MORE && in_len == in_left && out_len == out_left) {
+      errorf("%s %s data\n", in_len ? "broken" : "truncated", format->name);
+      err = ERROR_CANT_READ;
+    }
+
+    if (err)
+      break;
+  }
+
+  if (!err && mode == DECODE_ALL && *total < buf_len) {
+    errorf("%s data shorter than the size recorded in it\n", format->name);
+    err = ERROR_CANT_READ;
+  }
+
+  format->ops->close(state);
+
+  return err;
+}
+
+error compressed_get_magic(mapped_file_t *file, uint32_t *magic) {
+  const compressed_format_t *format;
+  uint8_t head[sizeof(*magic)];
+  uint64_t len;
+  error err;
+
+  if ((err = get_format(file, &format)))
+    return err;
+
+  if ((err = decode(format, file, head, sizeof(head), DECODE_HEAD, &len)))
+    return err;
+
+  *magic = 0;
+  if (len == sizeof(head))
+    memcpy(magic, head, sizeof(head));
+
+  return SUCCESS;
+}
+
+error compressed_get_size(mapped_file_t *file, uint64_t *size) {
+  const compressed_format_t *format;
+  uint8_t *scratch;
+  error err;
+
+  if ((err = get_format(file, &format)))
+    return err;
+
+  if (format->ops->recorded_size && format->ops->recorded_size(file, size) == SUCCESS)
+    return SUCCESS;
+
+  /* Decompress the data just to count it */
+  if (!(scratch = malloc(COMPRESSED_SCRATCH_SIZE))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  err = decode(format, file, scratch, COMPRESSED_SCRATCH_SIZE, DECODE_COUNT, size);
+  free(scratch);
+
+  return err;
+}
+
+error compressed_extract(void *addr, mapped_file_t *file, uint64_t size) {
+  const compressed_format_t *format;
+  uint64_t len;
+  error err;
+
+  if ((err = get_format(file, &format)))
+    return err;
+
+  if (size > SIZE_MAX) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  return decode(format, file, addr, size, DECODE_ALL, &len);
+}
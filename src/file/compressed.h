@@ -0,0 +1,18 @@
+#ifndef COMPRESSED_H
+#define COMPRESSED_H
+
+/* Returns the magic word the decompressed data starts with via the last
+ * argument, 0 if it is shorter. The regular return value is the error code. */
+error compressed_get_magic(mapped_file_t *file, uint32_t *magic);
+
+/* Returns the decompressed data size via the last argument. It is taken
+ * from the container if recorded there, otherwise the file is
+ * decompressed once without keeping the data.
+ * The regular return value is the error code. */
+error compressed_get_size(mapped_file_t *file, uint64_t *size);
+
+/* Decompresses the file into addr, which has room for exactly the size
+ * returned by compressed_get_size. The regular return value is the error code. */
+error compressed_extract(void *addr, mapped_file_t *file, uint64_t size);
+
+#endif
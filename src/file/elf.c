@@ -24,139 +24,255 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <elf.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <bootrom.h>
-#include <fcntl.h>
 #include <file/elf.h>
-#include <gelf.h>
-#include <unistd.h>
 
-static bool elf_is_loadable_section(const GElf_Shdr *elf_shdr) {
-  return elf_shdr->sh_type != SHT_NOBITS && (elf_shdr->sh_flags & SHF_ALLOC) &&
-         elf_shdr->sh_size != 0;
+/* The parts of an ELF file needed to flatten it. Only the program
+ * headers are used, the file is loaded the way a loader would load
+ * it, so files without section headers work as well. */
+typedef struct elf_file_t {
+  const uint8_t *phdrs;
+  uint32_t phnum;
+  uint32_t phentsize;
+  uint8_t nbits;
+  uint64_t entry;
+
+  /* The span of the file-backed bytes of all PT_LOAD segments */
+  uint64_t start_addr;
+  uint64_t end_addr;
+} elf_file_t;
+
+/* A PT_LOAD segment with some data in the file */
+typedef struct elf_segment_t {
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+} elf_segment_t;
+
+/* Get program header i if it is a segment to be loaded from the file */
+static bool elf_get_segment(const elf_file_t *elf, uint32_t i, elf_segment_t *seg) {
+  const uint8_t *ptr = elf->phdrs + (size_t) i * elf->phentsize;
+  Elf64_Phdr phdr64;
+  Elf32_Phdr phdr32;
+
+  if (elf->nbits == 64) {
+    memcpy(&phdr64, ptr, sizeof(phdr64));
+    if (phdr64.p_type != PT_LOAD || phdr64.p_filesz == 0)
+      return false;
+
+    seg->addr = phdr64.p_vaddr;
+    seg->offset = phdr64.p_offset;
+    seg->size = phdr64.p_filesz;
+  } else {
+    memcpy(&phdr32, ptr, sizeof(phdr32));
+    if (phdr32.p_type != PT_LOAD || phdr32.p_filesz == 0)
+      return false;
+
+    seg->addr = phdr32.p_vaddr;
+    seg->offset = phdr32.p_offset;
+    seg->size = phdr32.p_filesz;
+  }
+
+  return true;
 }
 
-static error elf_get_startaddr_endaddr(Elf *elf, uint32_t *start_addr, uint32_t *end_addr) {
-  Elf_Scn *elf_scn = NULL;
-  GElf_Shdr elf_shdr;
-  *start_addr = -1;
-  *end_addr = 0;
+/* Validate the headers of a mapped ELF file and find what it loads.
+ * The segments have to be sorted by address, as the ELF specification
+ * requires, and can't overlap. */
+static error elf_open(const mapped_file_t *file, elf_file_t *elf) {
+  const uint8_t *ident = file->data;
+  elf_segment_t seg;
+  Elf64_Ehdr ehdr64;
+  Elf32_Ehdr ehdr32;
+  uint64_t phoff, end = 0;
+  bool found = false;
+  uint32_t i;
 
-  while ((elf_scn = elf_nextscn(elf, elf_scn)) != NULL) {
-    if (gelf_getshdr(elf_scn, &elf_shdr) != &elf_shdr)
+  memset(elf, 0x0, sizeof(*elf));
+
+  if (file->size < EI_NIDENT || memcmp(ident, ELFMAG, SELFMAG) ||
+      ident[EI_DATA] != ELFDATA2LSB || ident[EI_VERSION] != EV_CURRENT)
+    return ERROR_BOOTROM_ELF;
+
+  if (ident[EI_CLASS] == ELFCLASS64 && file->size >= sizeof(ehdr64)) {
+    memcpy(&ehdr64, file->data, sizeof(ehdr64));
+    elf->nbits = 64;
+    elf->entry = ehdr64.e_entry;
+    elf->phnum = ehdr64.e_phnum;
+    elf->phentsize = ehdr64.e_phentsize;
+    phoff = ehdr64.e_phoff;
+
+    if (elf->phentsize < sizeof(Elf64_Phdr))
       return ERROR_BOOTROM_ELF;
+  } else if (ident[EI_CLASS] == ELFCLASS32 && file->size >= sizeof(ehdr32)) {
+    memcpy(&ehdr32, file->data, sizeof(ehdr32));
+    elf->nbits = 32;
+    elf->entry = ehdr32.e_entry;
+    elf->phnum = ehdr32.e_phnum;
+    elf->phentsize = ehdr32.e_phentsize;
+    phoff = ehdr32.e_phoff;
+
+    if (elf->phentsize < sizeof(Elf32_Phdr))
+      return ERROR_BOOTROM_ELF;
+  } else {
+    return ERROR_BOOTROM_ELF;
+  }
 
-    if (!elf_is_loadable_section(&elf_shdr))
+  /* More than PN_XNUM program headers make no sense for a boot image */
+  if (elf->phnum == PN_XNUM || phoff > file->size ||
+      (uint64_t) elf->phnum * elf->phentsize > file->size - phoff)
+    return ERROR_BOOTROM_ELF;
+  elf->phdrs = file->data + phoff;
+
+  for (i = 0; i < elf->phnum; i++) {
+    if (!elf_get_segment(elf, i, &seg))
       continue;
 
-    if (*start_addr > elf_shdr.sh_addr)
-      *start_addr = elf_shdr.sh_addr;
+    if (seg.offset > file->size || seg.size > file->size - seg.offset ||
+        seg.size > UINT64_MAX - seg.addr || (found && seg.addr < end))
+      return ERROR_BOOTROM_ELF;
 
-    if (elf_shdr.sh_addr + elf_shdr.sh_size > *end_addr)
-      *end_addr = elf_shdr.sh_addr + elf_shdr.sh_size;
+    if (!found)
+      elf->start_addr = seg.addr;
+    end = seg.addr + seg.size;
+    found = true;
   }
 
+  /* There is nothing to load */
+  if (!found)
+    return ERROR_BOOTROM_ELF;
+  elf->end_addr = end;
+
   return SUCCESS;
 }
 
-static error elf_create_image(Elf *elf, uint32_t start_addr, uint8_t *out_buf) {
-  Elf_Scn *elf_scn = NULL;
-  Elf_Data *elf_data;
-  GElf_Shdr elf_shdr;
+/* Copy the segments loaded between start and end to out. The segments
+ * are copied in one go each, only the gaps between them are not in the
+ * file and have to be cleared. */
+static void elf_flatten(const elf_file_t *elf,
+                        const mapped_file_t *file,
+                        uint64_t start,
+                        uint64_t end,
+                        uint8_t *out) {
+  elf_segment_t seg;
+  uint64_t pos = 0;
+  uint32_t i;
 
-  while ((elf_scn = elf_nextscn(elf, elf_scn)) != NULL) {
-    if (gelf_getshdr(elf_scn, &elf_shdr) != &elf_shdr)
-      return ERROR_BOOTROM_ELF;
+  for (i = 0; i < elf->phnum; i++) {
+    if (!elf_get_segment(elf, i, &seg) || seg.addr < start || seg.addr >= end)
+      continue;
+
+    memset(out + pos, 0x0, seg.addr - start - pos);
+    pos = seg.addr - start;
+
+    memcpy(out + pos, file->data + seg.offset, seg.size);
+    pos += seg.size;
+  }
+}
+
+error elf_get_size(mapped_file_t *file, uint32_t *size) {
+  elf_file_t elf;
+  error err;
+
+  if ((err = elf_open(file, &elf)))
+    return err;
 
-    if (!elf_is_loadable_section(&elf_shdr))
+  if (elf.end_addr - elf.start_addr > UINT32_MAX)
+    return ERROR_BOOTROM_ELF;
+
+  *size = elf.end_addr - elf.start_addr;
+
+  return SUCCESS;
+}
+
+error elf_get_regions(mapped_file_t *file,
+                      uint32_t gap,
+                      elf_region_t *regions,
+                      uint32_t max_regions,
+                      uint32_t *regions_num) {
+  elf_segment_t seg;
+  elf_file_t elf;
+  uint64_t load = 0, end = 0;
+  uint32_t i, n = 0;
+  error err;
+
+  if ((err = elf_open(file, &elf)))
+    return err;
+
+  for (i = 0; i < elf.phnum; i++) {
+    if (!elf_get_segment(&elf, i, &seg))
       continue;
 
-    elf_data = NULL;
+    /* Start a new region if the segment is too far from the last one */
+    if (!n || seg.addr - end > gap) {
+      load = seg.addr;
+      n++;
+    }
+    end = seg.addr + seg.size;
 
-    while ((elf_data = elf_rawdata(elf_scn, elf_data)) != NULL) {
-      if (!elf_data->d_buf)
-        return ERROR_BOOTROM_ELF;
+    if (end - load > UINT32_MAX)
+      return ERROR_BOOTROM_ELF;
 
-      memcpy(out_buf + elf_shdr.sh_addr + elf_data->d_off - start_addr,
-             elf_data->d_buf,
-             elf_data->d_size);
+    if (n <= max_regions) {
+      regions[n - 1].load = load;
+      regions[n - 1].size = end - load;
     }
   }
 
+  *regions_num = n;
+
   return SUCCESS;
 }
 
 error elf_append(void *addr,
-                 const char *fname,
+                 mapped_file_t *file,
                  uint32_t img_max_size,
                  uint32_t *img_size,
                  uint8_t *elf_nbits,
-                 uint32_t *elf_load,
-                 uint32_t *elf_entry) {
+                 uint64_t *elf_load,
+                 uint64_t *elf_entry) {
+  elf_file_t elf;
   error err;
-  int fd_elf;
-  Elf *elf;
-  GElf_Ehdr elf_ehdr;
-  uint32_t start_addr;
-  uint32_t end_addr;
-
-  /* Init elf library */
-  if (elf_version(EV_CURRENT) == EV_NONE)
-    return ERROR_BOOTROM_ELF;
 
-  /* Open file descriptor used by elf library */
-  if ((fd_elf = open(fname, O_RDONLY, 0)) < 0)
-    return ERROR_BOOTROM_ELF;
+  if ((err = elf_open(file, &elf)))
+    return err;
 
-  /* Init elf */
-  if ((elf = elf_begin(fd_elf, ELF_C_READ, NULL)) == NULL) {
-    close(fd_elf);
+  if (elf.end_addr - elf.start_addr > img_max_size)
     return ERROR_BOOTROM_ELF;
-  }
 
-  /* Make sure it is an elf (despite magic byte check) */
-  if (elf_kind(elf) != ELF_K_ELF) {
-    elf_end(elf);
-    close(fd_elf);
-    return ERROR_BOOTROM_ELF;
-  }
+  elf_flatten(&elf, file, elf.start_addr, elf.end_addr, addr);
 
-  if ((err = elf_get_startaddr_endaddr(elf, &start_addr, &end_addr))) {
-    elf_end(elf);
-    close(fd_elf);
-    return err;
-  }
+  *elf_load = elf.start_addr;
+  *elf_entry = elf.entry;
+  *elf_nbits = elf.nbits;
+  *img_size = elf.end_addr - elf.start_addr;
 
-  if (end_addr - start_addr > img_max_size) {
-    elf_end(elf);
-    close(fd_elf);
-    return ERROR_BOOTROM_ELF;
-  }
+  return SUCCESS;
+}
 
-  memset(addr, 0, end_addr - start_addr);
+error elf_append_region(void *addr,
+                        mapped_file_t *file,
+                        const elf_region_t *region,
+                        uint32_t *img_size,
+                        uint8_t *elf_nbits,
+                        uint64_t *elf_entry) {
+  elf_file_t elf;
+  error err;
 
-  if ((err = elf_create_image(elf, start_addr, addr))) {
-    elf_end(elf);
-    close(fd_elf);
+  if ((err = elf_open(file, &elf)))
     return err;
-  }
-
-  if (gelf_getehdr(elf, &elf_ehdr) != &elf_ehdr) {
-    elf_end(elf);
-    close(fd_elf);
-    return ERROR_BOOTROM_ELF;
-  }
 
-  *elf_load = start_addr;
-  *elf_entry = elf_ehdr.e_entry;
-  *elf_nbits = (elf_ehdr.e_ident[EI_CLASS] == ELFCLASS64) ? 64 : 32;
-  *img_size = end_addr - start_addr;
+  elf_flatten(&elf, file, region->load, region->load + region->size, addr);
 
-  elf_end(elf);
-  close(fd_elf);
+  *elf_entry = elf.entry;
+  *elf_nbits = elf.nbits;
+  *img_size = region->size;
 
   return SUCCESS;
 }
@@ -1,14 +1,41 @@
 #ifndef ELF_H
 #define ELF_H
 
+/* Loadable data of an ELF file put in a single partition */
+typedef struct elf_region_t {
+  uint64_t load; /* address of the first byte */
+  uint32_t size; /* bytes up to the end of the last segment in it */
+} elf_region_t;
+
+/* Returns the size of the flattened ELF image via the last argument.
+ * The regular return value is the error code. */
+error elf_get_size(mapped_file_t *file, uint32_t *size);
+
+/* Splits the loadable data of the file where it is more than gap bytes
+ * apart. Up to max_regions of them are stored in regions, the number of
+ * regions found is returned via the last argument. */
+error elf_get_regions(mapped_file_t *file,
+                      uint32_t gap,
+                      elf_region_t *regions,
+                      uint32_t max_regions,
+                      uint32_t *regions_num);
+
 /* Returns the appended file size and the elf header info via arguments.
  * The regular return value is the error code. */
 error elf_append(void *addr,
-                 const char *fname,
+                 mapped_file_t *file,
                  uint32_t img_max_size,
                  uint32_t *img_size,
                  uint8_t *elf_nbits,
-                 uint32_t *elf_load,
-                 uint32_t *elf_entry);
+                 uint64_t *elf_load,
+                 uint64_t *elf_entry);
+
+/* Same as above for a single region found by elf_get_regions */
+error elf_append_region(void *addr,
+                        mapped_file_t *file,
+                        const elf_region_t *region,
+                        uint32_t *img_size,
+                        uint8_t *elf_nbits,
+                        uint64_t *elf_entry);
 
 #endif
@@ -0,0 +1,326 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arch/zynq.h>
+#include <arch/zynqmp.h>
+#include <bif.h>
+#include <bootrom.h>
+#include <cache.h>
+#include <common.h>
+#include <libmkbootimage.h>
+
+/* Pieces the image is passed to the write callback in */
+#define MKBOOTIMAGE_WRITE_CHUNK (1 << 20)
+
+/* A payload given by the caller instead of a file */
+typedef struct mkbootimage_input_t {
+  char *fname;
+  mapped_file_t file;
+} mkbootimage_input_t;
+
+struct mkbootimage_t {
+  bif_cfg_t cfg;
+  bootrom_ops_t *bops;
+  unsigned int jobs;
+  char *cache_dir;
+  error_sink_t sink;
+
+  mkbootimage_input_t *inputs;
+  uint32_t inputs_num;
+  uint32_t inputs_avail;
+};
+
+/* Every call reports its errors to the sink of the builder, the sink
+ * of the calling thread is restored when it returns */
+static inline error_sink_t enter(mkbootimage_t *mkbi) {
+  return set_error_sink(mkbi->sink);
+}
+
+static inline error leave(error_sink_t prev, error err) {
+  set_error_sink(prev);
+  return err;
+}
+
+mkbootimage_t *mkbootimage_create(bool zynqmp) {
+  mkbootimage_t *mkbi;
+
+  if (!(mkbi = calloc(1, sizeof(*mkbi))))
+    return NULL;
+
+  if (init_bif_cfg(&mkbi->cfg)) {
+    free(mkbi);
+    return NULL;
+  }
+
+  mkbi->cfg.arch = zynqmp ? BIF_ARCH_ZYNQMP : BIF_ARCH_ZYNQ;
+  mkbi->bops = zynqmp ? &zynqmp_bops : &zynq_bops;
+  mkbi->jobs = 1;
+
+  return mkbi;
+}
+
+void mkbootimage_destroy(mkbootimage_t *mkbi) {
+  uint32_t i;
+
+  if (!mkbi)
+    return;
+
+  for (i = 0; i < mkbi->inputs_num; i++) {
+    unmap_file(&mkbi->inputs[i].file);
+    free(mkbi->inputs[i].fname);
+  }
+
+  free(mkbi->inputs);
+  free(mkbi->cache_dir);
+  deinit_bif_cfg(&mkbi->cfg);
+  free(mkbi);
+}
+
+void mkbootimage_set_error_fn(mkbootimage_t *mkbi, mkbootimage_error_fn fn, void *arg) {
+  mkbi->sink.fn = fn;
+  mkbi->sink.arg = arg;
+}
+
+void mkbootimage_set_jobs(mkbootimage_t *mkbi, unsigned int jobs) {
+  mkbi->jobs = jobs ? jobs : 1;
+}
+
+error mkbootimage_set_cache_dir(mkbootimage_t *mkbi, const char *dir) {
+  error_sink_t prev = enter(mkbi);
+  char *copy;
+  error err;
+
+  if ((err = cache_init_dir(dir)))
+    return leave(prev, err);
+
+  if (!(copy = strdup(dir))) {
+    errorf("out of memory\n");
+    return leave(prev, ERROR_NOMEM);
+  }
+
+  free(mkbi->cache_dir);
+  mkbi->cache_dir = copy;
+
+  return leave(prev, SUCCESS);
+}
+
+static error add_node(mkbootimage_t *mkbi, const bif_node_t *node) {
+  bif_node_t copy = *node;
+
+  if (node->fname &&
+      !(copy.fname = bif_cfg_add_string(&mkbi->cfg, node->fname, strlen(node->fname)))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+
+  return bif_cfg_add_node(&mkbi->cfg, &copy);
+}
+
+/* The BIF is parsed on its own, so that sorting its nodes doesn't
+ * move the ones added before */
+static error add_bif(mkbootimage_t *mkbi, const char *fname, const char *text, size_t len) {
+  bif_cfg_t cfg;
+  uint32_t i;
+  error err;
+
+  if ((err = init_bif_cfg(&cfg))) {
+    errorf("out of memory\n");
+    return err;
+  }
+  cfg.arch = mkbi->cfg.arch;
+
+  if (fname)
+    err = bif_parse(fname, &cfg);
+  else
+    err = bif_parse_text("<bif>", text, len, &cfg);
+
+  for (i = 0; i < cfg.nodes_num && !err; i++)
+    err = add_node(mkbi, &cfg.nodes[i]);
+
+  deinit_bif_cfg(&cfg);
+
+  return err;
+}
+
+error mkbootimage_parse_bif(mkbootimage_t *mkbi, const char *text, size_t len) {
+  error_sink_t prev = enter(mkbi);
+
+  return leave(prev, add_bif(mkbi, NULL, text, len));
+}
+
+error mkbootimage_parse_bif_file(mkbootimage_t *mkbi, const char *fname) {
+  error_sink_t prev = enter(mkbi);
+
+  return leave(prev, add_bif(mkbi, fname, NULL, 0));
+}
+
+error mkbootimage_add_node(mkbootimage_t *mkbi, const bif_node_t *node) {
+  error_sink_t prev = enter(mkbi);
+
+  return leave(prev, add_node(mkbi, node));
+}
+
+/* Reserve the next input entry, it's counted once it gets a payload */
+static mkbootimage_input_t *new_input(mkbootimage_t *mkbi, const char *fname) {
+  mkbootimage_input_t *inputs, *input;
+  uint32_t avail;
+
+  if (mkbi->inputs_num == mkbi->inputs_avail) {
+    avail = mkbi->inputs_avail ? 2 * mkbi->inputs_avail : 8;
+    if (!(inputs = realloc(mkbi->inputs, avail * sizeof(*inputs)))) {
+      errorf("out of memory\n");
+      return NULL;
+    }
+    mkbi->inputs = inputs;
+    mkbi->inputs_avail = avail;
+  }
+
+  input = &mkbi->inputs[mkbi->inputs_num];
+  memset(input, 0x0, sizeof(*input));
+
+  if (!(input->fname = strdup(fname))) {
+    errorf("out of memory\n");
+    return NULL;
+  }
+
+  return input;
+}
+
+error mkbootimage_add_buffer(mkbootimage_t *mkbi, const char *fname, const void *data, size_t len) {
+  error_sink_t prev = enter(mkbi);
+  mkbootimage_input_t *input;
+
+  if (!(input = new_input(mkbi, fname)))
+    return leave(prev, ERROR_NOMEM);
+
+  input->file.data = data;
+  input->file.size = len;
+  input->file.kind = MAPPED_FILE_BORROWED;
+  mkbi->inputs_num++;
+
+  return leave(prev, SUCCESS);
+}
+
+error mkbootimage_add_fd(mkbootimage_t *mkbi, const char *fname, int fd) {
+  error_sink_t prev = enter(mkbi);
+  mkbootimage_input_t *input;
+  error err;
+
+  if (!(input = new_input(mkbi, fname)))
+    return leave(prev, ERROR_NOMEM);
+
+  if ((err = map_fd(fd, fname, &input->file))) {
+    free(input->fname);
+    return leave(prev, err);
+  }
+  mkbi->inputs_num++;
+
+  return leave(prev, SUCCESS);
+}
+
+/* bootrom_input_fn handing out the payloads added by the caller, the
+ * layout only borrows them as they belong to the builder. The last one
+ * added under a name wins. */
+static bool find_input(void *arg, const bif_node_t *node, mapped_file_t *file) {
+  mkbootimage_t *mkbi = arg;
+  uint32_t i;
+
+  for (i = mkbi->inputs_num; i-- > 0;) {
+    if (!strcmp(mkbi->inputs[i].fname, node->fname)) {
+      *file = mkbi->inputs[i].file;
+      file->kind = MAPPED_FILE_BORROWED;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static error plan(mkbootimage_t *mkbi, bootrom_layout_t *layout) {
+  if (mkbi->cfg.nodes_num == 0) {
+    errorf("no files to put in the image\n");
+    return ERROR_BOOTROM_NOFILE;
+  }
+
+  return plan_boot_image_from(&mkbi->cfg, mkbi->bops, find_input, mkbi, layout);
+}
+
+/* Build a planned image in a buffer of layout->mem_size bytes */
+static error build(mkbootimage_t *mkbi, bootrom_layout_t *layout, uint32_t *img, size_t *len) {
+  cache_t cache = {.dir = mkbi->cache_dir};
+  uint32_t words;
+  error err;
+
+  err = create_boot_image(img, &mkbi->cfg, mkbi->bops, layout, mkbi->jobs, &cache, &words);
+  if (!err)
+    *len = words * sizeof(uint32_t);
+
+  return err;
+}
+
+error mkbootimage_build(mkbootimage_t *mkbi, void *buf, size_t buf_len, size_t *img_len) {
+  error_sink_t prev = enter(mkbi);
+  bootrom_layout_t layout;
+  uint32_t *img = buf, *scratch = NULL;
+  error err;
+
+  if ((err = plan(mkbi, &layout)))
+    return leave(prev, err);
+
+  if (buf_len < layout.img_size) {
+    *img_len = layout.img_size;
+    release_boot_image_layout(&layout);
+    return leave(prev, ERROR_BOOTROM_NOMEM);
+  }
+
+  /* The padding after the last partition is written as well, so the
+   * image goes through a buffer of our own if there's no room for it */
+  if (buf_len < layout.mem_size || (uintptr_t) buf % sizeof(uint32_t)) {
+    if (!(img = scratch = malloc(layout.mem_size))) {
+      errorf("out of memory\n");
+      release_boot_image_layout(&layout);
+      return leave(prev, ERROR_NOMEM);
+    }
+  }
+
+  err = build(mkbi, &layout, img, img_len);
+  if (!err && scratch)
+    memcpy(buf, scratch, *img_len);
+
+  free(scratch);
+  release_boot_image_layout(&layout);
+
+  return leave(prev, err);
+}
+
+error mkbootimage_build_to(mkbootimage_t *mkbi, mkbootimage_write_fn write, void *arg) {
+  error_sink_t prev = enter(mkbi);
+  bootrom_layout_t layout;
+  uint8_t *img;
+  size_t len, off, n;
+  error err;
+
+  if ((err = plan(mkbi, &layout)))
+    return leave(prev, err);
+
+  if (!(img = malloc(layout.mem_size))) {
+    errorf("out of memory\n");
+    release_boot_image_layout(&layout);
+    return leave(prev, ERROR_NOMEM);
+  }
+
+  err = build(mkbi, &layout, (uint32_t *) img, &len);
+  release_boot_image_layout(&layout);
+
+  for (off = 0; !err && off < len; off += n) {
+    n = len - off < MKBOOTIMAGE_WRITE_CHUNK ? len - off : MKBOOTIMAGE_WRITE_CHUNK;
+    err = write(arg, img + off, n);
+  }
+
+  free(img);
+
+  return leave(prev, err);
+}
@@ -0,0 +1,65 @@
+#ifndef LIBMKBOOTIMAGE_H
+#define LIBMKBOOTIMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bif.h>
+#include <common.h>
+
+/* Boot image builder usable from other programs. Everything a build
+ * needs is kept in the builder, so any number of them can be used at
+ * once from different threads, one builder by one thread at a time.
+ *
+ * The image is described by a BIF and/or nodes added one by one. The
+ * payload of a node is looked up among the buffers and descriptors
+ * added under its file name, and read from the file otherwise. */
+typedef struct mkbootimage_t mkbootimage_t;
+
+/* Gets the error messages, without the "error: " prefix and the newline */
+typedef void (*mkbootimage_error_fn)(void *arg, const char *msg);
+
+/* Gets the consecutive pieces of the image, a non-zero return stops the
+ * build and is returned by it */
+typedef error (*mkbootimage_write_fn)(void *arg, const void *data, size_t len);
+
+mkbootimage_t *mkbootimage_create(bool zynqmp);
+void mkbootimage_destroy(mkbootimage_t *mkbi);
+
+/* The messages go to stderr until a callback is set, NULL restores that */
+void mkbootimage_set_error_fn(mkbootimage_t *mkbi, mkbootimage_error_fn fn, void *arg);
+
+/* Load up to jobs partitions at once, 1 by default */
+void mkbootimage_set_jobs(mkbootimage_t *mkbi, unsigned int jobs);
+
+/* Reuse processed payloads stored in dir, it is created if missing */
+error mkbootimage_set_cache_dir(mkbootimage_t *mkbi, const char *dir);
+
+/* Add the nodes of a BIF given as text or as a file */
+error mkbootimage_parse_bif(mkbootimage_t *mkbi, const char *text, size_t len);
+error mkbootimage_parse_bif_file(mkbootimage_t *mkbi, const char *fname);
+
+/* Add a node after the ones already there, nodes added this way are
+ * put in the image in the order they are added. The file name is
+ * copied and is_file has to be set for nodes with a payload. ELF files
+ * are only split if split_gap is set, see BIF_SPLIT_GAP_DEFAULT. */
+error mkbootimage_add_node(mkbootimage_t *mkbi, const bif_node_t *node);
+
+/* Use data as the payload of the nodes naming fname, the buffer has to
+ * stay untouched until the builder is destroyed */
+error mkbootimage_add_buffer(mkbootimage_t *mkbi, const char *fname, const void *data, size_t len);
+
+/* Same with the contents of a descriptor, which is mapped (or read if
+ * it's not a regular file) right away and can be closed afterwards */
+error mkbootimage_add_fd(mkbootimage_t *mkbi, const char *fname, int fd);
+
+/* Build the image into buf. The image size is stored in *img_len, if
+ * buf is too small ERROR_BOOTROM_NOMEM is returned instead and *img_len
+ * is the size needed. */
+error mkbootimage_build(mkbootimage_t *mkbi, void *buf, size_t buf_len, size_t *img_len);
+
+/* Build the image and pass it to write */
+error mkbootimage_build_to(mkbootimage_t *mkbi, mkbootimage_write_fn write, void *arg);
+
+#endif
@@ -34,16 +34,37 @@
 #include <argp.h>
 #include <bif.h>
 #include <bootrom.h>
+#include <cache.h>
 #include <common.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <serve.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* Prepare global variables for arg parser */
 const char *argp_program_version = MKBOOTIMAGE_VER;
 static char doc[] = "Generate bootloader images for Xilinx Zynq based platforms.";
-static char args_doc[] = "[--parse-only|-p] [--zynqmp|-u] <input_bif_file> <output_bin_file>";
+static char args_doc[] =
+  "[--parse-only|-p] [--zynqmp|-u] [--jobs|-j N] [--cache-dir|-c DIR] <input_bif_file> "
+  "<output_bin_file>\n"
+  "[--zynqmp|-u] [--cache-dir|-c DIR] --patch|-P <bin_file> --replace|-r NAME=FILE...\n"
+  "[--zynqmp|-u] [--jobs|-j N] [--cache-dir|-c DIR] --batch|-b <manifest_file>\n"
+  "[--cache-dir|-c DIR] [--cache-size|-m MB] --serve|-S <socket>\n"
+  "[--zynqmp|-u] [--jobs|-j N] --connect|-C <socket> <input_bif_file> <output_bin_file>";
 
 static struct argp_option argp_options[] = {
   {"zynqmp", 'u', 0, 0, "Generate files for ZyqnMP (default is Zynq)", 0},
   {"parse-only", 'p', 0, 0, "Analyze BIF grammar, but don't generate any files", 0},
+  {"jobs", 'j', "N", 0, "Load up to N partitions in parallel (default is 1)", 0},
+  {"cache-dir", 'c', "DIR", 0, "Reuse processed ELF and bitstream payloads stored in DIR", 0},
+  {"patch", 'P', "BIN", 0, "Replace partitions of an existing image in place", 0},
+  {"replace", 'r', "NAME=FILE", 0, "Partition NAME to be replaced with FILE (with --patch)", 0},
+  {"batch", 'b', "MANIFEST", 0, "Build all the images listed in MANIFEST", 0},
+  {"serve", 'S', "SOCKET", 0, "Keep building the images requested over SOCKET", 0},
+  {"cache-size", 'm', "MB", 0, "Memory for processed payloads (with --serve, default 256)", 0},
+  {"connect", 'C', "SOCKET", 0, "Have the daemon serving on SOCKET build the image", 0},
   {0},
 };
 
@@ -51,6 +72,15 @@ static struct argp_option argp_options[] = {
 struct arguments {
   bool zynqmp;
   bool parse_only;
+  unsigned int jobs;
+  char *cache_dir;
+  char *patch_filename;
+  int replace_count;
+  char **replace_names; /* the file follows the name after a NUL */
+  char *batch_filename;
+  char *serve_socket;
+  char *connect_socket;
+  unsigned int cache_size;
   char *bif_filename;
   char *bin_filename;
 };
@@ -58,6 +88,8 @@ struct arguments {
 /* Define argument parser */
 static error_t argp_parser(int key, char *arg, struct argp_state *state) {
   struct arguments *arguments = state->input;
+  char *end, *s;
+  long n;
 
   switch (key) {
   case 'u':
@@ -66,6 +98,45 @@ static error_t argp_parser(int key, char *arg, struct argp_state *state) {
   case 'p':
     arguments->parse_only = true;
     break;
+  case 'j':
+    n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > 1024)
+      argp_error(state, "invalid number of jobs: %s", arg);
+    arguments->jobs = n;
+    break;
+  case 'c':
+    arguments->cache_dir = arg;
+    break;
+  case 'P':
+    arguments->patch_filename = arg;
+    break;
+  case 'b':
+    arguments->batch_filename = arg;
+    break;
+  case 'S':
+    arguments->serve_socket = arg;
+    break;
+  case 'C':
+    arguments->connect_socket = arg;
+    break;
+  case 'm':
+    n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > 1 << 20)
+      argp_error(state, "invalid cache size: %s", arg);
+    arguments->cache_size = n;
+    break;
+  case 'r':
+    if (!(s = strchr(arg, '=')) || s == arg || !s[1])
+      argp_error(state, "invalid replacement, expected NAME=FILE: %s", arg);
+    *s = '\0';
+
+    if (!arguments->replace_names) {
+      arguments->replace_names = calloc(state->argc, sizeof(char *));
+      if (!arguments->replace_names)
+        return EXIT_FAILURE;
+    }
+    arguments->replace_names[arguments->replace_count++] = arg;
+    break;
   case ARGP_KEY_ARG:
     switch (state->arg_num) {
     case 0:
@@ -79,7 +150,25 @@ static error_t argp_parser(int key, char *arg, struct argp_state *state) {
     }
     break;
   case ARGP_KEY_END:
-    if (state->arg_num < 1)
+    if (arguments->cache_size && !arguments->serve_socket)
+      argp_usage(state);
+
+    if (arguments->serve_socket) {
+      if (arguments->patch_filename || arguments->replace_count || arguments->parse_only ||
+          arguments->batch_filename || arguments->connect_socket || state->arg_num > 0)
+        argp_usage(state);
+    } else if (arguments->connect_socket) {
+      if (arguments->patch_filename || arguments->replace_count || arguments->parse_only ||
+          arguments->batch_filename || arguments->cache_dir || state->arg_num < 2)
+        argp_usage(state);
+    } else if (arguments->batch_filename) {
+      if (arguments->patch_filename || arguments->replace_count || arguments->parse_only ||
+          state->arg_num > 0)
+        argp_usage(state);
+    } else if (arguments->patch_filename || arguments->replace_count) {
+      if (!arguments->patch_filename || !arguments->replace_count || state->arg_num > 0)
+        argp_usage(state);
+    } else if (state->arg_num < 1)
       argp_usage(state);
     else if (state->arg_num < 2 && !arguments->parse_only)
       argp_usage(state);
@@ -93,24 +182,753 @@ static error_t argp_parser(int key, char *arg, struct argp_state *state) {
 /* Finally initialize argp struct */
 static struct argp argp = {argp_options, argp_parser, args_doc, doc, 0, 0, 0};
 
+/* The output image, mapped straight from the output file if possible */
+typedef struct output_image_t {
+  const char *fname;
+  char *target;   /* the file replaced by the image, fname with links resolved */
+  char *tmp_name; /* the image is built here, NULL if it goes to target directly */
+  int fd;
+  uint32_t *data;
+  size_t size;
+  bool mapped;
+} output_image_t;
+
+/* Permissions removed from new output files, umask can't be read
+ * without changing it, so it's done once before starting any threads */
+static mode_t output_umask;
+
+/* Create a temporary file next to the target, it takes the place of the
+ * target once the image is complete, so a failed build leaves the
+ * previous image untouched */
+static error create_temp_output(output_image_t *out, const struct stat *st) {
+  size_t len = strlen(out->target);
+  mode_t mode = st ? st->st_mode & 07777 : 0666 & ~output_umask;
+
+  if (!(out->tmp_name = malloc(len + sizeof(".XXXXXX")))) {
+    errorf("out of memory\n");
+    return ERROR_NOMEM;
+  }
+  memcpy(out->tmp_name, out->target, len);
+  memcpy(out->tmp_name + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  if ((out->fd = mkstemp(out->tmp_name)) < 0) {
+    errorf("could not open output file: %s\n", out->fname);
+    return ERROR_CANT_WRITE;
+  }
+
+  if (fchmod(out->fd, mode)) {
+    errorf("could not open output file: %s\n", out->fname);
+    return ERROR_CANT_WRITE;
+  }
+
+  return SUCCESS;
+}
+
+/* Release everything but the image data */
+static void release_output_image(output_image_t *out, bool remove) {
+  if (out->fd >= 0)
+    close(out->fd);
+  if (remove && out->tmp_name)
+    unlink(out->tmp_name);
+  free(out->tmp_name);
+  free(out->target);
+}
+
+/* Open the output and reserve size bytes for the image in it. Regular
+ * files are replaced by a temporary file, which is extended and mapped,
+ * so the image gets built in the page cache directly. Anything else
+ * (devices, pipes) is written in place from a heap buffer, it is never
+ * truncated or removed. */
+static error open_output_image(output_image_t *out, const char *fname, size_t size) {
+  struct stat st;
+  bool exists;
+  void *data;
+  error err;
+
+  memset(out, 0x0, sizeof(*out));
+  out->fname = fname;
+  out->size = size;
+  out->fd = -1;
+
+  exists = !stat(fname, &st);
+  if (exists && !S_ISREG(st.st_mode)) {
+    if ((out->fd = open(fname, O_WRONLY)) < 0) {
+      errorf("could not open output file: %s\n", fname);
+      return ERROR_CANT_WRITE;
+    }
+  } else {
+    /* A link to an image is kept, the image it points at gets replaced */
+    if (!exists || !(out->target = realpath(fname, NULL)))
+      out->target = strdup(fname);
+
+    if (!out->target) {
+      errorf("out of memory\n");
+      err = ERROR_NOMEM;
+    } else {
+      err = create_temp_output(out, exists ? &st : NULL);
+    }
+
+    if (err) {
+      release_output_image(out, true);
+      return err;
+    }
+
+    if (!ftruncate(out->fd, size)) {
+      data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+      if (data != MAP_FAILED) {
+        out->data = data;
+        out->mapped = true;
+        return SUCCESS;
+      }
+    }
+  }
+
+  if (!(out->data = malloc(size))) {
+    errorf("out of memory\n");
+    release_output_image(out, true);
+    return ERROR_NOMEM;
+  }
+
+  return SUCCESS;
+}
+
+/* Trim the output file to the final image size and put it in place */
+static error close_output_image(output_image_t *out, size_t size) {
+  uint8_t *ptr = (uint8_t *) out->data;
+  ssize_t n;
+  error err = SUCCESS;
+
+  if (out->mapped) {
+    munmap(out->data, out->size);
+    if (ftruncate(out->fd, size))
+      err = ERROR_CANT_WRITE;
+  } else {
+    if (out->tmp_name && ftruncate(out->fd, size))
+      err = ERROR_CANT_WRITE;
+
+    while (!err && size > 0) {
+      if ((n = write(out->fd, ptr, size)) <= 0) {
+        err = ERROR_CANT_WRITE;
+        break;
+      }
+      ptr += n;
+      size -= n;
+    }
+    free(out->data);
+  }
+
+  if (close(out->fd))
+    err = ERROR_CANT_WRITE;
+  out->fd = -1;
+
+  if (!err && out->tmp_name && rename(out->tmp_name, out->target))
+    err = ERROR_CANT_WRITE;
+
+  if (err)
+    errorf("could not write output file: %s\n", out->fname);
+
+  release_output_image(out, err != SUCCESS);
+  return err;
+}
+
+/* Drop a partially generated output, the previous image stays in place */
+static void discard_output_image(output_image_t *out) {
+  if (out->mapped)
+    munmap(out->data, out->size);
+  else
+    free(out->data);
+
+  release_output_image(out, true);
+}
+
+/* Change the size of the patched image file and map it again */
+static error resize_patched_image(
+  const char *fname, int fd, uint32_t **data, size_t *size, size_t new_size) {
+  void *ptr;
+
+  if (*data)
+    munmap(*data, *size);
+  *data = NULL;
+
+  if (new_size != *size && ftruncate(fd, new_size)) {
+    errorf("could not write output file: %s\n", fname);
+    return ERROR_CANT_WRITE;
+  }
+  *size = new_size;
+
+  ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    errorf("could not map file: %s\n", fname);
+    return ERROR_CANT_READ;
+  }
+
+  *data = ptr;
+  return SUCCESS;
+}
+
+/* The words of an image a patch may overwrite, kept to undo it */
+typedef struct patch_undo_t {
+  uint32_t *slot; /* the data of the partition up to the next one */
+  bootrom_partition_hdr_t part_hdr;
+} patch_undo_t;
+
+/* Apply all the requested replacements to an existing image, the image
+ * is mapped so only the pages of the changed partitions get written.
+ * All of them are planned before anything is written, and the image is
+ * put back as it was if applying one of them fails. */
+static error patch_image_file(const char *fname,
+                              bootrom_ops_t *bops,
+                              const cache_t *cache,
+                              struct arguments *arguments) {
+  bootrom_patch_t *patches;
+  patch_undo_t *undo = NULL;
+  bootrom_hdr_t main_hdr;
+  struct stat st;
+  uint32_t *data = NULL;
+  size_t size = 0, orig_size, mem_size, img_size;
+  char *file;
+  error err;
+  int fd, i, planned = 0, applied = 0;
+
+  if ((fd = open(fname, O_RDWR)) < 0) {
+    errorf("could not open file: %s\n", fname);
+    return ERROR_CANT_WRITE;
+  }
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(bootrom_hdr_t) ||
+      st.st_size > UINT32_MAX) {
+    errorf("not a boot image: %s\n", fname);
+    close(fd);
+    return ERROR_CANT_READ;
+  }
+
+  if (!(patches = calloc(arguments->replace_count, sizeof(*patches))) ||
+      !(undo = calloc(arguments->replace_count, sizeof(*undo)))) {
+    errorf("out of memory\n");
+    free(patches);
+    close(fd);
+    return ERROR_NOMEM;
+  }
+
+  orig_size = size = st.st_size;
+  err = resize_patched_image(fname, fd, &data, &size, size);
+
+  for (; planned < arguments->replace_count && !err; planned++) {
+    file = arguments->replace_names[planned] + strlen(arguments->replace_names[planned]) + 1;
+    printf("Replacing %s with %s\n", arguments->replace_names[planned], file);
+
+    err = plan_boot_image_patch(data,
+                                size / sizeof(uint32_t),
+                                bops,
+                                arguments->replace_names[planned],
+                                file,
+                                &patches[planned]);
+    if (err)
+      break;
+  }
+
+  /* Only the last partition can change the image size, if it's replaced
+   * more than once the last replacement counts */
+  mem_size = img_size = orig_size;
+  for (i = 0; i < planned && !err; i++) {
+    if (patches[i].mem_len * sizeof(uint32_t) > mem_size)
+      mem_size = patches[i].mem_len * sizeof(uint32_t);
+    if (patches[i].img_len * sizeof(uint32_t) != orig_size)
+      img_size = patches[i].img_len * sizeof(uint32_t);
+  }
+
+  /* Keep everything the patches may overwrite */
+  if (!err)
+    memcpy(&main_hdr, data, sizeof(main_hdr));
+  for (i = 0; i < planned && !err; i++) {
+    if (!(undo[i].slot = malloc((patches[i].slot_end - patches[i].data_off) * sizeof(uint32_t)))) {
+      errorf("out of memory\n");
+      err = ERROR_NOMEM;
+      break;
+    }
+    memcpy(undo[i].slot,
+           data + patches[i].data_off,
+           (patches[i].slot_end - patches[i].data_off) * sizeof(uint32_t));
+    memcpy(&undo[i].part_hdr, data + patches[i].hdr_off, sizeof(undo[i].part_hdr));
+  }
+
+  if (!err && mem_size > size)
+    err = resize_patched_image(fname, fd, &data, &size, mem_size);
+
+  for (; applied < planned && !err; applied++)
+    err = patch_boot_image(data, bops, &patches[applied], cache);
+
+  if (!err && img_size != size)
+    err = resize_patched_image(fname, fd, &data, &size, img_size);
+
+  /* Put back what was written before the failure, in reverse order as
+   * a partition may have been replaced more than once */
+  if (err && (applied > 0 || size != orig_size) &&
+      !resize_patched_image(fname, fd, &data, &size, orig_size)) {
+    for (i = applied - 1; i >= 0; i--) {
+      memcpy(data + patches[i].data_off,
+             undo[i].slot,
+             (patches[i].slot_end - patches[i].data_off) * sizeof(uint32_t));
+      memcpy(data + patches[i].hdr_off, &undo[i].part_hdr, sizeof(undo[i].part_hdr));
+    }
+    memcpy(data, &main_hdr, sizeof(main_hdr));
+  }
+
+  for (i = 0; i < planned; i++) {
+    release_boot_image_patch(&patches[i]);
+    free(undo[i].slot);
+  }
+  free(patches);
+  free(undo);
+
+  if (data)
+    munmap(data, size);
+  close(fd);
+
+  return err;
+}
+
+/* A single image of a batch build */
+typedef struct batch_image_t {
+  char *bif_filename;
+  char *bin_filename;
+  bool zynqmp;
+
+  bif_cfg_t cfg;
+  bootrom_layout_t layout;
+  output_image_t ofile;
+  bootrom_build_t build;
+
+  /* How far the image got, for the cleanup */
+  bool planned, opened, begun;
+  error err;
+} batch_image_t;
+
+/* A single partition of one of the images */
+typedef struct batch_task_t {
+  batch_image_t *img;
+  uint32_t idx;
+  error err;
+} batch_task_t;
+
+typedef struct batch_t {
+  batch_image_t *images;
+  uint32_t images_num;
+  batch_task_t *tasks;
+  uint32_t tasks_num;
+  cache_t cache;
+} batch_t;
+
+/* Read the manifest, every line describes a single image as
+ * "[-u|--zynqmp] <input_bif_file> <output_bin_file>", empty lines
+ * and everything after a '#' are skipped */
+static error read_batch_manifest(const char *fname, bool zynqmp, batch_t *batch) {
+  batch_image_t *img, *tmp;
+  uint32_t avail = 0, line_num = 0;
+  char *line = NULL, *save, *tok, *paths[2];
+  size_t line_cap = 0;
+  error err = SUCCESS;
+  FILE *f;
+  int n;
+
+  if (!(f = fopen(fname, "r"))) {
+    errorf("could not open file: %s\n", fname);
+    return ERROR_CANT_READ;
+  }
+
+  while (getline(&line, &line_cap, f) >= 0) {
+    line_num++;
+
+    if ((tok = strchr(line, '#')))
+      *tok = '\0';
+
+    if (batch->images_num == avail) {
+      avail = avail ? 2 * avail : 16;
+      if (!(tmp = realloc(batch->images, avail * sizeof(*tmp)))) {
+        errorf("out of memory\n");
+        err = ERROR_NOMEM;
+        break;
+      }
+      batch->images = tmp;
+    }
+
+    img = &batch->images[batch->images_num];
+    memset(img, 0x0, sizeof(*img));
+    img->zynqmp = zynqmp;
+
+    n = 0;
+    for (tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+      if (!strcmp(tok, "-u") || !strcmp(tok, "--zynqmp"))
+        img->zynqmp = true;
+      else if (n < 2)
+        paths[n++] = tok;
+      else
+        n = 3;
+    }
+
+    if (n == 0 && !img->zynqmp)
+      continue;
+
+    if (n != 2) {
+      errorf("%s:%u: expected [-u] <input_bif_file> <output_bin_file>\n", fname, line_num);
+      err = ERROR_BIF_PARSER;
+      break;
+    }
+
+    img->bif_filename = strdup(paths[0]);
+    img->bin_filename = strdup(paths[1]);
+    batch->images_num++;
+
+    if (!img->bif_filename || !img->bin_filename) {
+      errorf("out of memory\n");
+      err = ERROR_NOMEM;
+      break;
+    }
+  }
+
+  free(line);
+  fclose(f);
+
+  if (!err && batch->images_num == 0) {
+    errorf("no images listed in %s\n", fname);
+    err = ERROR_BIF_NOFILE;
+  }
+
+  return err;
+}
+
+/* run_parallel callback parsing and planning a single image */
+static error batch_plan_image(void *arg, uint32_t i) {
+  batch_image_t *img = &((batch_t *) arg)->images[i];
+  bootrom_ops_t *bops = img->zynqmp ? &zynqmp_bops : &zynq_bops;
+  error err;
+
+  init_bif_cfg(&img->cfg);
+  img->cfg.arch = img->zynqmp ? BIF_ARCH_ZYNQMP : BIF_ARCH_ZYNQ;
+
+  if ((err = bif_parse(img->bif_filename, &img->cfg)))
+    goto out;
+
+  if (img->cfg.nodes_num == 0) {
+    errorf("no files listed in %s\n", img->bif_filename);
+    err = ERROR_BOOTROM_NOFILE;
+    goto out;
+  }
+
+  if ((err = plan_boot_image(&img->cfg, bops, &img->layout)))
+    goto out;
+  img->planned = true;
+
+  if ((err = open_output_image(&img->ofile, img->bin_filename, img->layout.mem_size)))
+    goto out;
+  img->opened = true;
+
+out:
+  /* The batch goes on without the failed image */
+  img->err = err;
+  return SUCCESS;
+}
+
+/* run_parallel callback preparing the partition loads of an image */
+static error batch_begin_image(void *arg, uint32_t i) {
+  batch_t *batch = arg;
+  batch_image_t *img = &batch->images[i];
+  bootrom_ops_t *bops = img->zynqmp ? &zynqmp_bops : &zynq_bops;
+
+  if (img->err)
+    return SUCCESS;
+
+  img->err = begin_boot_image(
+    &img->build, img->ofile.data, &img->cfg, bops, &img->layout, &batch->cache);
+  img->begun = !img->err;
+
+  return SUCCESS;
+}
+
+/* run_parallel callback loading a partition of any of the images */
+static error batch_load_part(void *arg, uint32_t i) {
+  batch_task_t *task = &((batch_t *) arg)->tasks[i];
+
+  task->err = load_boot_image_part(&task->img->build, task->idx);
+  return SUCCESS;
+}
+
+/* run_parallel callback writing the headers of an image and closing it */
+static error batch_finish_image(void *arg, uint32_t i) {
+  batch_image_t *img = &((batch_t *) arg)->images[i];
+  uint32_t size;
+
+  if (!img->err) {
+    img->begun = false;
+    if (!(img->err = finish_boot_image(&img->build, &size))) {
+      img->opened = false;
+      img->err = close_output_image(&img->ofile, sizeof(uint32_t) * size);
+    }
+  }
+
+  if (img->begun)
+    cancel_boot_image(&img->build);
+  if (img->opened)
+    discard_output_image(&img->ofile);
+  if (img->planned)
+    release_boot_image_layout(&img->layout);
+  deinit_bif_cfg(&img->cfg);
+
+  return SUCCESS;
+}
+
+/* Build all the images of the manifest in a single process. The
+ * partitions of all the images are loaded by the same pool of threads
+ * and the inputs shared by several images are processed only once.
+ * A failed image doesn't stop the others, the error of the first
+ * failed one is returned. */
+static error build_batch(const char *fname, const char *cache_dir, struct arguments *arguments) {
+  batch_t batch;
+  batch_image_t *img;
+  uint32_t i, j, failed = 0;
+  error err;
+
+  memset(&batch, 0x0, sizeof(batch));
+  batch.cache.dir = cache_dir;
+
+  err = read_batch_manifest(fname, arguments->zynqmp, &batch);
+  if (!err && !(batch.cache.mem = cache_mem_create()))
+    err = ERROR_NOMEM;
+
+  if (err) {
+    for (i = 0; i < batch.images_num; i++) {
+      free(batch.images[i].bif_filename);
+      free(batch.images[i].bin_filename);
+    }
+    free(batch.images);
+    return err;
+  }
+
+  run_parallel(arguments->jobs, batch.images_num, batch_plan_image, &batch);
+
+  /* Every use of an input has to be known before any of them is loaded */
+  for (i = 0; i < batch.images_num; i++) {
+    img = &batch.images[i];
+    if (!img->err) {
+      img->err = share_boot_image_inputs(&img->layout, batch.cache.mem);
+      batch.tasks_num += img->layout.parts_num;
+    }
+  }
+
+  if (!(batch.tasks = calloc(batch.tasks_num + 1, sizeof(*batch.tasks)))) {
+    errorf("out of memory\n");
+    for (i = 0; i < batch.images_num; i++)
+      batch.images[i].err = ERROR_NOMEM;
+  }
+
+  run_parallel(arguments->jobs, batch.images_num, batch_begin_image, &batch);
+
+  /* A single list of the partitions of all the images for the pool */
+  batch.tasks_num = 0;
+  for (i = 0; i < batch.images_num; i++) {
+    img = &batch.images[i];
+    for (j = 0; !img->err && j < img->build.tasks_num; j++) {
+      batch.tasks[batch.tasks_num].img = img;
+      batch.tasks[batch.tasks_num++].idx = j;
+    }
+  }
+
+  run_parallel(arguments->jobs, batch.tasks_num, batch_load_part, &batch);
+
+  for (i = 0; i < batch.tasks_num; i++)
+    if (batch.tasks[i].err && !batch.tasks[i].img->err)
+      batch.tasks[i].img->err = batch.tasks[i].err;
+
+  run_parallel(arguments->jobs, batch.images_num, batch_finish_image, &batch);
+
+  for (i = 0; i < batch.images_num; i++) {
+    img = &batch.images[i];
+    printf("%s: %s\n", img->bin_filename, img->err ? "failed" : "done");
+
+    if (img->err && !failed++)
+      err = img->err;
+
+    free(img->bif_filename);
+    free(img->bin_filename);
+  }
+
+  if (failed)
+    printf("%u of %u images failed\n", failed, batch.images_num);
+
+  cache_mem_destroy(batch.cache.mem);
+  free(batch.tasks);
+  free(batch.images);
+
+  return err;
+}
+
+/* Lay out, load and write a single image described by cfg */
+static error build_image(bif_cfg_t *cfg,
+                         bootrom_ops_t *bops,
+                         const char *bin_filename,
+                         unsigned int jobs,
+                         const cache_t *cache) {
+  output_image_t ofile;
+  uint32_t ofile_size;
+  bootrom_layout_t layout;
+  error err;
+
+  /* Compute the exact image layout before touching any data */
+  err = plan_boot_image(cfg, bops, &layout);
+  if (err)
+    return err;
+
+  /* Reserve exactly the space the image will be built in */
+  err = open_output_image(&ofile, bin_filename, layout.mem_size);
+  if (err) {
+    release_boot_image_layout(&layout);
+    return err;
+  }
+
+  /* Generate bin file */
+  err = create_boot_image(ofile.data, cfg, bops, &layout, jobs, cache, &ofile_size);
+  release_boot_image_layout(&layout);
+  if (err) {
+    discard_output_image(&ofile);
+    return err;
+  }
+
+  return close_output_image(&ofile, sizeof(uint32_t) * ofile_size);
+}
+
+/* Build an image requested from the daemon, the file names in
+ * the BIF are relative to the working directory of the client */
+static error serve_build(const serve_request_t *req, const cache_t *cache) {
+  char path[PATH_MAX];
+  bootrom_ops_t *bops;
+  bif_cfg_t cfg;
+  uint32_t i;
+  error err;
+
+  init_bif_cfg(&cfg);
+  cfg.arch = req->zynqmp ? BIF_ARCH_ZYNQMP : BIF_ARCH_ZYNQ;
+  bops = req->zynqmp ? &zynqmp_bops : &zynq_bops;
+
+  if (req->bif_filename)
+    err = bif_parse(req->bif_filename, &cfg);
+  else
+    err = bif_parse_text("<request>", req->bif_text, req->bif_len, &cfg);
+
+  if (!err && cfg.nodes_num == 0)
+    err = ERROR_BOOTROM_NOFILE;
+
+  for (i = 0; i < cfg.nodes_num && !err; i++) {
+    if (!cfg.nodes[i].is_file || cfg.nodes[i].fname[0] == '/')
+      continue;
+
+    if (!serve_join_path(path, sizeof(path), req->cwd, cfg.nodes[i].fname)) {
+      errorf("file name too long: %s\n", cfg.nodes[i].fname);
+      err = ERROR_BOOTROM_NOFILE;
+    } else if (!(cfg.nodes[i].fname = bif_cfg_add_string(&cfg, path, strlen(path)))) {
+      err = ERROR_NOMEM;
+    }
+  }
+
+  if (!err)
+    err = build_image(&cfg, bops, req->bin_filename, req->jobs, cache);
+
+  deinit_bif_cfg(&cfg);
+
+  printf("%s: %s\n", req->bin_filename, err ? "failed" : "done");
+  fflush(stdout);
+
+  return err;
+}
+
+/* Read the whole BIF given on the standard input */
+static error read_stdin(char **text, size_t *len) {
+  size_t cap = 0, n;
+  char *tmp;
+
+  *text = NULL;
+  *len = 0;
+
+  do {
+    if (*len == cap) {
+      cap = cap ? 2 * cap : 4096;
+      if (!(tmp = realloc(*text, cap))) {
+        errorf("out of memory\n");
+        free(*text);
+        return ERROR_NOMEM;
+      }
+      *text = tmp;
+    }
+
+    n = fread(*text + *len, 1, cap - *len, stdin);
+    *len += n;
+  } while (n > 0);
+
+  if (ferror(stdin)) {
+    errorf("could not read the standard input\n");
+    free(*text);
+    return ERROR_BIF_NOFILE;
+  }
+
+  return SUCCESS;
+}
+
+/* Send the build to the daemon, "-" stands for a BIF on the standard input */
+static error connect_build(struct arguments *arguments) {
+  char cwd[PATH_MAX], bif[PATH_MAX], bin[PATH_MAX];
+  serve_request_t req;
+  error err;
+
+  memset(&req, 0x0, sizeof(req));
+  req.zynqmp = arguments->zynqmp;
+  req.jobs = arguments->jobs;
+  req.cwd = cwd;
+  req.bin_filename = bin;
+
+  if (!getcwd(cwd, sizeof(cwd))) {
+    errorf("could not get the working directory\n");
+    return ERROR_CANT_READ;
+  }
+
+  if (!serve_join_path(bin, sizeof(bin), cwd, arguments->bin_filename)) {
+    errorf("file name too long: %s\n", arguments->bin_filename);
+    return ERROR_CANT_WRITE;
+  }
+
+  if (strcmp(arguments->bif_filename, "-")) {
+    if (!serve_join_path(bif, sizeof(bif), cwd, arguments->bif_filename)) {
+      errorf("file name too long: %s\n", arguments->bif_filename);
+      return ERROR_BIF_NOFILE;
+    }
+    req.bif_filename = bif;
+  } else if ((err = read_stdin(&req.bif_text, &req.bif_len))) {
+    return err;
+  }
+
+  err = serve_send_request(arguments->connect_socket, &req);
+  free(req.bif_text);
+
+  return err;
+}
+
 /* Declare the main function */
 int main(int argc, char *argv[]) {
-  FILE *ofile;
-  uint32_t ofile_size;
-  uint32_t *file_data;
-  uint32_t esize, esize_aligned;
   struct arguments arguments;
   bootrom_ops_t *bops;
   bif_cfg_t cfg;
+  cache_t cache;
   error err;
-  int i;
+  uint32_t i;
 
   /* Init non-string arguments */
   memset(&arguments, 0, sizeof(arguments));
+  arguments.jobs = 1;
 
   /* Parse program arguments */
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
+  output_umask = umask(0);
+  umask(output_umask);
+
   /* Print program version info */
   printf("%s\n", MKBOOTIMAGE_VER);
 
@@ -120,6 +938,51 @@ int main(int argc, char *argv[]) {
   cfg.arch = (arguments.zynqmp) ? BIF_ARCH_ZYNQMP : BIF_ARCH_ZYNQ;
   bops = (arguments.zynqmp) ? &zynqmp_bops : &zynq_bops;
 
+  if (arguments.cache_dir && (err = cache_init_dir(arguments.cache_dir)))
+    return err;
+
+  cache.dir = arguments.cache_dir;
+  cache.mem = NULL;
+  cache.lru = NULL;
+
+  if (arguments.serve_socket) {
+    cache.lru = cache_lru_create(
+      (size_t) (arguments.cache_size ? arguments.cache_size : 256) << 20);
+    if (!cache.lru)
+      return ERROR_NOMEM;
+
+    err = serve(arguments.serve_socket, &cache, serve_build);
+    cache_lru_destroy(cache.lru);
+    return err;
+  }
+
+  if (arguments.connect_socket) {
+    err = connect_build(&arguments);
+    if (err)
+      return err;
+
+    printf("All done, quitting\n");
+    return EXIT_SUCCESS;
+  }
+
+  if (arguments.batch_filename) {
+    err = build_batch(arguments.batch_filename, arguments.cache_dir, &arguments);
+    if (err)
+      return err;
+
+    printf("All done, quitting\n");
+    return EXIT_SUCCESS;
+  }
+
+  if (arguments.patch_filename) {
+    err = patch_image_file(arguments.patch_filename, bops, &cache, &arguments);
+    if (err)
+      return err;
+
+    printf("All done, quitting\n");
+    return EXIT_SUCCESS;
+  }
+
   err = bif_parse(arguments.bif_filename, &cfg);
   if (err)
     return err;
@@ -144,39 +1007,10 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
-  /* Estimate memory required to fit all the binaries */
-  esize = estimate_boot_image_size(&cfg);
-  if (!esize)
-    return ERROR_BOOTROM_NOFILE;
-
-  /* Align estimated size to powers of two */
-  esize_aligned = 2;
-  while (esize_aligned < esize)
-    esize_aligned *= 2;
-
-  /* Allocate memory for output image */
-  file_data = malloc(sizeof *file_data * esize_aligned);
-  if (!file_data) {
-    return ERROR_NOMEM;
-  }
-
-  /* Generate bin file */
-  err = create_boot_image(file_data, &cfg, bops, &ofile_size);
-  if (err) {
-    free(file_data);
+  err = build_image(&cfg, bops, arguments.bin_filename, arguments.jobs, &cache);
+  if (err)
     return err;
-  }
-
-  ofile = fopen(arguments.bin_filename, "wb");
-  if (ofile == NULL) {
-    errorf("could not open output file: %s\n", arguments.bin_filename);
-    return ERROR_CANT_WRITE;
-  }
-
-  fwrite(file_data, sizeof(uint32_t), ofile_size, ofile);
 
-  fclose(ofile);
-  free(file_data);
   deinit_bif_cfg(&cfg);
 
   printf("All done, quitting\n");
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE /* accept4 */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cache.h>
+#include <common.h>
+#include <pthread.h>
+#include <serve.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* The protocol is line based. The client sends a request like:
+ *
+ *   arch zynqmp
+ *   jobs 4
+ *   cwd /home/user/board
+ *   output /home/user/board/boot.bin
+ *   bif /home/user/board/boot.bif   (or "text LEN" followed by LEN bytes)
+ *   end
+ *
+ * and the daemon replies with the error messages of the build, each of
+ * them starting with "error: ", and "status N" where N is the exit code
+ * the build would have had as a separate mkbootimage run. */
+
+/* Limit for the BIF text sent along with a request */
+#define SERVE_MAX_BIF_LEN (16 << 20)
+
+/* Removed when the daemon gets killed */
+static const char *serve_socket_path;
+
+typedef struct serve_conn_t {
+  int fd;
+  const cache_t *cache;
+  serve_build_fn build;
+} serve_conn_t;
+
+bool serve_join_path(char *dst, size_t n, const char *dir, const char *path) {
+  if (path[0] == '/')
+    return snprintf(dst, n, "%s", path) < (int) n;
+
+  return snprintf(dst, n, "%s/%s", dir, path) < (int) n;
+}
+
+static bool serve_socket_addr(struct sockaddr_un *addr, const char *socket_path) {
+  memset(addr, 0x0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+    errorf("socket path too long: %s\n", socket_path);
+    return false;
+  }
+  strcpy(addr->sun_path, socket_path);
+
+  return true;
+}
+
+static bool set_string(char **dst, const char *val) {
+  free(*dst);
+  return (*dst = strdup(val)) != NULL;
+}
+
+static void free_request(serve_request_t *req) {
+  free(req->cwd);
+  free(req->bin_filename);
+  free(req->bif_filename);
+  free(req->bif_text);
+}
+
+static error read_request(FILE *in, serve_request_t *req) {
+  char *line = NULL, *val, *end;
+  size_t cap = 0;
+  ssize_t n;
+  long num;
+  error err = ERROR_CANT_READ;
+
+  memset(req, 0x0, sizeof(*req));
+  req->jobs = 1;
+
+  while ((n = getline(&line, &cap, in)) > 0) {
+    if (line[n - 1] == '\n')
+      line[--n] = '\0';
+
+    if (!strcmp(line, "end")) {
+      err = SUCCESS;
+      break;
+    }
+
+    if (!(val = strchr(line, ' ')))
+      break;
+    *val++ = '\0';
+
+    if (!strcmp(line, "arch")) {
+      if (!strcmp(val, "zynqmp"))
+        req->zynqmp = true;
+      else if (strcmp(val, "zynq"))
+        break;
+    } else if (!strcmp(line, "jobs")) {
+      num = strtol(val, &end, 10);
+      if (*val == '\0' || *end != '\0' || num < 1 || num > 1024)
+        break;
+      req->jobs = num;
+    } else if (!strcmp(line, "cwd")) {
+      if (!set_string(&req->cwd, val))
+        break;
+    } else if (!strcmp(line, "output")) {
+      if (!set_string(&req->bin_filename, val))
+        break;
+    } else if (!strcmp(line, "bif")) {
+      if (!set_string(&req->bif_filename, val))
+        break;
+    } else if (!strcmp(line, "text")) {
+      num = strtol(val, &end, 10);
+      if (*val == '\0' || *end != '\0' || num < 0 || num > SERVE_MAX_BIF_LEN || req->bif_text)
+        break;
+      if (!(req->bif_text = malloc(num ? num : 1)))
+        break;
+      req->bif_len = num;
+      if (fread(req->bif_text, 1, num, in) != (size_t) num)
+        break;
+    } else {
+      break;
+    }
+  }
+
+  free(line);
+
+  /* Exactly one BIF has to be given */
+  if (!err && (!req->cwd || !req->bin_filename || !req->bif_filename == !req->bif_text))
+    err = ERROR_CANT_READ;
+
+  if (err)
+    errorf("malformed build request\n");
+
+  return err;
+}
+
+static void *serve_connection(void *arg) {
+  serve_conn_t *conn = arg;
+  serve_request_t req;
+  FILE *in, *out;
+  int fd;
+  error err;
+
+  in = fdopen(conn->fd, "r");
+  out = (fd = dup(conn->fd)) >= 0 ? fdopen(fd, "w") : NULL;
+
+  if (!in || !out) {
+    if (in)
+      fclose(in);
+    else
+      close(conn->fd);
+    if (out)
+      fclose(out);
+    else if (fd >= 0)
+      close(fd);
+    free(conn);
+    return NULL;
+  }
+
+  /* Everything reported while building goes to the client */
+  set_error_stream(out);
+
+  if (!(err = read_request(in, &req)))
+    err = conn->build(&req, conn->cache);
+
+  set_error_stream(NULL);
+  fprintf(out, "status %d\n", err);
+
+  fclose(out);
+  fclose(in);
+  free_request(&req);
+  free(conn);
+
+  return NULL;
+}
+
+static void serve_stop(int sig) {
+  (void) sig;
+
+  unlink(serve_socket_path);
+  _exit(EXIT_SUCCESS);
+}
+
+/* Only the user running the daemon may build with it, the socket file
+ * is created accessible to the owner alone and the peers are checked
+ * too, as not every system honours the permissions of socket files */
+static bool serve_peer_allowed(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred))
+    return false;
+
+  return cred.uid == geteuid();
+}
+
+/* Bind the socket, taking over a socket file left by a daemon
+ * that is gone, but not the one of a daemon still running */
+static error serve_bind(int fd, struct sockaddr_un *addr, const char *socket_path) {
+  int probe;
+
+  if (!bind(fd, (struct sockaddr *) addr, sizeof(*addr)))
+    return SUCCESS;
+
+  probe = errno == EADDRINUSE ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+
+  if (probe >= 0 && !connect(probe, (struct sockaddr *) addr, sizeof(*addr))) {
+    errorf("already serving on %s\n", socket_path);
+    close(probe);
+    return ERROR_CANT_WRITE;
+  }
+
+  if (probe >= 0) {
+    close(probe);
+    unlink(socket_path);
+  }
+
+  if (probe < 0 || bind(fd, (struct sockaddr *) addr, sizeof(*addr))) {
+    errorf("could not bind socket: %s\n", socket_path);
+    return ERROR_CANT_WRITE;
+  }
+
+  return SUCCESS;
+}
+
+/* Create the listening socket, accessible to the owner only */
+static error serve_listen(const char *socket_path, int *fd) {
+  struct sockaddr_un addr;
+  mode_t mask;
+  error err;
+
+  if (!serve_socket_addr(&addr, socket_path))
+    return ERROR_CANT_WRITE;
+
+  if ((*fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    errorf("could not create socket: %s\n", socket_path);
+    return ERROR_CANT_WRITE;
+  }
+
+  mask = umask(0177);
+  err = serve_bind(*fd, &addr, socket_path);
+  umask(mask);
+
+  if (err) {
+    close(*fd);
+    return err;
+  }
+
+  if (listen(*fd, SOMAXCONN)) {
+    errorf("could not listen on socket: %s\n", socket_path);
+    close(*fd);
+    unlink(socket_path);
+    return ERROR_CANT_WRITE;
+  }
+
+  return SUCCESS;
+}
+
+error serve(const char *socket_path, const cache_t *cache, serve_build_fn build) {
+  struct sigaction sa;
+  pthread_attr_t attr;
+  pthread_t thread;
+  serve_conn_t *conn;
+  int fd, conn_fd;
+  error err;
+
+  if ((err = serve_listen(socket_path, &fd)))
+    return err;
+
+  /* Clients going away in the middle of a reply are not a problem */
+  memset(&sa, 0x0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  serve_socket_path = socket_path;
+  sa.sa_handler = serve_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  printf("Serving on %s\n", socket_path);
+  fflush(stdout);
+
+  for (;;) {
+    if ((conn_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      errorf("could not accept connection on %s\n", socket_path);
+      err = ERROR_CANT_READ;
+      break;
+    }
+
+    if (!serve_peer_allowed(conn_fd)) {
+      dprintf(conn_fd,
+              "error: only builds of the user running the daemon are served\nstatus %d\n",
+              ERROR_CANT_READ);
+      close(conn_fd);
+      continue;
+    }
+
+    if (!(conn = malloc(sizeof(*conn)))) {
+      close(conn_fd);
+      continue;
+    }
+
+    conn->fd = conn_fd;
+    conn->cache = cache;
+    conn->build = build;
+
+    /* Handle the request right away if there's no thread for it */
+    if (pthread_create(&thread, &attr, serve_connection, conn))
+      serve_connection(conn);
+  }
+
+  pthread_attr_destroy(&attr);
+  close(fd);
+  unlink(socket_path);
+
+  return err;
+}
+
+static bool send_request(FILE *out, const serve_request_t *req) {
+  fprintf(out, "arch %s\n", req->zynqmp ? "zynqmp" : "zynq");
+  fprintf(out, "jobs %u\n", req->jobs);
+  fprintf(out, "cwd %s\n", req->cwd);
+  fprintf(out, "output %s\n", req->bin_filename);
+
+  if (req->bif_filename) {
+    fprintf(out, "bif %s\n", req->bif_filename);
+  } else {
+    fprintf(out, "text %zu\n", req->bif_len);
+    fwrite(req->bif_text, 1, req->bif_len, out);
+  }
+
+  fprintf(out, "end\n");
+
+  return !fflush(out) && !ferror(out);
+}
+
+error serve_send_request(const char *socket_path, const serve_request_t *req) {
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  FILE *in = NULL, *out = NULL;
+  char *line = NULL;
+  size_t cap = 0;
+  long status = -1;
+  int fd, out_fd;
+
+  /* The request is made of lines */
+  if (strchr(req->cwd, '\n') || strchr(req->bin_filename, '\n') ||
+      (req->bif_filename && strchr(req->bif_filename, '\n'))) {
+    errorf("unsupported file name\n");
+    return ERROR_CANT_READ;
+  }
+
+  if (!serve_socket_addr(&addr, socket_path))
+    return ERROR_CANT_READ;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+      connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    errorf("could not connect to %s\n", socket_path);
+    if (fd >= 0)
+      close(fd);
+    return ERROR_CANT_READ;
+  }
+
+  /* A refused request is answered without being read, the reply is
+   * still there to be read after the send fails */
+  memset(&sa, 0x0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  if ((out_fd = dup(fd)) >= 0 && (out = fdopen(out_fd, "w")) && (in = fdopen(fd, "r"))) {
+    if (!send_request(out, req))
+      shutdown(fd, SHUT_WR);
+
+    while (getline(&line, &cap, in) > 0) {
+      if (!strncmp(line, "status ", 7)) {
+        status = strtol(line + 7, NULL, 10);
+        break;
+      }
+      /* Report the errors of the daemon as ours */
+      errorf("%s", strncmp(line, "error: ", 7) ? line : line + 7);
+    }
+  }
+
+  free(line);
+  if (out)
+    fclose(out);
+  else if (out_fd >= 0)
+    close(out_fd);
+  if (in)
+    fclose(in);
+  else
+    close(fd);
+
+  if (status < 0) {
+    errorf("no reply from %s\n", socket_path);
+    return ERROR_CANT_READ;
+  }
+
+  return status;
+}
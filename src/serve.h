@@ -0,0 +1,37 @@
+#ifndef MKBOOTIMAGE_SERVE_H
+#define MKBOOTIMAGE_SERVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <cache.h>
+#include <common.h>
+
+/* A single image to be built by the daemon. The BIF and output paths
+ * are absolute, the file names inside of the BIF are relative to cwd,
+ * the working directory of the client. */
+typedef struct serve_request_t {
+  bool zynqmp;
+  unsigned int jobs;
+  char *cwd;
+  char *bin_filename;
+  char *bif_filename; /* NULL if the BIF is given as text */
+  char *bif_text;
+  size_t bif_len;
+} serve_request_t;
+
+/* Builds the requested image, called by many connection threads at once
+ * with the errors of the thread going back to the client */
+typedef error (*serve_build_fn)(const serve_request_t *req, const cache_t *cache);
+
+/* Accept build requests on a Unix socket until killed */
+error serve(const char *socket_path, const cache_t *cache, serve_build_fn build);
+
+/* Have the daemon build an image and return the result of the build,
+ * the errors it reports are printed as if they were ours */
+error serve_send_request(const char *socket_path, const serve_request_t *req);
+
+/* Put path into dst, prefixed with dir unless it's absolute */
+bool serve_join_path(char *dst, size_t n, const char *dir, const char *path);
+
+#endif
@@ -0,0 +1,74 @@
+/* Compares every summing kernel the CPU supports with a plain sum,
+ * over buffers of all lengths up to a few kernel blocks starting at
+ * unaligned addresses:
+ *
+ *   kernels
+ *
+ * The names of the kernels checked are printed, the exit code is
+ * non-zero if any of them gives a different sum. */
+
+#include <stdlib.h>
+
+/* The kernels are private to the module */
+#include <checksum.c>
+
+#define MAX_WORDS  (3 * 32 + 31)
+#define MAX_OFFSET 7
+
+typedef struct kernel_t {
+  const char *name;
+  sum_words_fn fn;
+  int supported;
+} kernel_t;
+
+int main(void) {
+  uint8_t buf[MAX_WORDS * 4 + MAX_OFFSET];
+  size_t k, off, words, i;
+  uint32_t expected;
+  int failed = 0;
+
+#ifdef CHECKSUM_X86
+  __builtin_cpu_init();
+#endif
+
+  kernel_t kernels[] = {
+    {"scalar", sum_words_scalar, 1},
+#ifdef CHECKSUM_X86
+    {"sse2", sum_words_sse2, __builtin_cpu_supports("sse2")},
+    {"avx2", sum_words_avx2, __builtin_cpu_supports("avx2")},
+    {"avx512", sum_words_avx512, __builtin_cpu_supports("avx512f")},
+#endif
+  };
+
+  /* Words close to the wrap around make the carries show up */
+  srand(1);
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 5 ? 0xff : rand();
+
+  for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (!kernels[k].supported)
+      continue;
+
+    for (off = 0; off <= MAX_OFFSET; off++) {
+      for (words = 0; words <= MAX_WORDS; words++) {
+        /* The words put together byte by byte, as little endian */
+        expected = 0;
+        for (i = 0; i < words; i++)
+          expected += (uint32_t) buf[off + 4 * i] | (uint32_t) buf[off + 4 * i + 1] << 8 |
+                      (uint32_t) buf[off + 4 * i + 2] << 16 | (uint32_t) buf[off + 4 * i + 3] << 24;
+
+        /* checksum_words goes through the kernel picked at runtime */
+        if (kernels[k].fn(buf + off, words) == expected &&
+            checksum_words(buf + off, words) == ~expected)
+          continue;
+
+        printf("%s: wrong sum of %zu words at offset %zu\n", kernels[k].name, words, off);
+        failed = 1;
+      }
+    }
+
+    printf("%s\n", kernels[k].name);
+  }
+
+  return failed;
+}
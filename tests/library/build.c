@@ -0,0 +1,121 @@
+/* Builds an image with libmkbootimage out of files read to memory:
+ *
+ *   build [-u] <input_bif_file> <output_bin_file> [NAME=FILE...]
+ *
+ * The BIF is passed as text, every FILE is given as the payload of the
+ * nodes named NAME, alternately as a buffer and as a descriptor. The
+ * image is built both into a buffer and through a write callback, the
+ * results have to be the same. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libmkbootimage.h>
+
+static char *read_all(const char *fname, size_t *len) {
+  struct stat st;
+  char *data;
+  FILE *f;
+
+  if (!(f = fopen(fname, "r")) || fstat(fileno(f), &st))
+    return NULL;
+
+  *len = st.st_size;
+  if ((data = malloc(*len + 1)) && fread(data, 1, *len, f) != *len) {
+    free(data);
+    data = NULL;
+  }
+
+  fclose(f);
+  return data;
+}
+
+static void report(void *arg, const char *msg) {
+  fprintf(stderr, "%s: %s\n", (char *) arg, msg);
+}
+
+static error write_file(void *arg, const void *data, size_t len) {
+  return fwrite(data, 1, len, arg) == len ? SUCCESS : ERROR_CANT_WRITE;
+}
+
+int main(int argc, char *argv[]) {
+  mkbootimage_t *mkbi;
+  char *bif, *img, *streamed, *name, *file, *bufs[argc];
+  size_t bif_len, img_len, streamed_len;
+  int i, n, fd, zynqmp = 0, nbufs = 0;
+  FILE *out;
+  error err;
+
+  if (argc > 1 && !strcmp(argv[1], "-u"))
+    zynqmp = 1;
+  if (argc < 3 + zynqmp)
+    return EXIT_FAILURE;
+
+  if (!(mkbi = mkbootimage_create(zynqmp)))
+    return ERROR_NOMEM;
+  mkbootimage_set_error_fn(mkbi, report, "libmkbootimage");
+  mkbootimage_set_jobs(mkbi, 2);
+
+  if (!(bif = read_all(argv[1 + zynqmp], &bif_len)))
+    return ERROR_BIF_NOFILE;
+  if ((err = mkbootimage_parse_bif(mkbi, bif, bif_len)))
+    return err;
+
+  for (i = 3 + zynqmp, n = 0; i < argc; i++, n++) {
+    name = argv[i];
+    if (!(file = strchr(name, '=')))
+      return EXIT_FAILURE;
+    *file++ = '\0';
+
+    if (n % 2 == 0) {
+      if (!(bufs[nbufs] = read_all(file, &img_len)))
+        return ERROR_CANT_READ;
+      err = mkbootimage_add_buffer(mkbi, name, bufs[nbufs++], img_len);
+    } else {
+      if ((fd = open(file, O_RDONLY)) < 0)
+        return ERROR_CANT_READ;
+      err = mkbootimage_add_fd(mkbi, name, fd);
+      close(fd);
+    }
+
+    if (err)
+      return err;
+  }
+
+  /* Ask for the size first, the buffer starts with garbage */
+  if ((err = mkbootimage_build(mkbi, NULL, 0, &img_len)) != ERROR_BOOTROM_NOMEM)
+    return err ? err : EXIT_FAILURE;
+  if (!(img = malloc(img_len)))
+    return ERROR_NOMEM;
+  memset(img, 0xaa, img_len);
+  if ((err = mkbootimage_build(mkbi, img, img_len, &img_len)))
+    return err;
+
+  if (!(out = open_memstream(&streamed, &streamed_len)))
+    return ERROR_NOMEM;
+  if ((err = mkbootimage_build_to(mkbi, write_file, out)))
+    return err;
+  fclose(out);
+
+  if (streamed_len != img_len || memcmp(img, streamed, img_len)) {
+    fprintf(stderr, "images built into a buffer and streamed differ\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!(out = fopen(argv[2 + zynqmp], "w")) || fwrite(img, 1, img_len, out) != img_len)
+    return ERROR_CANT_WRITE;
+  fclose(out);
+
+  mkbootimage_destroy(mkbi);
+  for (i = 0; i < nbufs; i++)
+    free(bufs[i]);
+  free(streamed);
+  free(img);
+  free(bif);
+
+  return EXIT_SUCCESS;
+}
@@ -32,6 +32,19 @@ failtest() {
   printf "${RED}fail${RESET}: %s\n" "$1"
 }
 
+# Write a BIF putting the given files and then the ones listed
+# in extraction/files in the image
+writebif() {
+  bif=$1
+  shift
+
+  printf "the_rom_image:{" > $bif
+  for file in "$@" $(cat $EXTRACT/files); do
+    printf "%s " $file >> $bif
+  done
+  printf "}" >> $bif
+}
+
 # The routine implements a test pair. The kind of test
 # is determined by the $1 argument.
 #
@@ -62,11 +75,7 @@ testextraction() {
   BIN=$EXTRACT/boot.bin
   TMP=$EXTRACT/tmp
 
-  printf "the_rom_image:{" > $BIF
-  for file in $(cat $EXTRACT/files); do
-    printf "%s " $file >> $BIF
-  done
-  printf "}" >> $BIF
+  writebif $BIF
 
   # Create a dummy boot image and unpack it
   printf "\nLogs for image extraction:\n" >> $LOG
@@ -93,6 +102,197 @@ testextraction() {
   cd $DIR
 }
 
+# Check if images loaded in parallel are the same as the serial ones
+testjobs() {
+  BIF=$EXTRACT/boot.bif
+  BIN=$EXTRACT/boot.bin
+
+  writebif $BIF
+
+  printf "\nLogs for parallel image generation:\n" >> $LOG
+  $DIR/mkbootimage -u $BIF $BIN 1> /dev/null 2>> $LOG
+
+  for jobs in 2 4; do
+    $DIR/mkbootimage -u -j $jobs $BIF $BIN.$jobs 1> /dev/null 2>> $LOG
+
+    if cmp $BIN $BIN.$jobs 1> /dev/null 2>> $LOG; then
+      passtest "jobs $jobs"
+    else
+      failtest "jobs $jobs"
+    fi
+    rm -f $BIN.$jobs
+  done
+
+  # Extract the files back with a few jobs
+  mkdir $EXTRACT/tmp
+  cd $EXTRACT/tmp
+  $DIR/exbootimage -ux -j 4 $BIN 1> /dev/null 2>> $LOG
+
+  for file in $(cat $EXTRACT/files); do
+    if diff $file $EXTRACT/tmp/$(basename $file) 1> /dev/null 2>> $LOG; then
+      passtest "jobs 4 $(basename $file) extraction"
+    else
+      failtest "jobs 4 $(basename $file) extraction"
+    fi
+  done
+
+  cd $DIR
+  rm -rf $EXTRACT/tmp
+  rm $BIF $BIN
+}
+
+# Check if images built with a cold and a warm payload cache are the
+# same as the ones built without it, the tool itself is the ELF input
+testcache() {
+  BIF=$EXTRACT/boot.bif
+  BIN=$EXTRACT/boot.bin
+  CACHE=$EXTRACT/cache
+
+  writebif $BIF $DIR/exbootimage
+
+  printf "\nLogs for cached image generation:\n" >> $LOG
+  $DIR/mkbootimage -u $BIF $BIN 1> /dev/null 2>> $LOG
+
+  for run in cold warm; do
+    $DIR/mkbootimage -u -c $CACHE $BIF $BIN.$run 1> /dev/null 2>> $LOG
+
+    if cmp $BIN $BIN.$run 1> /dev/null 2>> $LOG; then
+      passtest "cache $run"
+    else
+      failtest "cache $run"
+    fi
+    rm -f $BIN.$run
+  done
+
+  rm -rf $CACHE
+  rm $BIF $BIN
+}
+
+# Patch partitions of an existing image in place and compare the result
+# with an image built from scratch out of the same files
+testpatch() {
+  TMP=$TESTS/patch
+  BIF=$TMP/boot.bif
+  BIN=$TMP/boot.bin
+
+  mkdir $TMP
+  printf "the_rom_image:{" > $BIF
+  for file in $(cat $EXTRACT/files); do
+    cp $file $TMP/
+    printf "%s " $TMP/$(basename $file) >> $BIF
+  done
+  printf "}" >> $BIF
+
+  printf "\nLogs for image patching:\n" >> $LOG
+  $DIR/mkbootimage -u $BIF $BIN 1> /dev/null 2>> $LOG
+
+  # Replacing a partition with the same file changes nothing
+  cp $BIN $BIN.same
+  $DIR/mkbootimage -u -P $BIN.same -r LICENSE=$TMP/LICENSE 1> /dev/null 2>> $LOG
+  if cmp $BIN $BIN.same 1> /dev/null 2>> $LOG; then
+    passtest "patch same file"
+  else
+    failtest "patch same file"
+  fi
+
+  # A partition that doesn't fit its slot is refused
+  if $DIR/mkbootimage -u -P $BIN.same -r README.md=$DIR/mkbootimage 1> /dev/null 2>> $LOG; then
+    failtest "patch too large file"
+  else
+    passtest "patch too large file"
+  fi
+
+  # Nothing is replaced if one of the replacements is refused
+  printf "small" > $TMP/small
+  cp $BIN $BIN.failed
+  if ! $DIR/mkbootimage -u -P $BIN.failed -r LICENSE=$TMP/small \
+       -r README.md=$DIR/mkbootimage 1> /dev/null 2>> $LOG &&
+     cmp $BIN $BIN.failed 1> /dev/null 2>> $LOG; then
+    passtest "patch refused replacement"
+  else
+    failtest "patch refused replacement"
+  fi
+
+  # Nor if one fails while loading, after the image has grown
+  if command -v xz > /dev/null; then
+    head -c 600 $DIR/exbootimage | xz -c > $TMP/broken.xz
+    printf '\377\377\377\377' | dd of=$TMP/broken.xz bs=1 seek=300 conv=notrunc 2> /dev/null
+    if ! $DIR/mkbootimage -u -P $BIN.failed -r Makefile=$DIR/mkbootimage \
+         -r LICENSE=$TMP/broken.xz 1> /dev/null 2>> $LOG &&
+       cmp $BIN $BIN.failed 1> /dev/null 2>> $LOG; then
+      passtest "patch failed replacement"
+    else
+      failtest "patch failed replacement"
+    fi
+  fi
+
+  # The last partition can change the image size
+  printf "patched" > $TMP/new
+  $DIR/mkbootimage -u -P $BIN -r Makefile=$TMP/new 1> /dev/null 2>> $LOG
+  cp $TMP/new $TMP/Makefile
+  $DIR/mkbootimage -u $BIF $BIN.new 1> /dev/null 2>> $LOG
+  if cmp $BIN $BIN.new 1> /dev/null 2>> $LOG; then
+    passtest "patch last partition"
+  else
+    failtest "patch last partition"
+  fi
+
+  rm -rf $TMP
+}
+
+# Build images with 10000 partitions within bounded time and memory
+testscale() {
+  TMP=$TESTS/scale
+  BIF=$TMP/boot.bif
+  BIN=$TMP/boot.bin
+
+  mkdir $TMP
+  printf "scale" > $TMP/blob.bin
+
+  printf "the_rom_image:{" > $BIF
+  i=0
+  while [ $i -lt 10000 ]; do
+    printf "%s\n" $TMP/blob.bin
+    i=$(expr $i + 1)
+  done >> $BIF
+  printf "}" >> $BIF
+
+  for arch in zynq zynqmp; do
+    printf "\nLogs for 10000 partitions ($arch):\n" >> $LOG
+
+    flag=""
+    [ $arch = zynqmp ] && flag="-u"
+
+    # 60 seconds and 512MB of address space are plenty for this
+    if (ulimit -v 524288; timeout 60 $DIR/mkbootimage $flag $BIF $BIN) \
+         1> /dev/null 2>> $LOG &&
+       [ $($DIR/exbootimage $flag -l $BIN 2>> $LOG | grep -c blob.bin) = 10000 ]; then
+      passtest "10000 partitions ($arch)"
+    else
+      failtest "10000 partitions ($arch)"
+    fi
+    rm -f $BIN
+  done
+
+  # Strings with escapes take their own length only
+  printf "the_rom_image:{" > $BIF
+  i=0
+  while [ $i -lt 10000 ]; do
+    printf '"dir\\"x/blob.bin"\n'
+    i=$(expr $i + 1)
+  done >> $BIF
+  printf "}" >> $BIF
+
+  printf "\nLogs for 10000 escaped strings:\n" >> $LOG
+  if (ulimit -v 131072; $DIR/mkbootimage -p $BIF) 1> /dev/null 2>> $LOG; then
+    passtest "10000 escaped strings"
+  else
+    failtest "10000 escaped strings"
+  fi
+
+  rm -rf $TMP
+}
+
 # Check if wrong offsets are detected properly
 testoffseterrors() {
   for file in $OFFSETS/*; do
@@ -111,6 +311,416 @@ testoffseterrors() {
   done
 }
 
+# Check if the JSON output is a single line mentioning every partition
+# and if it stays a complete document when the image is broken
+testjson() {
+  printf "\nLogs for JSON output:\n" >> $LOG
+
+  out=$($DIR/exbootimage -F jsonl -ld $OFFSETS/boot.bin 2>> $LOG)
+  ok=$([ $? = 0 ] && [ $(printf "%s\n" "$out" | wc -l) = 1 ] && echo 1)
+
+  for name in $($DIR/exbootimage -l $OFFSETS/boot.bin 2>> $LOG); do
+    printf "%s" "$out" | grep -q "{\"name\":\"$name\"" || ok=
+  done
+
+  if [ -n "$ok" ]; then
+    passtest "json description"
+  else
+    failtest "json description"
+  fi
+
+  out=$($DIR/exbootimage -F jsonl -ld $OFFSETS/bad_1.bin 2>> $LOG)
+  if [ $? != 0 ] && [ "${out%\}}" != "$out" ]; then
+    passtest "json with wrong offsets"
+  else
+    failtest "json with wrong offsets"
+  fi
+}
+
+# Build a few images at once from a manifest and compare them with the
+# ones built separately, a broken entry must not stop the other ones
+testbatch() {
+  BIF=$EXTRACT/boot.bif
+  BIN=$EXTRACT/boot.bin
+  LIST=$EXTRACT/batch
+
+  writebif $BIF $DIR/exbootimage
+
+  printf "\nLogs for batch image generation:\n" >> $LOG
+  $DIR/mkbootimage -u $BIF $BIN 1> /dev/null 2>> $LOG
+
+  printf "# two images out of the same inputs\n" > $LIST
+  printf -- "-u %s %s.1\n-u %s %s.2\n" $BIF $BIN $BIF $BIN >> $LIST
+  printf -- "-u %s.missing %s.3\n" $BIF $BIN >> $LIST
+
+  if $DIR/mkbootimage -j 4 -b $LIST 1> /dev/null 2>> $LOG; then
+    failtest "batch with a missing file"
+  else
+    passtest "batch with a missing file"
+  fi
+
+  for run in 1 2; do
+    if cmp $BIN $BIN.$run 1> /dev/null 2>> $LOG; then
+      passtest "batch image $run"
+    else
+      failtest "batch image $run"
+    fi
+    rm -f $BIN.$run
+  done
+
+  rm -f $BIN.3
+  rm $LIST $BIF $BIN
+}
+
+# Build images through a daemon and compare them with the ones built
+# directly, errors have to come back with the same exit code
+testserve() {
+  BIF=$EXTRACT/boot.bif
+  BIN=$EXTRACT/boot.bin
+  SOCK=$EXTRACT/serve.sock
+
+  writebif $BIF $DIR/exbootimage
+
+  printf "\nLogs for images built by a daemon:\n" >> $LOG
+  $DIR/mkbootimage -u $BIF $BIN 1> /dev/null 2>> $LOG
+
+  $DIR/mkbootimage --serve $SOCK 1> /dev/null 2>> $LOG &
+  SERVER=$!
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S $SOCK ] && break
+    sleep 0.1
+  done
+
+  for run in cold warm; do
+    $DIR/mkbootimage -u -j 2 -C $SOCK $BIF $BIN.$run 1> /dev/null 2>> $LOG
+
+    if cmp $BIN $BIN.$run 1> /dev/null 2>> $LOG; then
+      passtest "serve $run"
+    else
+      failtest "serve $run"
+    fi
+    rm -f $BIN.$run
+  done
+
+  $DIR/mkbootimage -u -C $SOCK - $BIN.text < $BIF 1> /dev/null 2>> $LOG
+  if cmp $BIN $BIN.text 1> /dev/null 2>> $LOG; then
+    passtest "serve bif text"
+  else
+    failtest "serve bif text"
+  fi
+  rm -f $BIN.text
+
+  $DIR/mkbootimage -u $BIF.missing $BIN.err 1> /dev/null 2>> $LOG
+  expected=$?
+  $DIR/mkbootimage -u -C $SOCK $BIF.missing $BIN.err 1> /dev/null 2>> $LOG
+  if [ $? = $expected ] && [ $expected != 0 ]; then
+    passtest "serve error"
+  else
+    failtest "serve error"
+  fi
+
+  if [ "$(stat -c %a $SOCK)" = 600 ]; then
+    passtest "serve socket mode"
+  else
+    failtest "serve socket mode"
+  fi
+
+  kill $SERVER
+  wait $SERVER
+  rm $BIF $BIN
+}
+
+# Build an image through the library out of payloads held in memory and
+# compare it with the one built by the tool, errors go to a callback
+testlibrary() {
+  TMP=$TESTS/library/tmp
+  BIF=$TMP/boot.bif
+  BIN=$TMP/boot.bin
+
+  mkdir $TMP
+  printf "\nLogs for the library:\n" >> $LOG
+  if ! ${CC:-cc} -I$DIR/src -o $TMP/build $TESTS/library/build.c $DIR/libmkbootimage.a \
+    $LDFLAGS $LDLIBS -pthread 2>> $LOG; then
+    failtest "library build"
+    rm -rf $TMP
+    return
+  fi
+
+  writebif $BIF $DIR/exbootimage
+  printf "the_rom_image:{payload/exbootimage " > $BIF.lib
+  payloads="payload/exbootimage=$DIR/exbootimage"
+  for file in $(cat $EXTRACT/files); do
+    printf "payload/%s " $(basename $file) >> $BIF.lib
+    payloads="$payloads payload/$(basename $file)=$file"
+  done
+  printf "}" >> $BIF.lib
+
+  $DIR/mkbootimage -u $BIF $BIN 1> /dev/null 2>> $LOG
+  $TMP/build -u $BIF.lib $BIN.lib $payloads 2>> $LOG
+  if cmp $BIN $BIN.lib 1> /dev/null 2>> $LOG; then
+    passtest "library image"
+  else
+    failtest "library image"
+  fi
+
+  # Without the payloads the files aren't there
+  if ! $TMP/build -u $BIF.lib $BIN.lib 2> $TMP/errors &&
+    grep -q "^libmkbootimage: could not open file" $TMP/errors; then
+    passtest "library errors"
+  else
+    failtest "library errors"
+  fi
+  cat $TMP/errors >> $LOG
+
+  rm -rf $TMP
+}
+
+# Build an ELF file with its data far away from its code, which should
+# get a partition for each instead of a single one padded with the gap
+testsplit() {
+  TMP=$TESTS/split
+  ELF=$TMP/sparse.elf
+  BIN=$TMP/boot.bin
+
+  mkdir $TMP
+  printf "\nLogs for split ELF files:\n" >> $LOG
+  printf "int data[64] = {1};\nvoid _start(void) { for (;;) data[1]++; }\n" > $TMP/sparse.c
+  if ! ${CC:-cc} -nostdlib -static -fno-pie -no-pie -Wl,-Ttext=0x100000 \
+    -Wl,--section-start=.data=0x400000 -o $ELF $TMP/sparse.c 2>> $LOG; then
+    failtest "split ELF build"
+    rm -rf $TMP
+    return
+  fi
+
+  for arch in zynq zynqmp; do
+    flag=""
+    [ $arch = zynqmp ] && flag="-u"
+
+    printf "the_rom_image:{[split_gap=0x100000]%s}" $ELF > $TMP/split.bif
+    printf "the_rom_image:{%s}" $ELF > $TMP/whole.bif
+
+    mkdir $TMP/split $TMP/whole
+    $DIR/mkbootimage $flag $TMP/split.bif $BIN 1> /dev/null 2>> $LOG
+    split=$($DIR/exbootimage $flag -p $BIN 2>> $LOG | grep -c "^sparse.elf:")
+    size=$(wc -c < $BIN)
+    (cd $TMP/split && $DIR/exbootimage $flag -x $BIN 1> /dev/null 2>> $LOG)
+    $DIR/mkbootimage $flag $TMP/whole.bif $BIN 1> /dev/null 2>> $LOG
+    whole=$($DIR/exbootimage $flag -p $BIN 2>> $LOG | grep -c "^sparse.elf:")
+    (cd $TMP/whole && $DIR/exbootimage $flag -x $BIN 1> /dev/null 2>> $LOG)
+
+    if [ "$split" = 2 ] && [ "$whole" = 1 ] && [ $size -lt 65536 ]; then
+      passtest "split ELF ($arch)"
+    else
+      failtest "split ELF ($arch)"
+    fi
+
+    if cmp $TMP/split/sparse.elf $TMP/whole/sparse.elf 1> /dev/null 2>> $LOG; then
+      passtest "split ELF extraction ($arch)"
+    else
+      failtest "split ELF extraction ($arch)"
+    fi
+    rm -rf $TMP/split $TMP/whole
+  done
+
+  rm -rf $TMP
+}
+
+# Compare the SIMD checksum kernels with a plain word sum
+testchecksum() {
+  TMP=$TESTS/checksum/tmp
+
+  mkdir $TMP
+  printf "\nLogs for checksum kernels:\n" >> $LOG
+  if ! ${CC:-cc} -I$DIR/src -o $TMP/kernels $TESTS/checksum/kernels.c -pthread 2>> $LOG; then
+    failtest "checksum kernels build"
+    rm -rf $TMP
+    return
+  fi
+
+  out=$($TMP/kernels 2>> $LOG)
+  ret=$?
+  printf "%s\n" "$out" >> $LOG
+
+  # Every kernel checked is listed, after the sums it got wrong
+  for kernel in $(printf "%s\n" "$out" | grep -v " "); do
+    if printf "%s\n" "$out" | grep -q "^$kernel: "; then
+      failtest "checksum kernel $kernel"
+    else
+      passtest "checksum kernel $kernel"
+    fi
+  done
+
+  if [ $ret != 0 ] && ! printf "%s\n" "$out" | grep -q ": wrong"; then
+    failtest "checksum kernels"
+  fi
+
+  rm -rf $TMP
+}
+
+# Build an image from compressed copies of the inputs, which should be
+# the same as the one built from the inputs themselves
+testcompressed() {
+  TMP=$TESTS/compressed
+  FILES="README.md LICENSE Makefile exbootimage"
+
+  mkdir -p $TMP/plain
+  printf "\nLogs for compressed files:\n" >> $LOG
+  printf "the_rom_image:{" > $TMP/boot.bif
+  for file in $FILES; do
+    cp $DIR/$file $TMP/plain/
+    printf "%s " $file >> $TMP/boot.bif
+  done
+  printf "}" >> $TMP/boot.bif
+
+  (cd $TMP/plain && $DIR/mkbootimage -u $TMP/boot.bif $TMP/plain.bin) 1> /dev/null 2>> $LOG
+
+  for tool in gzip xz zstd; do
+    if ! command -v $tool > /dev/null; then
+      continue
+    fi
+
+    mkdir $TMP/$tool
+    for file in $FILES; do
+      $tool -c $DIR/$file > $TMP/$tool/$file 2>> $LOG
+    done
+
+    (cd $TMP/$tool && $DIR/mkbootimage -u $TMP/boot.bif $TMP/$tool.bin) 1> /dev/null \
+      2> $TMP/errors
+    cat $TMP/errors >> $LOG
+
+    if grep -q "does not support" $TMP/errors; then
+      continue
+    fi
+
+    if cmp -s $TMP/plain.bin $TMP/$tool.bin; then
+      passtest "compressed inputs ($tool)"
+    else
+      failtest "compressed inputs ($tool)"
+    fi
+  done
+
+  rm -rf $TMP
+}
+
+# Verify a good image and broken copies of it, which should fail with
+# a different exit code for each kind of problem
+testverify() {
+  TMP=$TESTS/verify
+
+  mkdir $TMP
+  printf "\nLogs for image verification:\n" >> $LOG
+  cp $OFFSETS/boot.bin $TMP/good.bin
+  cp $OFFSETS/boot.bin $TMP/checksum.bin
+  printf '\001' | dd of=$TMP/checksum.bin bs=1 seek=44 conv=notrunc 2> /dev/null
+  head -c 3200 $OFFSETS/boot.bin > $TMP/short.bin
+
+  $DIR/exbootimage -u -v $TMP/good.bin 1> /dev/null 2>> $LOG
+  good=$?
+  $DIR/exbootimage -u -v $TMP/checksum.bin 1> /dev/null 2>> $LOG
+  checksum=$?
+  $DIR/exbootimage -u -v $TMP/short.bin 1> /dev/null 2>> $LOG
+  short=$?
+
+  if [ $good = 0 ] && [ $checksum != 0 ] && [ $short != 0 ] && [ $checksum != $short ]; then
+    passtest "image verification"
+  else
+    failtest "image verification"
+  fi
+
+  out=$($DIR/exbootimage -u -v -j 4 $TMP/good.bin $TMP/checksum.bin $TMP/short.bin 2>> $LOG)
+  ret=$?
+  out=$(printf "%s" "$out" | cut -d' ' -f2 | tr '\n' ' ')
+  if [ $ret = $checksum ] && [ "$out" = "OK FAILED FAILED " ]; then
+    passtest "parallel image verification"
+  else
+    failtest "parallel image verification"
+  fi
+
+  # The data isn't covered by the headers, only its checksums tell the change
+  cp $TMP/good.bin $TMP/data.bin
+  printf '\001' | dd of=$TMP/data.bin bs=1 seek=$(expr $(wc -c < $TMP/data.bin) - 4) \
+    conv=notrunc 2> /dev/null
+  $DIR/exbootimage -u -vp $TMP/good.bin > $TMP/good.sums 2>> $LOG
+  $DIR/exbootimage -u -vp $TMP/data.bin > $TMP/data.sums 2>> $LOG
+  ret=$?
+  parts=$($DIR/exbootimage -u -l $TMP/good.bin 2>> $LOG | wc -l)
+  if [ $ret = 0 ] && [ $(grep -c "^  " $TMP/good.sums) = $parts ] &&
+     [ "$(tail -n +2 $TMP/good.sums)" != "$(tail -n +2 $TMP/data.sums)" ]; then
+    passtest "partition data checksums"
+  else
+    failtest "partition data checksums"
+  fi
+
+  rm -rf $TMP
+}
+
+# A failed build should leave the previous image in place, outputs
+# which are not regular files should be written without removing them
+testoutput() {
+  TMP=$TESTS/output
+  BIN=$TMP/boot.bin
+
+  mkdir $TMP
+  printf "\nLogs for output files:\n" >> $LOG
+  printf "the_rom_image:{%s}" $DIR/exbootimage > $TMP/boot.bif
+  $DIR/mkbootimage -u $TMP/boot.bif $BIN 1> /dev/null 2>> $LOG
+  cp $BIN $TMP/good.bin
+
+  # The broken data is only found when loading it, after the layout is planned
+  if command -v xz > /dev/null; then
+    head -c 65536 $DIR/exbootimage | xz -c > $TMP/broken.xz
+    printf '\377\377\377\377' | dd of=$TMP/broken.xz bs=1 seek=1024 conv=notrunc 2> /dev/null
+    printf "the_rom_image:{%s}" $TMP/broken.xz > $TMP/broken.bif
+    $DIR/mkbootimage -u $TMP/broken.bif $BIN 1> /dev/null 2> $TMP/errors
+    cat $TMP/errors >> $LOG
+
+    if grep -q "does not support" $TMP/errors; then
+      :
+    elif cmp -s $BIN $TMP/good.bin && [ -z "$(ls $TMP | grep "^boot.bin.")" ]; then
+      passtest "output kept after a failed build"
+    else
+      failtest "output kept after a failed build"
+    fi
+  fi
+
+  if $DIR/mkbootimage -u $TMP/boot.bif /dev/null 1> /dev/null 2>> $LOG && [ -c /dev/null ]; then
+    passtest "output to a device"
+  else
+    failtest "output to a device"
+  fi
+
+  # A partition that can't be written fails the extraction
+  if [ -c /dev/full ]; then
+    mkdir $TMP/full
+    ln -s /dev/full $TMP/full/exbootimage
+    cd $TMP/full
+    if $DIR/exbootimage -fx $BIN 1> /dev/null 2>> $LOG; then
+      failtest "extraction write error"
+    else
+      passtest "extraction write error"
+    fi
+    cd $DIR
+  fi
+
+  # The image is opened once, so it can even come from a pipe
+  mkdir $TMP/file $TMP/pipe
+  cd $TMP/file
+  $DIR/exbootimage -ux $BIN 1> /dev/null 2>> $LOG
+  cd $TMP/pipe
+  mkfifo $TMP/boot.fifo
+  cat $BIN > $TMP/boot.fifo &
+  if $DIR/exbootimage -ux $TMP/boot.fifo 1> /dev/null 2>> $LOG &&
+     cmp $TMP/file/exbootimage $TMP/pipe/exbootimage 1> /dev/null 2>> $LOG; then
+    passtest "extraction from a pipe"
+  else
+    failtest "extraction from a pipe"
+  fi
+  wait
+  cd $DIR
+
+  rm -rf $TMP
+}
+
 # It is encouraged for future tests to be placed here
 # and implemented in an analogous way with the `testparser`
 # test routine, with both negative and positive tests.
@@ -137,7 +747,20 @@ printf "Performed on $(date)\n" > $LOG
 # Perform parser tests
 testparser
 testextraction
+testjobs
+testcache
+testpatch
+testscale
 testoffseterrors
+testjson
+testbatch
+testserve
+testlibrary
+testsplit
+testchecksum
+testcompressed
+testverify
+testoutput
 
 # RESULT INFORMATION -------------------------------------- #
 printf "\npassed: %s\nfailed: %s\n\n" $pass $fail